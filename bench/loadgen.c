@@ -0,0 +1,478 @@
+/*********************************************************************
+** loadgen.c
+** Description: Load generator for otp_enc_d (or otp_dec_d with
+* -a DEC). Runs -c client threads, each with its own persistent
+* connection, for -d seconds, and reports throughput along with the
+* p50/p99/p999 request latency.
+* Closed loop (the default): every client keeps -p requests in flight
+* and sends the next as soon as one finishes.
+* Open loop (-r rate): requests are started on a fixed schedule of
+* rate per second across all clients whether or not earlier ones have
+* finished, and latency is measured from when each request was due, so
+* a stalled daemon shows up in the numbers instead of slowing the
+* schedule down.
+* With -S each client sends through a shared memory ring of -p slots
+* instead of its socket (closed loop only; port must be the daemon's
+* Unix socket), and with -P text is sent
+* packed (see otppack.h).
+* With -A the requests go through the client library instead (see
+* otpasync.h): one handle with -c pooled connections keeps -c * -p
+* jobs in flight, each submitted again from its onComplete callback
+* (closed loop only).
+* Usage: loadgen [-c clients] [-d seconds] [-s size] [-p depth] [-r rate] [-a code] [-S] [-P] [-A] port
+*********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "otpshared.h"
+#include "otpclient.h"
+#include "otpshm.h"
+#include "otppack.h"
+#include "otpasync.h"
+
+// One request slot of a client
+struct loadRequest
+{
+    struct otpRequest req;
+    struct loadClient* client;
+    uint64_t startNs; // when the request was sent (closed loop) or due (open loop)
+    int busy;
+};
+
+// One client thread and the latencies it measured
+struct loadClient
+{
+    pthread_t thread;
+    const char* port;
+    const char* authCode;
+    size_t size;
+    int depth;          // requests in flight, closed loop
+    double rate;        // requests per second for this client, 0 for closed loop
+    double seconds;
+    int shared;         // go through a shared memory ring
+    int packed;         // pack text on the wire
+    char* plaintext;
+    char* key;
+    struct loadRequest slots[OTP_MAX_INFLIGHT];
+    int inflight;
+    uint64_t* latencies; // in ns, one per finished request
+    size_t count;
+    size_t capacity;
+    size_t failed;
+    size_t shed;         // requests a busy daemon turned away
+};
+
+/*********************************************************************
+** nowNs()
+* Returns a monotonic time in nanoseconds.
+*********************************************************************/
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*********************************************************************
+** fail()
+* Reports what went wrong and exits; libotp.a only exports its API,
+* so loadgen can't borrow the programs' error().
+*********************************************************************/
+
+static void fail(const char* what)
+{
+    perror(what);
+    exit(1);
+}
+
+/*********************************************************************
+** recordLatency()
+* Adds one finished request's latency to the client's list.
+*********************************************************************/
+
+static void recordLatency(struct loadClient* client, uint64_t latency)
+{
+    if (client->count == client->capacity)
+    {
+        client->capacity = client->capacity ? client->capacity * 2 : 4096;
+        client->latencies = realloc(client->latencies, client->capacity * sizeof(uint64_t));
+        if (client->latencies == NULL) fail("loadgen: realloc");
+    }
+    client->latencies[client->count++] = latency;
+}
+
+/*********************************************************************
+** loadDone()
+* Request callback: records the request's latency and frees its slot.
+* Requests turned away with BUSY are counted apart from failures and
+* left out of the latencies, which are only for admitted requests.
+*********************************************************************/
+
+static void loadDone(struct otpRequest* req)
+{
+    struct loadRequest* slot = req->userData;
+    struct loadClient* client = slot->client;
+    slot->busy = 0;
+    client->inflight--;
+    if (req->status == OTP_REQ_BUSY)
+    {
+        client->shed++;
+        return;
+    }
+    if (req->status != OTP_REQ_DONE)
+    {
+        client->failed++;
+        return;
+    }
+    recordLatency(client, nowNs() - slot->startNs);
+}
+
+/*********************************************************************
+** startRequest()
+* Sends one request from a free slot, timed from startNs.
+* Returns 0 on success, -1 if no slot is free or the send failed.
+*********************************************************************/
+
+static int startRequest(struct loadClient* client, struct otpConn* conn, uint64_t startNs)
+{
+    int i;
+    for (i = 0; i < OTP_MAX_INFLIGHT; i++)
+    {
+        struct loadRequest* slot = &client->slots[i];
+        if (slot->busy)
+        {
+            continue;
+        }
+        memset(&slot->req, 0, sizeof(slot->req));
+        slot->req.len = client->size;
+        slot->req.onDone = loadDone;
+        slot->req.userData = slot;
+        slot->client = client;
+        slot->startNs = startNs;
+        if (otpBegin(conn, &slot->req) < 0 ||
+            otpQueueData(conn, &slot->req, 0, client->plaintext, client->key, client->size) < 0 ||
+            otpFinish(conn, &slot->req) < 0)
+        {
+            return -1;
+        }
+        slot->busy = 1;
+        client->inflight++;
+        return 0;
+    }
+    return -1;
+}
+
+/*********************************************************************
+** sharedThread()
+* clientThread() for -S: keeps every slot of a shared memory ring busy
+* for the length of the run. Text and key are copied into each slot,
+* as a real client would have to.
+*********************************************************************/
+
+static void* sharedThread(void* arg)
+{
+    struct loadClient* client = arg;
+    struct otpShm shm;
+    uint64_t started[OTP_SHM_MAX_SLOTS];
+    int slots = client->depth < OTP_SHM_MAX_SLOTS ? client->depth : OTP_SHM_MAX_SLOTS;
+    if (otpShmOpen(&shm, "localhost", client->port, client->authCode, slots, client->size) < 0)
+    {
+        client->failed++;
+        return NULL;
+    }
+    uint64_t end = nowNs() + (uint64_t)(client->seconds * 1e9);
+    int running = 1;
+    while (1)
+    {
+        int slot;
+        while (running && (slot = otpShmNext(&shm)) >= 0)
+        {
+            memcpy(otpShmText(&shm, slot), client->plaintext, client->size);
+            memcpy(otpShmKey(&shm, slot), client->key, client->size);
+            started[slot] = nowNs();
+            otpShmSubmit(&shm, client->size);
+        }
+        slot = otpShmWait(&shm, OTP_IO_TIMEOUT_MS);
+        if (slot < 0)
+        {
+            // Nothing left in flight, or the daemon is gone
+            break;
+        }
+        uint64_t t = nowNs();
+        if (otpShmStatus(&shm, slot) == OTP_SHM_OK)
+        {
+            recordLatency(client, t - started[slot]);
+        }
+        else
+        {
+            client->failed++;
+        }
+        otpShmRelease(&shm);
+        running = t < end;
+    }
+    otpShmClose(&shm);
+    return NULL;
+}
+
+/*********************************************************************
+** clientThread()
+* Drives one connection for the length of the run, closed or open
+* loop, then waits for the requests still in flight.
+*********************************************************************/
+
+static void* clientThread(void* arg)
+{
+    struct loadClient* client = arg;
+    struct otpConn conn;
+    if (otpConnect(&conn, "localhost", client->port, client->authCode) < 0)
+    {
+        client->failed++;
+        return NULL;
+    }
+    conn.packed = client->packed;
+    uint64_t start = nowNs();
+    uint64_t end = start + (uint64_t)(client->seconds * 1e9);
+    uint64_t interval = client->rate > 0 ? (uint64_t)(1e9 / client->rate) : 0;
+    uint64_t due = start;
+    while (1)
+    {
+        uint64_t t = nowNs();
+        if (t >= end)
+        {
+            break;
+        }
+        int timeoutMs = -1;
+        if (interval == 0)
+        {
+            while (client->inflight < client->depth && startRequest(client, &conn, nowNs()) == 0);
+        }
+        else
+        {
+            // Start everything that is due, even if it is late
+            while (due <= t && due < end && client->inflight < OTP_MAX_INFLIGHT && startRequest(client, &conn, due) == 0)
+            {
+                due += interval;
+            }
+            timeoutMs = (due > t) ? (int)((due - t) / 1000000) : 0;
+        }
+        if (otpPump(&conn, timeoutMs) < 0)
+        {
+            break;
+        }
+    }
+    while (client->inflight > 0 && otpPump(&conn, -1) == 0);
+    otpDisconnect(&conn);
+    return NULL;
+}
+
+// One job of an -A run
+struct loadJob
+{
+    struct otpJob job;
+    struct loadClient* client;
+    uint64_t startNs;
+};
+
+static uint64_t asyncEndNs; // when -A jobs stop being submitted again
+
+/*********************************************************************
+** asyncDone()
+* onComplete for -A: records the job like loadDone() and sends it
+* again until the run is over. Runs on the library's thread, the only
+* one that touches the client's counters until otpAsyncClose().
+*********************************************************************/
+
+static void asyncDone(struct otpJob* job)
+{
+    struct loadJob* load = job->userData;
+    struct loadClient* client = load->client;
+    uint64_t t = nowNs();
+    if (job->status == OTP_REQ_BUSY)
+    {
+        client->shed++;
+    }
+    else if (job->status != OTP_REQ_DONE)
+    {
+        client->failed++;
+    }
+    else
+    {
+        recordLatency(client, t - load->startNs);
+    }
+    load->startNs = t;
+    if (t < asyncEndNs)
+    {
+        otpAsyncSubmit(job->async, job);
+    }
+}
+
+/*********************************************************************
+** asyncRun()
+* Runs the whole -A load from the calling thread, counted in client:
+* submits connections * depth jobs, lets them resubmit themselves for
+* the length of the run, then closes the handle, which waits for the
+* last ones.
+*********************************************************************/
+
+static void asyncRun(struct loadClient* client, int connections)
+{
+    const char* daemon = client->port;
+    struct otpAsync* async = otpAsyncOpen(&daemon, 1, connections, client->authCode, client->packed);
+    if (async == NULL)
+    {
+        client->failed++;
+        return;
+    }
+    int count = connections * client->depth;
+    struct loadJob* jobs = calloc(count, sizeof(struct loadJob));
+    char* outputs = malloc((size_t)count * client->size);
+    if (jobs == NULL || outputs == NULL) fail("loadgen: malloc");
+    asyncEndNs = nowNs() + (uint64_t)(client->seconds * 1e9);
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        jobs[i].client = client;
+        jobs[i].job.input = client->plaintext;
+        jobs[i].job.key = client->key;
+        jobs[i].job.output = outputs + (size_t)i * client->size;
+        jobs[i].job.len = client->size;
+        jobs[i].job.onComplete = asyncDone;
+        jobs[i].job.userData = &jobs[i];
+        jobs[i].startNs = nowNs();
+        otpAsyncSubmit(async, &jobs[i].job);
+    }
+    usleep((useconds_t)(client->seconds * 1e6));
+    otpAsyncClose(async);
+    free(jobs);
+    free(outputs);
+}
+
+static int compareLatency(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+    int clients = 4;
+    double seconds = 5;
+    size_t size = 1024;
+    int depth = 1;
+    double rate = 0;
+    const char* authCode = "ENC";
+    int shared = 0;
+    int packed = 0;
+    int async = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:d:s:p:r:a:SPA")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c': clients = atoi(optarg); break;
+        case 'd': seconds = atof(optarg); break;
+        case 's': size = strtoull(optarg, NULL, 10); break;
+        case 'p': depth = atoi(optarg); break;
+        case 'r': rate = atof(optarg); break;
+        case 'a': authCode = optarg; break;
+        case 'S': shared = 1; break;
+        case 'P': packed = 1; break;
+        case 'A': async = 1; break;
+        default:
+            fprintf(stderr, "USAGE: %s [-c clients] [-d seconds] [-s size] [-p depth] [-r rate] [-a code] [-S] [-P] [-A] port\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind >= argc || clients < 1 || size == 0 || ((shared || async) && rate > 0) || (shared && async))
+    {
+        fprintf(stderr, "USAGE: %s [-c clients] [-d seconds] [-s size] [-p depth] [-r rate] [-a code] [-S] [-P] [-A] port\n", argv[0]);
+        exit(1);
+    }
+    if (depth < 1) depth = 1;
+    if (depth > OTP_MAX_INFLIGHT) depth = OTP_MAX_INFLIGHT;
+
+    // Every request sends the same text and key; the daemon doesn't care
+    const char charset[] = CHARS;
+    char* plaintext = malloc(size);
+    char* key = malloc(size);
+    if (plaintext == NULL || key == NULL) fail("loadgen: malloc");
+    size_t i;
+    unsigned int seed = 1;
+    for (i = 0; i < size; i++)
+    {
+        plaintext[i] = charset[rand_r(&seed) % 27];
+        key[i] = charset[rand_r(&seed) % 27];
+    }
+
+    // -A runs every connection from one handle, counted as one client
+    int connections = clients;
+    if (async) clients = 1;
+    struct loadClient* all = calloc(clients, sizeof(struct loadClient));
+    if (all == NULL) fail("loadgen: calloc");
+    int c;
+    for (c = 0; c < clients; c++)
+    {
+        all[c].port = argv[optind];
+        all[c].authCode = authCode;
+        all[c].size = size;
+        all[c].depth = depth;
+        all[c].rate = rate / clients;
+        all[c].seconds = seconds;
+        all[c].shared = shared;
+        all[c].packed = packed;
+        all[c].plaintext = plaintext;
+        all[c].key = key;
+        if (!async)
+        {
+            pthread_create(&all[c].thread, NULL, shared ? sharedThread : clientThread, &all[c]);
+        }
+    }
+    if (async)
+    {
+        asyncRun(&all[0], connections);
+    }
+
+    // Gather every latency into one sorted array
+    size_t total = 0, failed = 0, shed = 0;
+    for (c = 0; c < clients; c++)
+    {
+        if (!async)
+        {
+            pthread_join(all[c].thread, NULL);
+        }
+        total += all[c].count;
+        failed += all[c].failed;
+        shed += all[c].shed;
+    }
+    uint64_t* latencies = malloc((total ? total : 1) * sizeof(uint64_t));
+    if (latencies == NULL) fail("loadgen: malloc");
+    size_t n = 0;
+    for (c = 0; c < clients; c++)
+    {
+        memcpy(latencies + n, all[c].latencies, all[c].count * sizeof(uint64_t));
+        n += all[c].count;
+        free(all[c].latencies);
+    }
+    qsort(latencies, total, sizeof(uint64_t), compareLatency);
+
+    printf("mode %s%s%s%s, %d clients, %zu byte requests, %.1f s\n", rate > 0 ? "open loop" : "closed loop", shared ? " over shared memory" : "", async ? " through the client library" : "", packed ? " packed" : "", connections, size, seconds);
+    printf("requests %zu (failed %zu, shed %zu)\n", total, failed, shed);
+    printf("throughput %.0f req/s, %.1f MB/s\n", total / seconds, total * (double)size / seconds / 1e6);
+    if (total > 0)
+    {
+        printf("latency p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+               latencies[total / 2] / 1e3, latencies[total * 99 / 100] / 1e3,
+               latencies[total * 999 / 1000] / 1e3, latencies[total - 1] / 1e3);
+    }
+    free(latencies);
+    free(all);
+    free(plaintext);
+    free(key);
+    return failed ? 1 : 0;
+}
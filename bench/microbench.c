@@ -0,0 +1,261 @@
+/*********************************************************************
+** microbench.c
+** Description: Micro-benchmarks for the hot paths of the one time pad
+* programs: the cipher kernels, validation, packing, reading input
+* files and receiving frames. Each benchmark runs at message sizes from 16 B to
+* 100 MB, repeating until it has run for at least -t seconds, and
+* prints its throughput in GB/s. Give benchmark names to run only
+* those. The cipher kernel can be forced with OTP_ENCODER as usual.
+* Usage: microbench [-t seconds] [benchmark]...
+*********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "otpshared.h"
+#include "otpcipher.h"
+#include "otppool.h"
+#include "otppack.h"
+
+#define MAX_SIZE (100 * 1000 * 1000) // largest message size benchmarked
+#define RECV_FRAME_BODY (4 * 1024 * 1024) // frame size for messages too big for one frame
+
+static const size_t sizes[] = { 16, 256, 4096, 65536, 1 << 20, 16 << 20, MAX_SIZE };
+
+static char* plaintext; // MAX_SIZE random characters from CHARS
+static char* key;
+static char* output;
+static unsigned char* packed; // plaintext packed, for unpack
+static double minSeconds = 0.2;
+
+// One benchmark: runs the operation once on a message of len bytes
+struct benchCase
+{
+    const char* name;
+    void (*setup)(size_t len);    // called before timing each size, may be NULL
+    void (*run)(size_t len);
+    void (*teardown)(size_t len); // called after timing each size, may be NULL
+};
+
+/*********************************************************************
+** now()
+* Returns a monotonic time in seconds.
+*********************************************************************/
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void runEncode(size_t len) { encodeBlock(plaintext, key, output, len, OTP_ENCRYPT); }
+static void runDecode(size_t len) { encodeBlock(plaintext, key, output, len, OTP_DECRYPT); }
+static void runBytes(size_t len) { encodeBytes(plaintext, key, output, len, OTP_ENCRYPT); }
+static void runChecked(size_t len) { encodeChecked(plaintext, key, output, len, OTP_ENCRYPT); }
+static void runParallel(size_t len) { encodeParallel(plaintext, key, output, len, OTP_ENCRYPT, OTP_ALPHABET_TEXT); }
+static void runValidateLen(size_t len) { validateLen(plaintext, len); }
+static void runPack(size_t len) { packSymbols(plaintext, len, (unsigned char*)output); }
+static void setupUnpack(size_t len) { packSymbols(plaintext, len, packed); }
+static void runUnpack(size_t len) { unpackSymbols(packed, packedSize(len), output); }
+
+// validateStr() needs a terminated string
+static void setupValidateStr(size_t len) { plaintext[len] = '\0'; }
+static void runValidateStr(size_t len) { (void)len; validateStr(plaintext); }
+static void teardownValidateStr(size_t len) { plaintext[len] = 'A'; }
+
+// processFile() and mapFile() read a file of the given size, from the page cache
+static char filePath[] = "/tmp/otpbenchXXXXXX";
+
+static void setupFile(size_t len)
+{
+    int fd = mkstemp(filePath);
+    if (fd < 0 || write(fd, plaintext, len) != (ssize_t)len)
+    {
+        perror("microbench: temp file");
+        exit(1);
+    }
+    close(fd);
+}
+
+static void teardownFile(size_t len)
+{
+    (void)len;
+    unlink(filePath);
+    strcpy(filePath, "/tmp/otpbenchXXXXXX");
+}
+
+static void runProcessFile(size_t len)
+{
+    (void)len;
+    FILE* fp = fopen(filePath, "r");
+    free(processFile(fp));
+}
+
+static void runMapFile(size_t len)
+{
+    (void)len;
+    struct otpMapping map;
+    mapFile(filePath, &map);
+    unmapFile(&map);
+}
+
+// Frame receiving: a thread sends the message as DATA frames over a
+// socketpair and the benchmark reads them back with nextFrame()
+static int recvPair[2];
+static struct otpReader recvReader;
+
+static void* recvSender(void* arg)
+{
+    size_t len = *(size_t*)arg;
+    size_t sent = 0;
+    do
+    {
+        size_t chunk = (len - sent < RECV_FRAME_BODY) ? len - sent : RECV_FRAME_BODY;
+        if (sendFrame(recvPair[0], OTP_FRAME_DATA, 0, sent, plaintext + sent, chunk, NULL, 0) < 0)
+        {
+            break;
+        }
+        sent += chunk;
+    } while (sent < len);
+    return NULL;
+}
+
+static void setupRecv(size_t len)
+{
+    (void)len;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, recvPair) < 0 || initReader(&recvReader, recvPair[1]) < 0)
+    {
+        perror("microbench: socketpair");
+        exit(1);
+    }
+}
+
+static void runRecv(size_t len)
+{
+    pthread_t sender;
+    pthread_create(&sender, NULL, recvSender, &len);
+    size_t received = 0;
+    do
+    {
+        struct otpFrame frame;
+        const char* body;
+        if (recvFrame(&recvReader, &frame, &body) < 0)
+        {
+            exit(1);
+        }
+        received += frame.len0;
+    } while (received < len);
+    pthread_join(sender, NULL);
+}
+
+static void teardownRecv(size_t len)
+{
+    (void)len;
+    freeReader(&recvReader);
+    close(recvPair[0]);
+    close(recvPair[1]);
+}
+
+static const struct benchCase benchmarks[] =
+{
+    { "encode", NULL, runEncode, NULL },
+    { "decode", NULL, runDecode, NULL },
+    { "encodeBytes", NULL, runBytes, NULL },
+    { "encodeChecked", NULL, runChecked, NULL },
+    { "encodeParallel", NULL, runParallel, NULL },
+    { "validateLen", NULL, runValidateLen, NULL },
+    { "pack", NULL, runPack, NULL },
+    { "unpack", setupUnpack, runUnpack, NULL },
+    { "validateStr", setupValidateStr, runValidateStr, teardownValidateStr },
+    { "processFile", setupFile, runProcessFile, teardownFile },
+    { "mapFile", setupFile, runMapFile, teardownFile },
+    { "recvFrame", setupRecv, runRecv, teardownRecv },
+};
+
+/*********************************************************************
+** runBenchmark()
+* Times one benchmark at every size and prints a line per size.
+*********************************************************************/
+
+static void runBenchmark(const struct benchCase* bench)
+{
+    size_t s;
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        size_t len = sizes[s];
+        if (bench->setup) bench->setup(len);
+        bench->run(len); // warm up caches and the page cache
+        long iterations = 0;
+        double start = now(), elapsed;
+        do
+        {
+            bench->run(len);
+            iterations++;
+            elapsed = now() - start;
+        } while (elapsed < minSeconds);
+        if (bench->teardown) bench->teardown(len);
+        printf("%-16s %10zu %10ld %10.3f GB/s %12.1f ns/op\n", bench->name, len, iterations,
+               (double)len * iterations / elapsed / 1e9, elapsed / iterations * 1e9);
+        fflush(stdout);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            minSeconds = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "USAGE: %s [-t seconds] [benchmark]...\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    initEncoder();
+    initPacker();
+    plaintext = malloc(MAX_SIZE + 1);
+    key = malloc(MAX_SIZE);
+    output = malloc(MAX_SIZE);
+    packed = malloc(packedSize(MAX_SIZE));
+    if (plaintext == NULL || key == NULL || output == NULL || packed == NULL) error("microbench: malloc");
+    const char charset[] = CHARS;
+    size_t i;
+    unsigned int seed = 1;
+    for (i = 0; i < MAX_SIZE; i++)
+    {
+        plaintext[i] = charset[rand_r(&seed) % 27];
+        key[i] = charset[rand_r(&seed) % 27];
+    }
+    plaintext[MAX_SIZE] = 'A';
+
+    printf("kernel: %s, packer: %s\n", encoderName(), packerName());
+    printf("%-16s %10s %10s %15s %15s\n", "benchmark", "bytes", "iters", "throughput", "latency");
+    size_t b;
+    for (b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++)
+    {
+        int wanted = (optind == argc);
+        int a;
+        for (a = optind; a < argc; a++)
+        {
+            if (strcmp(argv[a], benchmarks[b].name) == 0) wanted = 1;
+        }
+        if (wanted)
+        {
+            runBenchmark(&benchmarks[b]);
+        }
+    }
+    free(plaintext);
+    free(key);
+    free(output);
+    return 0;
+}
@@ -0,0 +1,349 @@
+/*********************************************************************
+** keygen.c
+** Description: Creates one time pad key files: keylength random
+* characters from CHARS followed by a newline. Random bytes are drawn
+* from getrandom() a few MB at a time. Bytes of 243 and up are thrown
+* away so that each of the 27 characters is exactly as likely (243 is
+* 9 * 27), and the rest are turned into characters by table lookup.
+* Keeping a byte or not is done without branches, or with AVX-512
+* compress instructions when the CPU has them. Output goes out in large
+* writes, optionally with O_DIRECT so multi-GB pads don't push
+* everything else out of the page cache.
+* With no file names the key is written to stdout. Given file names,
+* every file gets its own key, and -j fills that many at once.
+* With -B the key is keylength raw random bytes and no newline, for
+* clients sending binary text (otp_enc -B).
+* Usage: keygen [-j jobs] [-d] [-B] keylength [pad file]...
+*********************************************************************/
+
+#define _GNU_SOURCE // O_DIRECT
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include "otpshared.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define OTP_X86 1
+#include <immintrin.h>
+#endif
+
+#define KEYGEN_BUFFER (4 * 1024 * 1024) // key bytes per write
+#define KEYGEN_RANDOM 65536 // random bytes drawn per getrandom() call
+#define KEYGEN_ALIGN 4096 // buffer alignment O_DIRECT needs
+#define SAMPLE_LIMIT 243 // largest multiple of 27 that fits in a byte
+
+// Signature of the sampling kernels, see sampleScalar()
+typedef size_t (*sampleKernel)(const unsigned char* random, size_t len, char* key);
+
+static char sampleTable[256]; // random byte -> key character, bytes >= 243 unused
+static sampleKernel sampler;
+static int binaryKey = 0; // -B: every random byte is key, no newline
+
+// Work shared by the -j threads
+struct keygenJob
+{
+    char** paths;
+    int count;
+    int next;       // next file to fill, taken with an atomic add
+    uint64_t length;
+    int direct;
+    int failed;
+};
+
+/*********************************************************************
+** sampleScalar()
+* Turns len random bytes into key characters, skipping bytes of 243 or
+* more. Every byte is written out, but the output position only moves
+* on for the ones that are kept, so there is no branch to mispredict.
+* key must have room for len characters. Returns how many were kept.
+*********************************************************************/
+
+static size_t sampleScalar(const unsigned char* random, size_t len, char* key)
+{
+    size_t kept = 0;
+    size_t i;
+    for (i = 0; i < len; i++)
+    {
+        key[kept] = sampleTable[random[i]];
+        kept += random[i] < SAMPLE_LIMIT;
+    }
+    return kept;
+}
+
+/*********************************************************************
+** sampleBytes()
+* Sampling kernel for -B: any byte is key, so every one is kept.
+*********************************************************************/
+
+static size_t sampleBytes(const unsigned char* random, size_t len, char* key)
+{
+    memcpy(key, random, len);
+    return len;
+}
+
+#ifdef OTP_X86
+
+/* AVX-512 version: looks all 64 bytes up in the table at once (two
+   128-entry permutes, picked by the top bit of each byte), then packs
+   the kept ones together with a masked compress store. */
+
+__attribute__((target("avx512f,avx512bw,avx512vbmi,avx512vbmi2")))
+static size_t sampleAVX512(const unsigned char* random, size_t len, char* key)
+{
+    const __m512i limit = _mm512_set1_epi8((char)SAMPLE_LIMIT);
+    const __m512i t0 = _mm512_loadu_si512((const void*)(sampleTable));
+    const __m512i t1 = _mm512_loadu_si512((const void*)(sampleTable + 64));
+    const __m512i t2 = _mm512_loadu_si512((const void*)(sampleTable + 128));
+    const __m512i t3 = _mm512_loadu_si512((const void*)(sampleTable + 192));
+    size_t kept = 0;
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+    {
+        __m512i r = _mm512_loadu_si512((const void*)(random + i));
+        __m512i low = _mm512_permutex2var_epi8(t0, r, t1);
+        __m512i high = _mm512_permutex2var_epi8(t2, r, t3);
+        __m512i c = _mm512_mask_blend_epi8(_mm512_movepi8_mask(r), low, high);
+        __mmask64 keep = _mm512_cmplt_epu8_mask(r, limit);
+        _mm512_mask_compressstoreu_epi8(key + kept, keep, c);
+        kept += __builtin_popcountll(keep);
+    }
+    return kept + sampleScalar(random + i, len - i, key + kept);
+}
+
+#endif
+
+/*********************************************************************
+** initSampler()
+* Fills the lookup table and picks the widest sampling kernel the CPU
+* supports.
+*********************************************************************/
+
+static void initSampler(void)
+{
+    const char charset[] = CHARS;
+    int b;
+    for (b = 0; b < 256; b++)
+    {
+        sampleTable[b] = charset[b % 27];
+    }
+    sampler = sampleScalar;
+#ifdef OTP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vbmi") && __builtin_cpu_supports("avx512vbmi2"))
+    {
+        sampler = sampleAVX512;
+    }
+#endif
+}
+
+/*********************************************************************
+** fillRandom()
+* Fills buffer with len bytes from getrandom(). Returns 0 on success,
+* -1 on failure.
+*********************************************************************/
+
+static int fillRandom(unsigned char* buffer, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = getrandom(buffer, len, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            perror("getrandom");
+            return -1;
+        }
+        buffer += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*********************************************************************
+** writeAll()
+* Writes all len bytes of buffer to fd. Returns 0 on success, -1 on
+* failure.
+*********************************************************************/
+
+static int writeAll(int fd, const char* buffer, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buffer, len);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buffer += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*********************************************************************
+** generateKey()
+* Writes length random key characters and a newline (with -B, length
+* random bytes and nothing else) to fd, one
+* KEYGEN_BUFFER at a time. When direct is set fd was opened with
+* O_DIRECT: full buffers are a multiple of the block size, and O_DIRECT
+* is switched off before the short tail is written.
+* Returns 0 on success, -1 on failure.
+*********************************************************************/
+
+static int generateKey(int fd, uint64_t length, int direct)
+{
+    char* key = NULL;
+    unsigned char random[KEYGEN_RANDOM];
+    // Room for a full buffer plus one draw's worth of characters past it
+    if (posix_memalign((void**)&key, KEYGEN_ALIGN, KEYGEN_BUFFER + KEYGEN_RANDOM) != 0)
+    {
+        fprintf(stderr, "keygen: out of memory\n");
+        return -1;
+    }
+    uint64_t left = length + !binaryKey; // the newline counts too
+    size_t filled = 0;
+    int status = 0;
+    while (left > 0)
+    {
+        size_t want = (left < KEYGEN_BUFFER) ? left : KEYGEN_BUFFER;
+        while (filled < want)
+        {
+            if (fillRandom(random, sizeof(random)) < 0)
+            {
+                free(key);
+                return -1;
+            }
+            filled += sampler(random, sizeof(random), key + filled);
+        }
+        if (want == left)
+        {
+            if (!binaryKey) key[want - 1] = '\n';
+            if (direct && want % KEYGEN_ALIGN != 0)
+            {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            }
+        }
+        if (writeAll(fd, key, want) < 0)
+        {
+            perror("keygen: write");
+            status = -1;
+            break;
+        }
+        // Characters drawn past the end of this buffer start the next one
+        memmove(key, key + want, filled - want);
+        filled -= want;
+        left -= want;
+    }
+    free(key);
+    return status;
+}
+
+/*********************************************************************
+** keygenWorker()
+* Thread body for -j: takes files off the job one at a time until none
+* are left, creating each with a fresh key.
+*********************************************************************/
+
+static void* keygenWorker(void* arg)
+{
+    struct keygenJob* job = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+    {
+        const char* path = job->paths[i];
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | (job->direct ? O_DIRECT : 0), 0600);
+        if (fd < 0 && job->direct && errno == EINVAL)
+        {
+            // The filesystem doesn't do O_DIRECT, write through the cache
+            fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        }
+        if (fd < 0)
+        {
+            perror(path);
+            job->failed = 1;
+            continue;
+        }
+        int direct = job->direct && (fcntl(fd, F_GETFL) & O_DIRECT);
+        if (generateKey(fd, job->length, direct) < 0 || close(fd) < 0)
+        {
+            fprintf(stderr, "keygen: failed writing %s\n", path);
+            job->failed = 1;
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int jobs = 1;
+    int direct = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:dB")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 'd':
+            direct = 1;
+            break;
+        case 'B':
+            binaryKey = 1;
+            break;
+        default:
+            fprintf(stderr, "USAGE: %s [-j jobs] [-d] [-B] keylength [pad file]...\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind >= argc)
+    {
+        fprintf(stderr, "USAGE: %s [-j jobs] [-d] [-B] keylength [pad file]...\n", argv[0]);
+        exit(1);
+    }
+    char* end;
+    uint64_t length = strtoull(argv[optind], &end, 10);
+    if (*end != '\0' || argv[optind][0] == '-')
+    {
+        fprintf(stderr, "keygen: invalid key length %s\n", argv[optind]);
+        exit(1);
+    }
+    initSampler();
+    if (binaryKey) sampler = sampleBytes;
+
+    // No files, the key goes to stdout
+    if (optind + 1 == argc)
+    {
+        return generateKey(STDOUT_FILENO, length, 0) < 0 ? 1 : 0;
+    }
+
+    struct keygenJob job;
+    memset(&job, 0, sizeof(job));
+    job.paths = argv + optind + 1;
+    job.count = argc - optind - 1;
+    job.length = length;
+    job.direct = direct;
+    if (jobs < 1) jobs = 1;
+    if (jobs > job.count) jobs = job.count;
+
+    pthread_t threads[jobs];
+    int started = 0;
+    while (started < jobs - 1 && pthread_create(&threads[started], NULL, keygenWorker, &job) == 0)
+    {
+        started++;
+    }
+    keygenWorker(&job); // this thread fills files too
+    int i;
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    return job.failed ? 1 : 0;
+}
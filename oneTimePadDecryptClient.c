@@ -0,0 +1,21 @@
+/*********************************************************************
+** oneTimePadDecryptClient.c
+** Description: Given a textfile (presumably ciphertext) and the OTP key
+* file it was encrypted with, decodes the textfile with the key. Acts
+* as a client to otp_dec_d by sending the ciphertext and key text.
+* Receives the plaintext from otp_dec_d and prints it to stdout.
+* The client itself lives in otpcli.c.
+* Usage: otp_dec [-P] [-S] [-B] [ciphertext] [key] [port]
+*        otp_dec [-P] -k [pad id] [-o pad offset] [ciphertext] [port]
+*        otp_dec [-P] -b [-d depth] [key] [port] [ciphertext]...
+*        otp_dec [-P] -b [-d depth] -k [pad id] [-o pad offset] [port] [ciphertext]...
+*        otp_dec [-P | -B] -s [-o key offset] [key] [port] < ciphertext
+*********************************************************************/
+
+#include "otpcli.h"
+
+int main(int argc, char *argv[])
+{
+    static const struct clientConfig config = { "otp_dec", "DEC", "decrypt" };
+    return runClient(argc, argv, &config);
+}
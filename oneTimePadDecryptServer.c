@@ -0,0 +1,18 @@
+/*********************************************************************
+** oneTimePadDecryptServer.c
+** Description: Acts as a server for one time pad decryption.
+* Receiving a ciphertext and key file from otp_dec, decodes the
+* ciphertext and sends the plaintext back to otp_dec. otp_dec sends a
+* code to otp_dec_d to verify it is from otp_dec.
+* The server itself lives in otpdaemon.c.
+* Usage: otp_dec_d [-m fork|epoll|uring] [-t threads] [-k id=padfile]... [-s statsSocket] [-T traceFile] [-u unixSocket] [-r] [-c maxRequests] [-C maxBytes] [port] &
+*********************************************************************/
+
+#include "otpcipher.h"
+#include "otpdaemon.h"
+
+int main(int argc, char *argv[])
+{
+    static const struct daemonConfig config = { "otp_dec_d", "otp_dec", "DEC", OTP_DECRYPT };
+    return runDaemon(argc, argv, &config);
+}
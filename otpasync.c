@@ -0,0 +1,795 @@
+/*********************************************************************
+** otpasync.c
+** Description: Embeddable client library. otpAsyncOpen() looks up
+* every daemon it is given, starts connsPerDaemon connections to each
+* and starts a thread that owns those connections from then on.
+* Connections are opened without blocking, so the thread never waits
+* on one. otpAsyncSubmit() only puts a job on a list and wakes the
+* thread through an eventfd; the thread sends each job on the least
+* busy connection with the otpclient.c engine, copies RESULT bodies
+* straight into the job's output and finishes the job by calling
+* onComplete, or by queuing it and bumping a second eventfd that the
+* caller polls. Jobs a busy daemon turns away go out again after the
+* wait it asks for. A connection that fails fails its open jobs and is
+* reopened the next time a job needs it, backing off while it keeps
+* failing. One that takes longer than OTP_ASYNC_CONNECT_MS to open, or
+* keeps a job for longer than OTP_ASYNC_TIMEOUT_MS, counts as failed.
+*********************************************************************/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "otpasync.h"
+
+// One connection of the pool
+struct asyncConn
+{
+    struct otpConn conn;
+    struct sockaddr_storage addr; // the daemon's, looked up once by otpAsyncOpen()
+    socklen_t addrLen;            // 0 if the lookup failed
+    int up;                 // open, or being opened (conn.connecting)
+    uint64_t connectByNs;   // when a connection still being opened has failed
+                            // (or, backlogged, when to stop waiting for room)
+    int backlogged;         // down because the daemon's backlog was full, see openConn()
+    uint64_t reconnectAtNs; // when a connection that is down may be tried again
+    int backoffMs;          // doubles on every failed attempt, up to OTP_IO_TIMEOUT_MS
+};
+
+struct otpAsync
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    // Guarded by lock
+    struct otpJob* submitted; // handed over by otpAsyncSubmit(), oldest first
+    struct otpJob* submittedTail;
+    struct otpJob* completed; // finished jobs waiting for otpAsyncReap()
+    struct otpJob* completedTail;
+    int stopping;
+    int wakeFD;               // eventfd: jobs were submitted or otpAsyncClose() was called
+    int doneFD;               // eventfd: completed isn't empty
+    char authCode[OTP_AUTH_SIZE + 1];
+    int packed;
+    struct asyncConn* conns;
+    int connCount;
+    // Only touched by the library's thread
+    int nextConn;             // where the search for the least busy connection starts
+    struct otpJob* waiting;   // not on a connection yet, oldest first
+    struct otpJob* waitingTail;
+    struct otpJob* delayed;   // turned away with BUSY, waiting for retryAtNs
+    struct otpJob* finished;  // finished during the last pass over the connections
+    struct otpJob* finishedTail;
+    int open;                 // jobs on connections
+    uint64_t expireAtNs;      // no deadline passes before this, 0 if none is set
+};
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void pushJob(struct otpJob** head, struct otpJob** tail, struct otpJob* job)
+{
+    job->next = NULL;
+    if (*head == NULL)
+    {
+        *head = job;
+    }
+    else
+    {
+        (*tail)->next = job;
+    }
+    *tail = job;
+}
+
+static void bumpFD(int fd)
+{
+    uint64_t one = 1;
+    while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+// Milliseconds to wait for poll() until atNs, rounded up
+static int msUntil(uint64_t atNs)
+{
+    uint64_t now = nowNs();
+    return (atNs <= now) ? 0 : (int)((atNs - now + 999999) / 1000000);
+}
+
+// Keeps a connection that is down off until its backoff has passed,
+// doubling the backoff when it failed to open
+static void delayReconnect(struct asyncConn* ac, int failedToOpen)
+{
+    ac->reconnectAtNs = nowNs() + (uint64_t)ac->backoffMs * 1000000;
+    if (failedToOpen)
+    {
+        ac->backoffMs = (ac->backoffMs * 2 < OTP_IO_TIMEOUT_MS) ? ac->backoffMs * 2 : OTP_IO_TIMEOUT_MS;
+    }
+}
+
+// Makes sure expireDeadlines() looks again by atNs
+static void watchDeadline(struct otpAsync* async, uint64_t atNs)
+{
+    if (async->expireAtNs == 0 || atNs < async->expireAtNs)
+    {
+        async->expireAtNs = atNs;
+    }
+}
+
+/*********************************************************************
+** jobResult() / jobDone()
+* Request callbacks: copy a RESULT body into the job's output, and
+* move a finished job onto the finished list for handleFinished().
+*********************************************************************/
+
+static void jobResult(struct otpRequest* req, uint64_t offset, const char* data, size_t len)
+{
+    struct otpJob* job = req->userData;
+    if (offset <= job->len && len <= job->len - offset)
+    {
+        memcpy(job->output + offset, data, len);
+    }
+}
+
+static void jobDone(struct otpRequest* req)
+{
+    struct otpJob* job = req->userData;
+    struct otpAsync* async = job->async;
+    async->open--;
+    pushJob(&async->finished, &async->finishedTail, job);
+}
+
+/*********************************************************************
+** openConn()
+* (Re)opens one connection of the pool, without waiting for the
+* connect to finish (see otpConnectAddr()); the thread sees it through
+* in otpPump(), and resets the backoff once it has. On failure the
+* connection stays down until its backoff has passed. A daemon whose
+* backlog is full isn't a failure: the connection is backlogged, and
+* tried again after the same backoff, until OTP_ASYNC_CONNECT_MS has
+* gone by without room. Returns 0 on success, -1 on failure.
+*********************************************************************/
+
+static int openConn(struct otpAsync* async, struct asyncConn* ac)
+{
+    int opened = (ac->addrLen == 0) ? -1 : otpConnectAddr(&ac->conn, &ac->addr, ac->addrLen, async->authCode);
+    if (opened == OTP_CONNECT_AGAIN)
+    {
+        if (!ac->backlogged)
+        {
+            ac->backlogged = 1;
+            ac->connectByNs = nowNs() + OTP_ASYNC_CONNECT_MS * 1000000ull;
+        }
+        if (nowNs() < ac->connectByNs)
+        {
+            delayReconnect(ac, 0);
+            watchDeadline(async, ac->reconnectAtNs);
+            return -1;
+        }
+    }
+    ac->backlogged = 0;
+    if (opened != 0)
+    {
+        delayReconnect(ac, 1);
+        return -1;
+    }
+    ac->conn.packed = async->packed;
+    ac->up = 1;
+    if (ac->conn.connecting)
+    {
+        ac->connectByNs = nowNs() + OTP_ASYNC_CONNECT_MS * 1000000ull;
+        watchDeadline(async, ac->connectByNs);
+    }
+    else
+    {
+        ac->backoffMs = OTP_ASYNC_RECONNECT_MS;
+    }
+    return 0;
+}
+
+/*********************************************************************
+** pickConn()
+* Returns the open connection with the fewest open requests, reopening
+* any that are down and due another try first. Returns NULL if every
+* connection is full, still being opened or down; *anyUp says whether
+* any is worth waiting for: open, backlogged, or being opened and not
+* having failed to open last time (so a daemon that is gone fails
+* waiting jobs after one try rather than keep them for every retry).
+*********************************************************************/
+
+static struct asyncConn* pickConn(struct otpAsync* async, int* anyUp)
+{
+    struct asyncConn* best = NULL;
+    uint64_t now = nowNs();
+    int i;
+    *anyUp = 0;
+    for (i = 0; i < async->connCount; i++)
+    {
+        struct asyncConn* ac = &async->conns[(async->nextConn + i) % async->connCount];
+        if (!ac->up && (now < ac->reconnectAtNs || openConn(async, ac) < 0))
+        {
+            *anyUp |= ac->backlogged;
+            continue;
+        }
+        if (!ac->conn.connecting || ac->backoffMs == OTP_ASYNC_RECONNECT_MS)
+        {
+            *anyUp = 1;
+        }
+        if (!ac->conn.connecting && ac->conn.inflightCount < OTP_MAX_INFLIGHT &&
+            (best == NULL || ac->conn.inflightCount < best->conn.inflightCount))
+        {
+            best = ac;
+        }
+    }
+    async->nextConn = (async->nextConn + 1) % async->connCount;
+    return best;
+}
+
+/*********************************************************************
+** dropConn()
+* Fails every job open on a connection, saying why, and closes it; it
+* is reopened after its backoff when a job needs it.
+*********************************************************************/
+
+static void dropConn(struct asyncConn* ac, const char* why)
+{
+    int failedToOpen = ac->conn.connecting;
+    int i;
+    for (i = 0; i < OTP_MAX_INFLIGHT; i++)
+    {
+        struct otpRequest* req = ac->conn.inflight[i];
+        if (req != NULL)
+        {
+            req->status = OTP_REQ_FAILED;
+            snprintf(req->errorMsg, sizeof(req->errorMsg), "%s", why);
+            ac->conn.inflight[i] = NULL;
+            jobDone(req);
+        }
+    }
+    otpDisconnect(&ac->conn);
+    ac->up = 0;
+    delayReconnect(ac, failedToOpen);
+}
+
+/*********************************************************************
+** expireDeadlines()
+* Drops every connection that has had a job open for longer than
+* OTP_ASYNC_TIMEOUT_MS, or has been opening for longer than
+* OTP_ASYNC_CONNECT_MS, so a daemon that stops answering can't hold
+* jobs (or otpAsyncClose()) forever. Only looks once the earliest
+* deadline it was told of has passed, and sets *settled if it gave up
+* on a connection being opened. Returns the next deadline (or next
+* try of a backlogged connection), or 0 if there is none.
+*********************************************************************/
+
+static uint64_t expireDeadlines(struct otpAsync* async, int* settled)
+{
+    uint64_t now = nowNs();
+    if (async->expireAtNs == 0 || now < async->expireAtNs)
+    {
+        return async->expireAtNs;
+    }
+    uint64_t next = 0;
+    int i, j;
+    for (i = 0; i < async->connCount; i++)
+    {
+        struct asyncConn* ac = &async->conns[i];
+        if (!ac->up)
+        {
+            // Jobs may be waiting on a backlogged daemon's next try
+            if (ac->backlogged && ac->reconnectAtNs > now && (next == 0 || ac->reconnectAtNs < next))
+            {
+                next = ac->reconnectAtNs;
+            }
+            continue;
+        }
+        uint64_t due = ac->conn.connecting ? ac->connectByNs : 0;
+        for (j = 0; j < OTP_MAX_INFLIGHT && ac->conn.inflightCount > 0; j++)
+        {
+            struct otpRequest* req = ac->conn.inflight[j];
+            if (req != NULL)
+            {
+                struct otpJob* job = req->userData;
+                if (due == 0 || job->deadlineNs < due)
+                {
+                    due = job->deadlineNs;
+                }
+            }
+        }
+        if (due != 0 && due <= now)
+        {
+            *settled |= ac->conn.connecting;
+            dropConn(ac, ac->conn.connecting ? "connect timed out" : "timed out");
+        }
+        else if (due != 0 && (next == 0 || due < next))
+        {
+            next = due;
+        }
+    }
+    async->expireAtNs = next;
+    return next;
+}
+
+/*********************************************************************
+** completeJob()
+* Hands a finished job back to the caller: through onComplete when it
+* has one, otherwise on the completed list with doneFD bumped.
+*********************************************************************/
+
+static void completeJob(struct otpAsync* async, struct otpJob* job, int status, const char* errorMsg)
+{
+    job->status = status;
+    snprintf(job->errorMsg, sizeof(job->errorMsg), "%s", errorMsg);
+    if (job->onComplete)
+    {
+        job->onComplete(job);
+        return;
+    }
+    pthread_mutex_lock(&async->lock);
+    pushJob(&async->completed, &async->completedTail, job);
+    bumpFD(async->doneFD);
+    pthread_mutex_unlock(&async->lock);
+}
+
+/*********************************************************************
+** sendJob()
+* Queues one job's HELLO, DATA and END frames on a connection.
+*********************************************************************/
+
+static void sendJob(struct otpAsync* async, struct asyncConn* ac, struct otpJob* job)
+{
+    struct otpRequest* req = &job->req;
+    memset(req, 0, sizeof(*req));
+    req->len = job->len;
+    req->binary = job->binary;
+    req->usePad = job->usePad;
+    req->padId = job->padId;
+    req->padOffset = job->padOffset;
+    req->onResult = jobResult;
+    req->onDone = jobDone;
+    req->userData = job;
+    job->attempts++;
+    job->deadlineNs = nowNs() + OTP_ASYNC_TIMEOUT_MS * 1000000ull;
+    watchDeadline(async, job->deadlineNs);
+    if (otpBegin(&ac->conn, req) < 0)
+    {
+        completeJob(async, job, OTP_REQ_FAILED, "out of memory");
+        return;
+    }
+    async->open++;
+    if (otpQueueData(&ac->conn, req, 0, job->input, job->usePad ? NULL : job->key, job->len) < 0 ||
+        otpFinish(&ac->conn, req) < 0)
+    {
+        // Half a request is queued, the connection can't be trusted anymore
+        dropConn(ac, "connection failed");
+    }
+}
+
+/*********************************************************************
+** dispatchJobs()
+* Sends waiting jobs, oldest first, while some connection has room.
+* When every connection is down and none could be reopened, the
+* waiting jobs fail at once rather than hang.
+*********************************************************************/
+
+static void dispatchJobs(struct otpAsync* async)
+{
+    while (async->waiting != NULL)
+    {
+        int anyUp;
+        struct asyncConn* ac = pickConn(async, &anyUp);
+        if (ac == NULL)
+        {
+            if (anyUp)
+            {
+                return;
+            }
+            while (async->waiting != NULL)
+            {
+                struct otpJob* job = async->waiting;
+                async->waiting = job->next;
+                completeJob(async, job, OTP_REQ_FAILED, "no daemon reachable");
+            }
+            return;
+        }
+        struct otpJob* job = async->waiting;
+        async->waiting = job->next;
+        sendJob(async, ac, job);
+    }
+}
+
+/*********************************************************************
+** handleFinished()
+* Goes through the jobs that finished during the last pass: a job
+* turned away with BUSY waits out retryAfterMs on the delayed list
+* (up to OTP_ASYNC_BUSY_ATTEMPTS sends), everything else is handed
+* back. Returns how many jobs left their connection.
+*********************************************************************/
+
+static int handleFinished(struct otpAsync* async)
+{
+    int count = 0;
+    while (async->finished != NULL)
+    {
+        struct otpJob* job = async->finished;
+        async->finished = job->next;
+        count++;
+        if (job->req.status == OTP_REQ_BUSY && job->attempts < OTP_ASYNC_BUSY_ATTEMPTS)
+        {
+            job->retryAtNs = nowNs() + job->req.retryAfterMs * 1000000;
+            job->next = async->delayed;
+            async->delayed = job;
+            continue;
+        }
+        job->padOffset = job->req.padOffset;
+        completeJob(async, job, job->req.status, job->req.errorMsg);
+    }
+    return count;
+}
+
+/*********************************************************************
+** promoteDelayed()
+* Moves delayed jobs whose wait is over back to the waiting list.
+* Returns the earliest retry time still ahead, or 0 if there is none.
+*********************************************************************/
+
+static uint64_t promoteDelayed(struct otpAsync* async)
+{
+    uint64_t now = nowNs();
+    uint64_t next = 0;
+    struct otpJob** link = &async->delayed;
+    while (*link != NULL)
+    {
+        struct otpJob* job = *link;
+        if (job->retryAtNs <= now)
+        {
+            *link = job->next;
+            pushJob(&async->waiting, &async->waitingTail, job);
+            continue;
+        }
+        if (next == 0 || job->retryAtNs < next)
+        {
+            next = job->retryAtNs;
+        }
+        link = &job->next;
+    }
+    return next;
+}
+
+/*********************************************************************
+** takeSubmitted()
+* Moves everything otpAsyncSubmit() handed over onto the waiting list.
+* Returns 1 once otpAsyncClose() has been called, else 0.
+*********************************************************************/
+
+static int takeSubmitted(struct otpAsync* async)
+{
+    uint64_t count;
+    // Read the counter before taking the list, so a submit after this
+    // point always leaves the eventfd readable
+    while (read(async->wakeFD, &count, sizeof(count)) < 0 && errno == EINTR);
+    pthread_mutex_lock(&async->lock);
+    struct otpJob* jobs = async->submitted;
+    struct otpJob* tail = async->submittedTail;
+    int stopping = async->stopping;
+    async->submitted = NULL;
+    async->submittedTail = NULL;
+    pthread_mutex_unlock(&async->lock);
+    if (jobs != NULL)
+    {
+        if (async->waiting == NULL)
+        {
+            async->waiting = jobs;
+        }
+        else
+        {
+            async->waitingTail->next = jobs;
+        }
+        async->waitingTail = tail;
+    }
+    return stopping;
+}
+
+/*********************************************************************
+** asyncThread()
+* The library's thread. Each pass takes new jobs, sends what it can,
+* runs every connection that is ready or has frames to write, drops
+* the ones past a deadline, deals with the jobs that finished, and
+* then sleeps in one poll() on the wake eventfd and every connection
+* until something happens or the next delayed job or deadline is due.
+* After otpAsyncClose() it keeps going until every job has finished.
+*********************************************************************/
+
+static void* asyncThread(void* arg)
+{
+    struct otpAsync* async = arg;
+    struct pollfd* pfds = calloc(async->connCount + 1, sizeof(struct pollfd));
+    if (pfds == NULL)
+    {
+        perror("otpAsync: calloc");
+        return NULL;
+    }
+    int i;
+    while (1)
+    {
+        int stopping = takeSubmitted(async);
+        promoteDelayed(async);
+        dispatchJobs(async);
+        int settled = 0; // a connection finished opening, or failed to
+        for (i = 0; i < async->connCount; i++)
+        {
+            struct asyncConn* ac = &async->conns[i];
+            if (!ac->up || (pfds[i + 1].revents == 0 && ac->conn.queueCount == 0))
+            {
+                continue;
+            }
+            int wasConnecting = ac->conn.connecting;
+            if (otpPump(&ac->conn, 0) < 0)
+            {
+                // otpPump() has already failed the open jobs
+                dropConn(ac, "connection failed");
+                settled |= wasConnecting;
+            }
+            else if (wasConnecting && !ac->conn.connecting)
+            {
+                ac->backoffMs = OTP_ASYNC_RECONNECT_MS;
+                settled = 1;
+            }
+        }
+        uint64_t expireAt = expireDeadlines(async, &settled);
+        int freed = handleFinished(async);
+        if (stopping && async->waiting == NULL && async->delayed == NULL && async->open == 0)
+        {
+            break;
+        }
+
+        // Sleep until the next delayed job or deadline is due, or not at
+        // all when waiting jobs may fit where finished ones left, or have
+        // a connection that was opening to go to or give up on
+        struct otpJob* lastWaiting = async->waitingTail;
+        uint64_t next = promoteDelayed(async);
+        if (next == 0 || (expireAt != 0 && expireAt < next))
+        {
+            next = expireAt;
+        }
+        int timeoutMs = -1;
+        if (async->waiting != NULL && (freed > 0 || settled || async->waitingTail != lastWaiting))
+        {
+            timeoutMs = 0;
+        }
+        else if (next != 0)
+        {
+            timeoutMs = msUntil(next);
+        }
+        pfds[0].fd = async->wakeFD;
+        pfds[0].events = POLLIN;
+        pfds[0].revents = 0;
+        for (i = 0; i < async->connCount; i++)
+        {
+            struct asyncConn* ac = &async->conns[i];
+            pfds[i + 1].fd = ac->up ? ac->conn.socketFD : -1;
+            pfds[i + 1].events = ac->up ? otpWantEvents(&ac->conn) : 0;
+            pfds[i + 1].revents = 0;
+        }
+        if (poll(pfds, async->connCount + 1, timeoutMs) < 0 && errno != EINTR)
+        {
+            perror("otpAsync: poll");
+        }
+    }
+    free(pfds);
+    return NULL;
+}
+
+/*********************************************************************
+** splitEndpoint()
+* Splits a daemon string in place into host and port. "host:port" is a
+* TCP port on host, a bare port is one on localhost, and anything with
+* a '/' is the path of the daemon's Unix socket (see connectDaemon()).
+*********************************************************************/
+
+static void splitEndpoint(char* endpoint, const char** host, const char** port)
+{
+    char* colon = strrchr(endpoint, ':');
+    *host = "localhost";
+    *port = endpoint;
+    if (strchr(endpoint, '/') == NULL && colon != NULL)
+    {
+        *colon = '\0';
+        *host = endpoint;
+        *port = colon + 1;
+    }
+}
+
+static void freeAsync(struct otpAsync* async)
+{
+    int i;
+    for (i = 0; i < async->connCount; i++)
+    {
+        if (async->conns[i].up)
+        {
+            otpDisconnect(&async->conns[i].conn);
+        }
+    }
+    free(async->conns);
+    if (async->wakeFD >= 0) close(async->wakeFD);
+    if (async->doneFD >= 0) close(async->doneFD);
+    pthread_mutex_destroy(&async->lock);
+    free(async);
+}
+
+/*********************************************************************
+** otpAsyncOpen()
+* Looks up each of the daemonCount daemons (see splitEndpoint() for
+* the strings) and starts connsPerDaemon connections to it, all sending
+* authCode, with text packed on the wire when packed is set, and starts
+* the library's thread. Daemons are only looked up here, so the thread
+* never waits on a name server; connections that can't be started now
+* are tried again when jobs need them. Returns the new handle, or NULL
+* (with the reason printed) if memory ran out or not a single
+* connection could be started or found a daemon with a full backlog.
+*********************************************************************/
+
+struct otpAsync* otpAsyncOpen(const char* const* daemons, int daemonCount, int connsPerDaemon, const char* authCode, int packed)
+{
+    if (daemonCount < 1 || connsPerDaemon < 1)
+    {
+        fprintf(stderr, "otpAsync: no daemons given\n");
+        return NULL;
+    }
+    struct otpAsync* async = calloc(1, sizeof(struct otpAsync));
+    if (async == NULL)
+    {
+        perror("otpAsync: calloc");
+        return NULL;
+    }
+    pthread_mutex_init(&async->lock, NULL);
+    strncpy(async->authCode, authCode, OTP_AUTH_SIZE);
+    async->packed = packed;
+    async->wakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    async->doneFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    async->conns = calloc((size_t)daemonCount * connsPerDaemon, sizeof(struct asyncConn));
+    if (async->wakeFD < 0 || async->doneFD < 0 || async->conns == NULL)
+    {
+        perror("otpAsync: open");
+        freeAsync(async);
+        return NULL;
+    }
+    int up = 0;
+    int d, c;
+    for (d = 0; d < daemonCount; d++)
+    {
+        char* endpoint = strdup(daemons[d]);
+        if (endpoint == NULL)
+        {
+            perror("otpAsync: strdup");
+            freeAsync(async);
+            return NULL;
+        }
+        const char* host;
+        const char* port;
+        struct sockaddr_storage addr;
+        socklen_t addrLen = 0;
+        splitEndpoint(endpoint, &host, &port);
+        if (resolveDaemon(host, port, &addr, &addrLen) < 0)
+        {
+            addrLen = 0;
+        }
+        free(endpoint);
+        for (c = 0; c < connsPerDaemon; c++)
+        {
+            struct asyncConn* ac = &async->conns[async->connCount++];
+            ac->addr = addr;
+            ac->addrLen = addrLen;
+            ac->backoffMs = OTP_ASYNC_RECONNECT_MS;
+            up += (openConn(async, ac) == 0 || ac->backlogged);
+        }
+    }
+    if (up == 0)
+    {
+        fprintf(stderr, "otpAsync: no daemon reachable\n");
+        freeAsync(async);
+        return NULL;
+    }
+    if (pthread_create(&async->thread, NULL, asyncThread, async) != 0)
+    {
+        perror("otpAsync: pthread_create");
+        freeAsync(async);
+        return NULL;
+    }
+    return async;
+}
+
+/*********************************************************************
+** otpAsyncSubmit()
+* Hands a job to the library without waiting for anything; it will
+* finish exactly once, through onComplete or otpAsyncReap(). May be
+* called from any thread, onComplete included. Returns 0 on success,
+* -1 if the job is incomplete or otpAsyncClose() has been called.
+*********************************************************************/
+
+int otpAsyncSubmit(struct otpAsync* async, struct otpJob* job)
+{
+    if (job->input == NULL || job->output == NULL || job->len == OTP_LEN_UNKNOWN ||
+        (job->key == NULL && !job->usePad) || (job->usePad && job->binary))
+    {
+        return -1;
+    }
+    job->async = async;
+    job->status = OTP_REQ_PENDING;
+    job->errorMsg[0] = '\0';
+    job->attempts = 0;
+    pthread_mutex_lock(&async->lock);
+    if (async->stopping)
+    {
+        pthread_mutex_unlock(&async->lock);
+        return -1;
+    }
+    // The thread only needs waking for the first job of a batch
+    int wake = (async->submitted == NULL);
+    pushJob(&async->submitted, &async->submittedTail, job);
+    pthread_mutex_unlock(&async->lock);
+    if (wake)
+    {
+        bumpFD(async->wakeFD);
+    }
+    return 0;
+}
+
+/*********************************************************************
+** otpAsyncFD()
+* Returns a descriptor that polls readable while finished jobs are
+* waiting for otpAsyncReap(). Jobs with onComplete never show up here.
+*********************************************************************/
+
+int otpAsyncFD(struct otpAsync* async)
+{
+    return async->doneFD;
+}
+
+/*********************************************************************
+** otpAsyncReap()
+* Takes up to max finished jobs, oldest first, without blocking.
+* Returns how many were stored in jobs.
+*********************************************************************/
+
+int otpAsyncReap(struct otpAsync* async, struct otpJob** jobs, int max)
+{
+    int count = 0;
+    pthread_mutex_lock(&async->lock);
+    while (count < max && async->completed != NULL)
+    {
+        jobs[count++] = async->completed;
+        async->completed = async->completed->next;
+    }
+    if (async->completed == NULL)
+    {
+        uint64_t pending;
+        while (read(async->doneFD, &pending, sizeof(pending)) < 0 && errno == EINTR);
+    }
+    pthread_mutex_unlock(&async->lock);
+    return count;
+}
+
+/*********************************************************************
+** otpAsyncClose()
+* Stops taking jobs, waits until every submitted job has finished
+* (which the deadlines bound, see expireDeadlines()), then closes the
+* connections and frees the handle. Jobs that finished without being
+* reaped keep their status.
+*********************************************************************/
+
+void otpAsyncClose(struct otpAsync* async)
+{
+    pthread_mutex_lock(&async->lock);
+    async->stopping = 1;
+    pthread_mutex_unlock(&async->lock);
+    bumpFD(async->wakeFD);
+    pthread_join(async->thread, NULL);
+    freeAsync(async);
+}
@@ -0,0 +1,63 @@
+/*********************************************************************
+** otpasync.h
+** Description: Function prototypes for the embeddable client library.
+* A program links libotp.a, opens an otpAsync on one or more daemons
+* and submits jobs that encrypt (or decrypt) memory into memory. The
+* library keeps a pool of warm connections and a thread of its own to
+* drive them, so otpAsyncSubmit() never blocks on the network. A job
+* finishes either through its onComplete callback or, without one,
+* on a queue read with otpAsyncReap() whenever otpAsyncFD() polls
+* readable.
+*********************************************************************/
+
+#ifndef OTPASYNC_H
+#define OTPASYNC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "otpclient.h"
+
+#define OTP_ASYNC_BUSY_ATTEMPTS 5 // sends of a job a busy daemon keeps turning away
+#define OTP_ASYNC_RECONNECT_MS 100 // wait before reopening a connection that failed
+#define OTP_ASYNC_CONNECT_MS 2000 // longest a connection may take to open
+#define OTP_ASYNC_TIMEOUT_MS 30000 // longest a job may stay on a connection
+
+struct otpAsync;
+struct otpJob;
+// Called on the library's thread when a job finishes; the job may be
+// freed or submitted again from here
+typedef void (*otpJobFn)(struct otpJob* job);
+
+// One message to encrypt or decrypt. Filled in by the caller before
+// otpAsyncSubmit(); input, key and output must stay valid until the
+// job finishes.
+struct otpJob
+{
+    const char* input;   // plaintext for otp_enc_d, ciphertext for otp_dec_d
+    const char* key;     // len bytes of key, NULL when usePad is set
+    char* output;        // where the len bytes of the result go
+    uint64_t len;
+    int binary;          // input and key are arbitrary bytes (OTP_FLAG_BINARY)
+    int usePad;          // key comes from the daemon's pad padId
+    uint32_t padId;
+    uint64_t padOffset;  // as in otpRequest: where the key starts in the pad
+    otpJobFn onComplete; // NULL to collect the job with otpAsyncReap()
+    void* userData;
+    // Set by the library
+    int status;          // OTP_REQ_DONE, OTP_REQ_FAILED or OTP_REQ_BUSY
+    char errorMsg[128];
+    struct otpAsync* async;
+    struct otpRequest req;
+    int attempts;        // times the job was sent
+    uint64_t retryAtNs;  // when a job turned away with BUSY goes out again
+    uint64_t deadlineNs; // when a job on a connection has taken too long
+    struct otpJob* next;
+};
+
+OTP_API struct otpAsync* otpAsyncOpen(const char* const* daemons, int daemonCount, int connsPerDaemon, const char* authCode, int packed);
+OTP_API int otpAsyncSubmit(struct otpAsync* async, struct otpJob* job);
+OTP_API int otpAsyncFD(struct otpAsync* async);
+OTP_API int otpAsyncReap(struct otpAsync* async, struct otpJob** jobs, int max);
+OTP_API void otpAsyncClose(struct otpAsync* async);
+
+#endif
@@ -0,0 +1,131 @@
+/*********************************************************************
+** otpbuf.c
+** Description: Buffer pool shared by the one time pad programs. A
+* request is rounded up to the next power of two (at least 4 KB) and
+* served from that class's free list when it has a buffer, otherwise
+* from malloc(). Buffers handed back go on the free list, up to
+* OTP_BUF_KEEP_BYTES per class, and are never cleared: every user
+* writes before it reads. Free buffers hold the list's next pointer in
+* their first bytes, so the pool itself allocates nothing.
+* The lists are per process, each guarded by its own mutex; buffers
+* are only taken and given back when a connection opens, closes or
+* needs a bigger buffer, never per frame.
+*********************************************************************/
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "otpbuf.h"
+
+#define CLASSES (OTP_BUF_MAX_SHIFT - OTP_BUF_MIN_SHIFT + 1)
+
+struct freeBuffer
+{
+    struct freeBuffer* next;
+};
+
+struct bufClass
+{
+    pthread_mutex_t lock;
+    struct freeBuffer* head;
+    size_t count;
+};
+
+static struct bufClass classes[CLASSES];
+static pthread_once_t classesOnce = PTHREAD_ONCE_INIT;
+
+static void initClasses(void)
+{
+    int i;
+    for (i = 0; i < CLASSES; i++)
+    {
+        pthread_mutex_init(&classes[i].lock, NULL);
+        classes[i].head = NULL;
+        classes[i].count = 0;
+    }
+}
+
+/*********************************************************************
+** sizeClass()
+* Returns the class a buffer of size bytes comes from, or -1 when it
+* is too big to pool.
+*********************************************************************/
+
+static int sizeClass(size_t size)
+{
+    if (size <= ((size_t)1 << OTP_BUF_MIN_SHIFT))
+    {
+        return 0;
+    }
+    int shift = 64 - __builtin_clzll((unsigned long long)size - 1);
+    return (shift > OTP_BUF_MAX_SHIFT) ? -1 : shift - OTP_BUF_MIN_SHIFT;
+}
+
+/*********************************************************************
+** getBuffer()
+* Returns an uninitialized buffer of at least size bytes and stores
+* how many bytes it really holds in *capacity (when not NULL), so the
+* caller can use the slack before asking for a bigger one. Returns
+* NULL if memory runs out.
+*********************************************************************/
+
+char* getBuffer(size_t size, size_t* capacity)
+{
+    int c = sizeClass(size);
+    if (c < 0)
+    {
+        if (capacity) *capacity = size;
+        return malloc(size);
+    }
+    pthread_once(&classesOnce, initClasses);
+    size_t classSize = (size_t)1 << (c + OTP_BUF_MIN_SHIFT);
+    struct bufClass* cls = &classes[c];
+    pthread_mutex_lock(&cls->lock);
+    struct freeBuffer* buf = cls->head;
+    if (buf != NULL)
+    {
+        cls->head = buf->next;
+        cls->count--;
+    }
+    pthread_mutex_unlock(&cls->lock);
+    if (buf == NULL)
+    {
+        buf = malloc(classSize);
+    }
+    if (capacity) *capacity = classSize;
+    return (char*)buf;
+}
+
+/*********************************************************************
+** putBuffer()
+* Gives back a buffer from getBuffer(). size may be anything from what
+* was asked for up to the capacity that was returned. NULL is ignored.
+*********************************************************************/
+
+void putBuffer(void* buffer, size_t size)
+{
+    if (buffer == NULL)
+    {
+        return;
+    }
+    int c = sizeClass(size);
+    if (c < 0)
+    {
+        free(buffer);
+        return;
+    }
+    pthread_once(&classesOnce, initClasses);
+    size_t classSize = (size_t)1 << (c + OTP_BUF_MIN_SHIFT);
+    size_t keep = OTP_BUF_KEEP_BYTES / classSize;
+    struct bufClass* cls = &classes[c];
+    struct freeBuffer* buf = buffer;
+    pthread_mutex_lock(&cls->lock);
+    if (cls->count < (keep ? keep : 1))
+    {
+        buf->next = cls->head;
+        cls->head = buf;
+        cls->count++;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&cls->lock);
+    free(buf);
+}
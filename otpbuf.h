@@ -0,0 +1,21 @@
+/*********************************************************************
+** otpbuf.h
+** Description: Function prototypes for the buffer pool. Buffers come
+* in power-of-two size classes and are kept for reuse when given back,
+* so a connection's buffers are recycled by the next one instead of
+* being allocated, faulted in and freed every time.
+*********************************************************************/
+
+#ifndef OTPBUF_H
+#define OTPBUF_H
+
+#include <stddef.h>
+
+#define OTP_BUF_MIN_SHIFT 12 // smallest class, 4 KB
+#define OTP_BUF_MAX_SHIFT 25 // largest pooled class, 32 MB; bigger buffers are malloc()ed
+#define OTP_BUF_KEEP_BYTES (64 * 1024 * 1024) // most memory kept idle in one class
+
+char* getBuffer(size_t size, size_t* capacity);
+void putBuffer(void* buffer, size_t size);
+
+#endif
@@ -0,0 +1,608 @@
+/*********************************************************************
+** otpcipher.c
+** Description: Cipher kernels for one time pad encryption and
+* decryption. Holds the table-driven scalar encoder along with SSE2,
+* AVX2 and AVX-512 versions that work on 16/32/64 characters at a
+* time. Every kernel takes a direction, so both programs share one code
+* path. initEncoder() picks the widest kernel
+* the CPU supports; encodeBlock() calls whichever one was picked.
+* Each kernel is also specialized for arbitrary bytes, added mod 256
+* instead of mod 27, which encodeBytes() calls.
+* The same file holds the fused kernels: scanText() finds where a
+* text's contents end and checks them against CHARS in one pass, and
+* encodeChecked() checks the plaintext and key while encoding them.
+* Both stop at the first vector holding a bad character.
+* Setting OTP_ENCODER=scalar|sse2|avx2|avx512 in the environment forces
+* a specific kernel (used to compare kernels against each other).
+*********************************************************************/
+
+#include <string.h>
+#include <stdlib.h>
+#include "otpshared.h"
+#include "otpcipher.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define OTP_X86 1
+#include <immintrin.h>
+#endif
+
+/* Lookup tables for the scalar kernels, generated at compile time.
+   charIndex maps a byte to its position in CHARS (A=0 .. Z=25, space=26)
+   and anything else to 27. cipherTable[direction][a][b] is the character
+   for plaintext index a and key index b: CHARS[(a + b) % 27] to
+   encrypt, CHARS[(a - b) % 27] to decrypt. Row and column 27 catch bad
+   characters, so a lookup never leaves the table. */
+
+#define INDEX_OF(c) (((c) >= 'A' && (c) <= 'Z') ? (c) - 'A' : (c) == ' ' ? 26 : 27)
+#define INDEX4(c) INDEX_OF(c), INDEX_OF((c) + 1), INDEX_OF((c) + 2), INDEX_OF((c) + 3)
+#define INDEX16(c) INDEX4(c), INDEX4((c) + 4), INDEX4((c) + 8), INDEX4((c) + 12)
+#define INDEX64(c) INDEX16(c), INDEX16((c) + 16), INDEX16((c) + 32), INDEX16((c) + 48)
+
+static const unsigned char charIndex[256] = { INDEX64(0), INDEX64(64), INDEX64(128), INDEX64(192) };
+
+#define CHAR_AT(i) ((i) == 26 ? ' ' : 'A' + (i))
+#define CELL(d, a, b) (((a) > 26 || (b) > 26) ? '?' : CHAR_AT((d) == OTP_DECRYPT ? ((a) - (b) + 27) % 27 : ((a) + (b)) % 27))
+#define ROW(d, a) { CELL(d, a, 0), CELL(d, a, 1), CELL(d, a, 2), CELL(d, a, 3), CELL(d, a, 4), CELL(d, a, 5), CELL(d, a, 6), \
+                    CELL(d, a, 7), CELL(d, a, 8), CELL(d, a, 9), CELL(d, a, 10), CELL(d, a, 11), CELL(d, a, 12), CELL(d, a, 13), \
+                    CELL(d, a, 14), CELL(d, a, 15), CELL(d, a, 16), CELL(d, a, 17), CELL(d, a, 18), CELL(d, a, 19), CELL(d, a, 20), \
+                    CELL(d, a, 21), CELL(d, a, 22), CELL(d, a, 23), CELL(d, a, 24), CELL(d, a, 25), CELL(d, a, 26), CELL(d, a, 27) }
+#define TABLE(d) { ROW(d, 0), ROW(d, 1), ROW(d, 2), ROW(d, 3), ROW(d, 4), ROW(d, 5), ROW(d, 6), \
+                   ROW(d, 7), ROW(d, 8), ROW(d, 9), ROW(d, 10), ROW(d, 11), ROW(d, 12), ROW(d, 13), \
+                   ROW(d, 14), ROW(d, 15), ROW(d, 16), ROW(d, 17), ROW(d, 18), ROW(d, 19), ROW(d, 20), \
+                   ROW(d, 21), ROW(d, 22), ROW(d, 23), ROW(d, 24), ROW(d, 25), ROW(d, 26), ROW(d, 27) }
+
+static const char cipherTable[2][28][28] = { TABLE(OTP_ENCRYPT), TABLE(OTP_DECRYPT) };
+
+/* Every encode kernel is written once for any alphabet, as an inline
+   body taking the alphabet as an argument, and instantiated by a small
+   wrapper per alphabet. There the alphabet is a constant, so the steps
+   the other alphabet needs fold away and neither pays for the other:
+     OTP_ALPHABET_TEXT   the 27 symbols in CHARS, added mod 27
+     OTP_ALPHABET_BYTES  any byte, added mod 256. Every byte is its own
+                         index and wrapping at 256 is free, so this is
+                         one add (of the negated key, to decrypt). */
+
+/*********************************************************************
+** encodeScalarAs()
+* Given plaintext, a key and a buffer to place the output into,
+* encrypts (or with OTP_DECRYPT, decrypts) len characters one at a time.
+* Text takes two table lookups each, no branches or division. This is
+* the fallback used when no SIMD kernel is available, and it finishes
+* off the tail that is too short for a full vector.
+*********************************************************************/
+
+__attribute__((always_inline))
+static inline void encodeScalarAs(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction, int alphabet)
+{
+    const unsigned char* p = (const unsigned char*)plaintext;
+    const unsigned char* k = (const unsigned char*)key;
+    size_t i;
+    if (alphabet == OTP_ALPHABET_BYTES)
+    {
+        unsigned char sign = (direction == OTP_DECRYPT) ? 0xFF : 0x00;
+        for (i = 0; i < len; i++)
+        {
+            encryptedText[i] = (char)(p[i] + ((k[i] ^ sign) - sign));
+        }
+        return;
+    }
+    const char (*table)[28] = cipherTable[direction];
+    for (i = 0; i < len; i++)
+    {
+        encryptedText[i] = table[charIndex[p[i]]][charIndex[k[i]]];
+    }
+}
+
+void encodeScalar(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction)
+{
+    encodeScalarAs(plaintext, key, encryptedText, len, direction, OTP_ALPHABET_TEXT);
+}
+
+static void encodeBytesScalar(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction)
+{
+    encodeScalarAs(plaintext, key, encryptedText, len, direction, OTP_ALPHABET_BYTES);
+}
+
+/*********************************************************************
+** scanScalar()
+* Scalar version of scanText(): walks text until a newline or a
+* character outside CHARS. Stores the position it stopped at in
+* contentLen and returns 1 if it stopped at a newline (or the end), 0
+* if it stopped at a bad character.
+*********************************************************************/
+
+static int scanScalar(const char* text, size_t len, uint64_t* contentLen)
+{
+    size_t i;
+    for (i = 0; i < len; i++)
+    {
+        if (charIndex[(unsigned char)text[i]] > 26)
+        {
+            *contentLen = i;
+            return text[i] == '\n';
+        }
+    }
+    *contentLen = len;
+    return 1;
+}
+
+/*********************************************************************
+** encodeCheckedScalar()
+* Scalar version of encodeChecked(): encodes one character at a time
+* and stops before the first position where the plaintext or key has a
+* character outside CHARS. Returns how many characters were encoded.
+*********************************************************************/
+
+static size_t encodeCheckedScalar(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction)
+{
+    const char (*table)[28] = cipherTable[direction];
+    size_t i;
+    for (i = 0; i < len; i++)
+    {
+        unsigned char a = charIndex[(unsigned char)plaintext[i]];
+        unsigned char b = charIndex[(unsigned char)key[i]];
+        if (a > 26 || b > 26)
+        {
+            break;
+        }
+        encryptedText[i] = table[a][b];
+    }
+    return i;
+}
+
+#ifdef OTP_X86
+
+/* The SIMD kernels compute the same thing as the scalar tables, just on
+   a full register of characters at once:
+     1. subtract 'A' from every byte, then swap spaces for 26
+     2. to decrypt, replace the key index b with (27 - b) % 27, so that
+        adding it subtracts b
+     3. add the plaintext and key indexes (at most 52, fits in a byte)
+     4. subtract 27 from every lane that went above 26
+     5. add 'A' back, then swap 26 for a space
+   For bytes, steps 1, 4 and 5 drop out and step 2 is (256 - b) % 256. */
+
+__attribute__((target("sse2"), always_inline))
+static inline __m128i stepSSE2(__m128i p, __m128i k, int direction, int alphabet)
+{
+    const __m128i base = _mm_set1_epi8('A');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i k26 = _mm_set1_epi8(26);
+    const __m128i k27 = _mm_set1_epi8(27);
+    __m128i a = p, b = k, m;
+    if (alphabet == OTP_ALPHABET_TEXT)
+    {
+        m = _mm_cmpeq_epi8(p, space);
+        a = _mm_or_si128(_mm_andnot_si128(m, _mm_sub_epi8(p, base)), _mm_and_si128(m, k26));
+        m = _mm_cmpeq_epi8(k, space);
+        b = _mm_or_si128(_mm_andnot_si128(m, _mm_sub_epi8(k, base)), _mm_and_si128(m, k26));
+    }
+    if (direction == OTP_DECRYPT && alphabet == OTP_ALPHABET_TEXT)
+    {
+        b = _mm_sub_epi8(k27, b);
+        b = _mm_andnot_si128(_mm_cmpeq_epi8(b, k27), b);
+    }
+    else if (direction == OTP_DECRYPT)
+    {
+        b = _mm_sub_epi8(_mm_setzero_si128(), b);
+    }
+    __m128i c = _mm_add_epi8(a, b);
+    if (alphabet == OTP_ALPHABET_TEXT)
+    {
+        c = _mm_sub_epi8(c, _mm_and_si128(_mm_cmpgt_epi8(c, k26), k27));
+        m = _mm_cmpeq_epi8(c, k26);
+        c = _mm_or_si128(_mm_andnot_si128(m, _mm_add_epi8(c, base)), _mm_and_si128(m, space));
+    }
+    return c;
+}
+
+__attribute__((target("sse2"), always_inline))
+static inline void encodeSSE2As(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction, int alphabet)
+{
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i p = _mm_loadu_si128((const __m128i*)(plaintext + i));
+        __m128i k = _mm_loadu_si128((const __m128i*)(key + i));
+        _mm_storeu_si128((__m128i*)(encryptedText + i), stepSSE2(p, k, direction, alphabet));
+    }
+    if (alphabet == OTP_ALPHABET_BYTES) encodeBytesScalar(plaintext + i, key + i, encryptedText + i, len - i, direction);
+    else encodeScalar(plaintext + i, key + i, encryptedText + i, len - i, direction);
+}
+
+__attribute__((target("sse2")))
+static void encodeSSE2(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction)
+{
+    encodeSSE2As(plaintext, key, encryptedText, len, direction, OTP_ALPHABET_TEXT);
+}
+
+__attribute__((target("sse2")))
+static void encodeBytesSSE2(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction)
+{
+    encodeSSE2As(plaintext, key, encryptedText, len, direction, OTP_ALPHABET_BYTES);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline __m256i stepAVX2(__m256i p, __m256i k, int direction, int alphabet)
+{
+    const __m256i base = _mm256_set1_epi8('A');
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i k26 = _mm256_set1_epi8(26);
+    const __m256i k27 = _mm256_set1_epi8(27);
+    __m256i a = p, b = k;
+    if (alphabet == OTP_ALPHABET_TEXT)
+    {
+        a = _mm256_blendv_epi8(_mm256_sub_epi8(p, base), k26, _mm256_cmpeq_epi8(p, space));
+        b = _mm256_blendv_epi8(_mm256_sub_epi8(k, base), k26, _mm256_cmpeq_epi8(k, space));
+    }
+    if (direction == OTP_DECRYPT && alphabet == OTP_ALPHABET_TEXT)
+    {
+        b = _mm256_sub_epi8(k27, b);
+        b = _mm256_andnot_si256(_mm256_cmpeq_epi8(b, k27), b);
+    }
+    else if (direction == OTP_DECRYPT)
+    {
+        b = _mm256_sub_epi8(_mm256_setzero_si256(), b);
+    }
+    __m256i c = _mm256_add_epi8(a, b);
+    if (alphabet == OTP_ALPHABET_TEXT)
+    {
+        c = _mm256_sub_epi8(c, _mm256_and_si256(_mm256_cmpgt_epi8(c, k26), k27));
+        c = _mm256_blendv_epi8(_mm256_add_epi8(c, base), space, _mm256_cmpeq_epi8(c, k26));
+    }
+    return c;
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void encodeAVX2As(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction, int alphabet)
+{
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i p = _mm256_loadu_si256((const __m256i*)(plaintext + i));
+        __m256i k = _mm256_loadu_si256((const __m256i*)(key + i));
+        _mm256_storeu_si256((__m256i*)(encryptedText + i), stepAVX2(p, k, direction, alphabet));
+    }
+    if (alphabet == OTP_ALPHABET_BYTES) encodeBytesSSE2(plaintext + i, key + i, encryptedText + i, len - i, direction);
+    else encodeSSE2(plaintext + i, key + i, encryptedText + i, len - i, direction);
+}
+
+__attribute__((target("avx2")))
+static void encodeAVX2(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction)
+{
+    encodeAVX2As(plaintext, key, encryptedText, len, direction, OTP_ALPHABET_TEXT);
+}
+
+__attribute__((target("avx2")))
+static void encodeBytesAVX2(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction)
+{
+    encodeAVX2As(plaintext, key, encryptedText, len, direction, OTP_ALPHABET_BYTES);
+}
+
+__attribute__((target("avx512f,avx512bw"), always_inline))
+static inline __m512i stepAVX512(__m512i p, __m512i k, int direction, int alphabet)
+{
+    const __m512i base = _mm512_set1_epi8('A');
+    const __m512i space = _mm512_set1_epi8(' ');
+    const __m512i k26 = _mm512_set1_epi8(26);
+    const __m512i k27 = _mm512_set1_epi8(27);
+    __m512i a = p, b = k;
+    if (alphabet == OTP_ALPHABET_TEXT)
+    {
+        a = _mm512_mask_blend_epi8(_mm512_cmpeq_epi8_mask(p, space), _mm512_sub_epi8(p, base), k26);
+        b = _mm512_mask_blend_epi8(_mm512_cmpeq_epi8_mask(k, space), _mm512_sub_epi8(k, base), k26);
+    }
+    if (direction == OTP_DECRYPT && alphabet == OTP_ALPHABET_TEXT)
+    {
+        b = _mm512_maskz_sub_epi8(_mm512_cmpneq_epi8_mask(b, _mm512_setzero_si512()), k27, b);
+    }
+    else if (direction == OTP_DECRYPT)
+    {
+        b = _mm512_sub_epi8(_mm512_setzero_si512(), b);
+    }
+    __m512i c = _mm512_add_epi8(a, b);
+    if (alphabet == OTP_ALPHABET_TEXT)
+    {
+        c = _mm512_mask_sub_epi8(c, _mm512_cmpgt_epi8_mask(c, k26), c, k27);
+        c = _mm512_mask_blend_epi8(_mm512_cmpeq_epi8_mask(c, k26), _mm512_add_epi8(c, base), space);
+    }
+    return c;
+}
+
+__attribute__((target("avx512f,avx512bw"), always_inline))
+static inline void encodeAVX512As(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction, int alphabet)
+{
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+    {
+        __m512i p = _mm512_loadu_si512((const void*)(plaintext + i));
+        __m512i k = _mm512_loadu_si512((const void*)(key + i));
+        _mm512_storeu_si512((void*)(encryptedText + i), stepAVX512(p, k, direction, alphabet));
+    }
+    if (alphabet == OTP_ALPHABET_BYTES) encodeBytesAVX2(plaintext + i, key + i, encryptedText + i, len - i, direction);
+    else encodeAVX2(plaintext + i, key + i, encryptedText + i, len - i, direction);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void encodeAVX512(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction)
+{
+    encodeAVX512As(plaintext, key, encryptedText, len, direction, OTP_ALPHABET_TEXT);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void encodeBytesAVX512(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction)
+{
+    encodeAVX512As(plaintext, key, encryptedText, len, direction, OTP_ALPHABET_BYTES);
+}
+
+/* The fused kernels add a range check in front of the same steps: a
+   byte is good if byte - 'A' is at most 25 (unsigned, so anything
+   below 'A' wraps around high) or it is a space. A vector with any bad
+   byte in it is handed to the scalar code, which finds exactly where. */
+
+__attribute__((target("sse2")))
+static int scanSSE2(const char* text, size_t len, uint64_t* contentLen)
+{
+    const __m128i base = _mm_set1_epi8('A');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i k25 = _mm_set1_epi8(25);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i p = _mm_loadu_si128((const __m128i*)(text + i));
+        __m128i t = _mm_sub_epi8(p, base);
+        __m128i ok = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(t, k25), t), _mm_cmpeq_epi8(p, space));
+        if (_mm_movemask_epi8(ok) != 0xFFFF)
+        {
+            break;
+        }
+    }
+    int valid = scanScalar(text + i, len - i, contentLen);
+    *contentLen += i;
+    return valid;
+}
+
+__attribute__((target("sse2")))
+static size_t encodeCheckedSSE2(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction)
+{
+    const __m128i base = _mm_set1_epi8('A');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i k25 = _mm_set1_epi8(25);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i p = _mm_loadu_si128((const __m128i*)(plaintext + i));
+        __m128i k = _mm_loadu_si128((const __m128i*)(key + i));
+        __m128i tp = _mm_sub_epi8(p, base);
+        __m128i tk = _mm_sub_epi8(k, base);
+        __m128i ok = _mm_and_si128(_mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(tp, k25), tp), _mm_cmpeq_epi8(p, space)),
+                                   _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(tk, k25), tk), _mm_cmpeq_epi8(k, space)));
+        if (_mm_movemask_epi8(ok) != 0xFFFF)
+        {
+            break;
+        }
+        encodeSSE2(plaintext + i, key + i, encryptedText + i, 16, direction);
+    }
+    return i + encodeCheckedScalar(plaintext + i, key + i, encryptedText + i, len - i, direction);
+}
+
+__attribute__((target("avx2")))
+static int scanAVX2(const char* text, size_t len, uint64_t* contentLen)
+{
+    const __m256i base = _mm256_set1_epi8('A');
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i k25 = _mm256_set1_epi8(25);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i p = _mm256_loadu_si256((const __m256i*)(text + i));
+        __m256i t = _mm256_sub_epi8(p, base);
+        __m256i ok = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(t, k25), t), _mm256_cmpeq_epi8(p, space));
+        if (_mm256_movemask_epi8(ok) != -1)
+        {
+            break;
+        }
+    }
+    int valid = scanSSE2(text + i, len - i, contentLen);
+    *contentLen += i;
+    return valid;
+}
+
+__attribute__((target("avx2")))
+static size_t encodeCheckedAVX2(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction)
+{
+    const __m256i base = _mm256_set1_epi8('A');
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i k25 = _mm256_set1_epi8(25);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i p = _mm256_loadu_si256((const __m256i*)(plaintext + i));
+        __m256i k = _mm256_loadu_si256((const __m256i*)(key + i));
+        __m256i tp = _mm256_sub_epi8(p, base);
+        __m256i tk = _mm256_sub_epi8(k, base);
+        __m256i ok = _mm256_and_si256(_mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(tp, k25), tp), _mm256_cmpeq_epi8(p, space)),
+                                      _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(tk, k25), tk), _mm256_cmpeq_epi8(k, space)));
+        if (_mm256_movemask_epi8(ok) != -1)
+        {
+            break;
+        }
+        encodeAVX2(plaintext + i, key + i, encryptedText + i, 32, direction);
+    }
+    return i + encodeCheckedSSE2(plaintext + i, key + i, encryptedText + i, len - i, direction);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static int scanAVX512(const char* text, size_t len, uint64_t* contentLen)
+{
+    const __m512i base = _mm512_set1_epi8('A');
+    const __m512i space = _mm512_set1_epi8(' ');
+    const __m512i k25 = _mm512_set1_epi8(25);
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+    {
+        __m512i p = _mm512_loadu_si512((const void*)(text + i));
+        __mmask64 ok = _mm512_cmple_epu8_mask(_mm512_sub_epi8(p, base), k25) | _mm512_cmpeq_epi8_mask(p, space);
+        if (ok != ~(__mmask64)0)
+        {
+            break;
+        }
+    }
+    int valid = scanAVX2(text + i, len - i, contentLen);
+    *contentLen += i;
+    return valid;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t encodeCheckedAVX512(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction)
+{
+    const __m512i base = _mm512_set1_epi8('A');
+    const __m512i space = _mm512_set1_epi8(' ');
+    const __m512i k25 = _mm512_set1_epi8(25);
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+    {
+        __m512i p = _mm512_loadu_si512((const void*)(plaintext + i));
+        __m512i k = _mm512_loadu_si512((const void*)(key + i));
+        __mmask64 ok = (_mm512_cmple_epu8_mask(_mm512_sub_epi8(p, base), k25) | _mm512_cmpeq_epi8_mask(p, space)) &
+                       (_mm512_cmple_epu8_mask(_mm512_sub_epi8(k, base), k25) | _mm512_cmpeq_epi8_mask(k, space));
+        if (ok != ~(__mmask64)0)
+        {
+            break;
+        }
+        encodeAVX512(plaintext + i, key + i, encryptedText + i, 64, direction);
+    }
+    return i + encodeCheckedAVX2(plaintext + i, key + i, encryptedText + i, len - i, direction);
+}
+
+#endif
+
+// Signatures of the fused kernels
+typedef int (*scanKernel)(const char* text, size_t len, uint64_t* contentLen);
+typedef size_t (*checkedKernel)(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction);
+
+// Kernels chosen by initEncoder()
+static encodeKernel activeEncoder = encodeScalar;
+static encodeKernel activeBytesEncoder = encodeBytesScalar;
+static scanKernel activeScanner = scanScalar;
+static checkedKernel activeChecked = encodeCheckedScalar;
+static const char* activeName = "scalar";
+
+/*********************************************************************
+** initEncoder()
+* Checks which instruction sets the CPU supports and points
+* encodeBlock() at the widest kernel available. Should be called once
+* at startup before any encoding is done. OTP_ENCODER in the
+* environment can force a narrower kernel.
+*********************************************************************/
+
+void initEncoder(void)
+{
+    const char* forced = getenv("OTP_ENCODER");
+    activeEncoder = encodeScalar;
+    activeBytesEncoder = encodeBytesScalar;
+    activeScanner = scanScalar;
+    activeChecked = encodeCheckedScalar;
+    activeName = "scalar";
+    if (forced != NULL && strcmp(forced, "scalar") == 0)
+    {
+        return;
+    }
+#ifdef OTP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+    {
+        activeEncoder = encodeSSE2;
+        activeBytesEncoder = encodeBytesSSE2;
+        activeScanner = scanSSE2;
+        activeChecked = encodeCheckedSSE2;
+        activeName = "sse2";
+        if (forced != NULL && strcmp(forced, "sse2") == 0)
+        {
+            return;
+        }
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        activeEncoder = encodeAVX2;
+        activeBytesEncoder = encodeBytesAVX2;
+        activeScanner = scanAVX2;
+        activeChecked = encodeCheckedAVX2;
+        activeName = "avx2";
+        if (forced != NULL && strcmp(forced, "avx2") == 0)
+        {
+            return;
+        }
+    }
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+    {
+        activeEncoder = encodeAVX512;
+        activeBytesEncoder = encodeBytesAVX512;
+        activeScanner = scanAVX512;
+        activeChecked = encodeCheckedAVX512;
+        activeName = "avx512";
+    }
+#endif
+}
+
+/*********************************************************************
+** encoderName()
+* Returns the name of the kernel picked by initEncoder().
+*********************************************************************/
+
+const char* encoderName(void)
+{
+    return activeName;
+}
+
+/*********************************************************************
+** encodeBlock()
+* Encrypts (direction OTP_ENCRYPT) or decrypts (OTP_DECRYPT) len
+* characters of text with the key using the kernel picked by
+* initEncoder(). Output matches encodeScalar() for any input made up of
+* characters from CHARS.
+*********************************************************************/
+
+void encodeBlock(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction)
+{
+    activeEncoder(plaintext, key, encryptedText, len, direction);
+}
+
+/*********************************************************************
+** encodeBytes()
+* Byte version of encodeBlock(): encrypts (or decrypts) len arbitrary
+* bytes by adding (or subtracting) the key bytes mod 256. Any byte is
+* valid, so there is nothing to check and no checked version.
+*********************************************************************/
+
+void encodeBytes(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction)
+{
+    activeBytesEncoder(plaintext, key, encryptedText, len, direction);
+}
+
+/*********************************************************************
+** scanText()
+* Finds where the contents of text end (the first newline, or len if
+* there is none) and checks that every character before that is from
+* CHARS, in one pass. Stores the length of the contents in contentLen.
+* Returns 1 if they are valid, 0 if not (and then contentLen is where
+* the first bad character is).
+*********************************************************************/
+
+int scanText(const char* text, size_t len, uint64_t* contentLen)
+{
+    return activeScanner(text, len, contentLen);
+}
+
+/*********************************************************************
+** encodeChecked()
+* Same as encodeBlock(), but checks that the plaintext and key only
+* hold characters from CHARS as it goes, so the daemon doesn't need a
+* separate pass over either. Returns how many characters were encoded:
+* len if all were valid, otherwise the position of the first bad one.
+*********************************************************************/
+
+size_t encodeChecked(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction)
+{
+    return activeChecked(plaintext, key, encryptedText, len, direction);
+}
@@ -0,0 +1,33 @@
+/*********************************************************************
+** otpcipher.h
+** Description: Function prototypes for the one time pad cipher kernels,
+* shared by the encrypt and decrypt sides.
+* The kernels are selected once at startup by initEncoder() based on
+* what the CPU supports. Until then the scalar kernels are used.
+*********************************************************************/
+
+#ifndef OTPCIPHER_H
+#define OTPCIPHER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OTP_ENCRYPT 0 // add the key to the text
+#define OTP_DECRYPT 1 // subtract the key from the text
+
+// Alphabets the kernels are specialized for
+#define OTP_ALPHABET_TEXT 27   // the symbols in CHARS, added mod 27
+#define OTP_ALPHABET_BYTES 256 // any byte, added mod 256
+
+// Signature shared by every encode kernel (scalar and SIMD)
+typedef void (*encodeKernel)(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction);
+
+void initEncoder(void);
+const char* encoderName(void);
+void encodeBlock(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction);
+void encodeBytes(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction);
+void encodeScalar(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction);
+int scanText(const char* text, size_t len, uint64_t* contentLen);
+size_t encodeChecked(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction);
+
+#endif
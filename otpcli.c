@@ -0,0 +1,809 @@
+/*********************************************************************
+** otpcli.c
+** Description: Client side of the one time pad programs, shared by
+* otp_enc and otp_dec. Given a textfile (plaintext for otp_enc,
+* ciphertext for otp_dec) and a OTP key file, encodes the textfile with
+* the key. Acts as a client to the matching daemon by sending the text
+* and key text. Receives the encoded text from the daemon and prints it
+* to stdout. Each client is a small main() that calls runClient() with
+* its name and auth code.
+* Uses mapFile() and the frame functions from otpshared.c
+* With -k the key comes from a pad registered with the daemon instead,
+* and only the text is sent. otp_dec needs -o to say where in the pad
+* the message's key starts (otp_enc prints it when encrypting).
+* With -b it encodes a list of files over one connection, keeping up
+* to -d requests in flight (see runBatch()).
+* With -s it encodes stdin to stdout as it arrives, taking the key
+* from the key file starting at -o (see runStream()).
+* With -S the text and key go through a shared memory ring instead of
+* the socket (see runShared()); port must then be the daemon's Unix
+* socket.
+* A port with a '/' in it is the daemon's Unix socket (see -u).
+* With -P text travels packed, five characters to three bytes (see
+* otppack.h), in every mode but -S.
+* With -B the text and key are arbitrary bytes, all of each file, and
+* the key is added mod 256; the output is raw bytes with no newline.
+* It works on a single file or with -s.
+* A request a busy daemon turns away with BUSY is sent again after the
+* wait it asks for, up to BUSY_ATTEMPTS times (except with -s or -S).
+* Usage: [name] [-P] [-S] [-B] [text] [key] [port]
+*        [name] [-P] -k [pad id] [-o pad offset] [text] [port]
+*        [name] [-P] -b [-d depth] [key] [port] [text]...
+*        [name] [-P] -b [-d depth] -k [pad id] [-o pad offset] [port] [text]...
+*        [name] [-P | -B] -s [-o key offset] [key] [port] < text
+*********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h> 
+#include <fcntl.h>
+#include "otpshared.h"
+#include "otpclient.h"
+#include "otpcipher.h"
+#include "otpcli.h"
+#include "otpshm.h"
+#include "otppack.h"
+#include "otpbuf.h"
+
+#define STREAM_SLOTS 4 // chunks of stdin in flight at once with -s
+#define MAPPED_CHUNK_SIZE (4 * 1024 * 1024) // plaintext bytes per DATA frame for a mapped file
+#define SHM_SLOTS 4 // chunks in flight at once with -S
+#define BUSY_ATTEMPTS 5 // times a request turned away with BUSY is sent before giving up
+
+// Which client this is, set by runClient()
+static const struct clientConfig* clientInfo;
+// -P: pack text on the wire
+static int packWire = 0;
+// -B: text and key are arbitrary bytes
+static int binaryText = 0;
+// Where a mapped file's chunks are packed and their results unpacked with -P
+static char* packScratch = NULL;
+static size_t packCapacity = 0;
+
+/********************************************************************* 
+** scratch()
+* Returns packScratch grown to at least size bytes, exiting if memory
+* runs out.
+*********************************************************************/
+
+char* scratch(size_t size)
+{
+    if (size > packCapacity)
+    {
+        putBuffer(packScratch, packCapacity);
+        packScratch = getBuffer(size, &packCapacity);
+        if (packScratch == NULL) error("CLIENT: ERROR allocating buffers");
+    }
+    return packScratch;
+}
+
+/********************************************************************* 
+** sendChunk()
+* Sends the next chunk (up to MAPPED_CHUNK_SIZE bytes) of the plaintext
+* and key starting at offset as a DATA frame, straight from the mapped
+* files. key is NULL when the daemon's pad supplies the key, and then
+* only plaintext is sent. With -P the chunk is packed into scratch()
+* first. Once offset reaches msgLen there is nothing left, so the END
+* frame is sent instead. Returns 0 on success, -1 on failure.
+*********************************************************************/
+
+int sendChunk(int socketFD, const char* plaintext, const char* key, uint64_t offset, uint64_t msgLen)
+{
+    if (offset >= msgLen)
+    {
+        return sendFrame(socketFD, OTP_FRAME_END, 0, offset, NULL, 0, NULL, 0);
+    }
+    size_t chunk = (msgLen - offset < MAPPED_CHUNK_SIZE) ? msgLen - offset : MAPPED_CHUNK_SIZE;
+    if (packWire)
+    {
+        unsigned char* packed = (unsigned char*)scratch(packedSize(chunk) * 2);
+        size_t textLen = packSymbols(plaintext + offset, chunk, packed);
+        size_t keyLen = key ? packSymbols(key + offset, chunk, packed + textLen) : 0;
+        return sendFrame(socketFD, OTP_FRAME_DATA, 0, offset, (char*)packed, textLen, (char*)packed + textLen, keyLen);
+    }
+    return sendFrame(socketFD, OTP_FRAME_DATA, 0, offset, plaintext + offset, chunk, key ? key + offset : NULL, key ? chunk : 0);
+}
+
+// One file in a batch run
+struct batchItem
+{
+    struct otpRequest req;
+    struct otpMapping plaintext; // file contents, sent in place
+    const char* key; // its part of the key file, NULL with a pad
+    char* output;    // ciphered text, filled in as RESULT frames arrive
+    int attempts;    // times it has been sent
+};
+
+/********************************************************************* 
+** batchResult()
+* RESULT callback for batch mode: copies the ciphered text into the
+* item's output buffer at the offset it belongs to.
+*********************************************************************/
+
+void batchResult(struct otpRequest* req, uint64_t offset, const char* data, size_t len)
+{
+    struct batchItem* item = req->userData;
+    memcpy(item->output + offset, data, len);
+}
+
+/********************************************************************* 
+** sendItem()
+* Queues a batch item's HELLO, DATA and END frames, exiting if the
+* connection's queue can't take them.
+*********************************************************************/
+
+void sendItem(struct otpConn* conn, struct batchItem* item)
+{
+    struct otpRequest* req = &item->req;
+    item->attempts++;
+    if (otpBegin(conn, req) < 0 ||
+        otpQueueData(conn, req, 0, item->plaintext.data, item->key, req->len) < 0 ||
+        otpFinish(conn, req) < 0)
+    {
+        error("CLIENT: ERROR queueing request");
+    }
+}
+
+/********************************************************************* 
+** runBatch()
+* Encodes every file in paths over one connection. Up to depth files
+* are in flight at once: each is sent as HELLO, DATA and END frames
+* without waiting for any reply, and replies are matched back up by
+* request id as the daemon finishes them. Ciphered text is printed one
+* line per file in the order the files were given. With a key file,
+* each file uses the key bytes following the previous file's, so no
+* key byte is used twice; with a pad, otp_enc_d picks each file's
+* range (not necessarily next to the last, as other clients and BUSY
+* retries take ranges too) and otp_dec_d is told each file's range
+* starting from padStart. Either way each file's pad range is printed
+* to stderr, as for a single file, since that is what decrypts it.
+* A file a busy daemon turns away is sent again once it is next to be
+* printed, after the wait the daemon asked for.
+* Returns 0 if every file was encoded, 1 otherwise.
+*********************************************************************/
+
+int runBatch(const char* keyPath, int usePad, uint32_t padId, uint64_t padStart, const char* port, char** paths, int count, int depth)
+{
+    struct otpMapping key;
+    size_t keyUsed = 0;
+    int status = 0;
+    int broken = 0; // the connection failed, nothing more can be sent
+
+    memset(&key, 0, sizeof(key));
+    if (!usePad)
+    {
+        if (mapFile(keyPath, &key) < 0)
+        {
+            fprintf(stderr, "Invalid key\n");
+            return 1;
+        }
+        if (!key.valid)
+        {
+            fprintf(stderr, "Key contains invalid chars\n");
+            return 1;
+        }
+    }
+
+    struct otpConn conn;
+    if (otpConnect(&conn, "localhost", port, clientInfo->authCode) < 0)
+    {
+        return 1;
+    }
+    conn.packed = packWire;
+    struct batchItem* items = calloc(count, sizeof(struct batchItem));
+    if (items == NULL) error("CLIENT: ERROR allocating batch");
+
+    int next = 0;    // next file to send
+    int printed = 0; // next file to print
+    while (printed < count)
+    {
+        // Keep the pipeline full
+        while (next < count && (broken || conn.inflightCount < depth))
+        {
+            struct batchItem* item = &items[next];
+            struct otpRequest* req = &item->req;
+            req->status = OTP_REQ_FAILED;
+            next++;
+            if (broken)
+            {
+                snprintf(req->errorMsg, sizeof(req->errorMsg), "connection failed");
+                continue;
+            }
+            if (mapFile(paths[next - 1], &item->plaintext) < 0)
+            {
+                snprintf(req->errorMsg, sizeof(req->errorMsg), "Invalid filename");
+                continue;
+            }
+            if (!item->plaintext.valid)
+            {
+                snprintf(req->errorMsg, sizeof(req->errorMsg), "%s contains invalid chars", paths[next - 1]);
+                continue;
+            }
+            req->len = item->plaintext.len;
+            if (!usePad)
+            {
+                if (key.len - keyUsed < req->len)
+                {
+                    snprintf(req->errorMsg, sizeof(req->errorMsg), "Key is too short to fully %s message", clientInfo->verb);
+                    continue;
+                }
+                item->key = key.data + keyUsed;
+                keyUsed += req->len;
+            }
+            item->output = malloc(req->len + 1);
+            if (item->output == NULL) error("CLIENT: ERROR allocating output");
+            req->usePad = usePad;
+            req->padId = padId;
+            req->padOffset = padStart;
+            padStart += req->len;
+            req->onResult = batchResult;
+            req->userData = item;
+            sendItem(&conn, item);
+        }
+        // Print everything that is finished, in order
+        while (printed < next && items[printed].req.status != OTP_REQ_PENDING)
+        {
+            struct batchItem* item = &items[printed];
+            if (item->req.status == OTP_REQ_BUSY && item->attempts < BUSY_ATTEMPTS && !broken)
+            {
+                usleep(item->req.retryAfterMs * 1000);
+                sendItem(&conn, item);
+                break;
+            }
+            if (item->req.status == OTP_REQ_DONE)
+            {
+                if (usePad)
+                {
+                    fprintf(stderr, "%s: %s pad %u offset %llu length %llu\n", clientInfo->name, paths[printed],
+                            padId, (unsigned long long)item->req.padOffset, (unsigned long long)item->req.len);
+                }
+                fwrite(item->output, 1, item->req.len, stdout);
+                printf("\n");
+            }
+            else
+            {
+                fprintf(stderr, "%s: %s\n", paths[printed], item->req.errorMsg);
+                status = 1;
+            }
+            unmapFile(&item->plaintext);
+            free(item->output);
+            printed++;
+        }
+        if (printed < count && !broken && otpPump(&conn, -1) < 0)
+        {
+            broken = 1;
+        }
+    }
+
+    otpDisconnect(&conn);
+    free(items);
+    unmapFile(&key);
+    return status;
+}
+
+// One chunk of stdin and its key, held until its ciphered text is back
+struct streamSlot
+{
+    char* plaintext;
+    char* key;
+    uint64_t offset;
+    size_t len;
+};
+
+// Ring of chunks in flight in stream mode, oldest at head
+struct streamState
+{
+    struct streamSlot slots[STREAM_SLOTS];
+    int head;
+    int count;
+};
+
+/********************************************************************* 
+** streamResult()
+* RESULT callback for stream mode: prints the ciphered text straight to
+* stdout and frees every chunk it completes for the next read.
+*********************************************************************/
+
+void streamResult(struct otpRequest* req, uint64_t offset, const char* data, size_t len)
+{
+    struct streamState* state = req->userData;
+    fwrite(data, 1, len, stdout);
+    while (state->count > 0)
+    {
+        struct streamSlot* slot = &state->slots[state->head];
+        if (slot->offset + slot->len > offset + len)
+        {
+            break;
+        }
+        state->head = (state->head + 1) % STREAM_SLOTS;
+        state->count--;
+    }
+}
+
+/********************************************************************* 
+** readKey()
+* Reads exactly len key bytes at offset in the key file into buffer.
+* Returns 1 on success, 0 if the key has invalid characters, -1 if the
+* key ends (or fails to read) first. With -B every byte is key.
+*********************************************************************/
+
+int readKey(int keyFD, char* buffer, size_t len, uint64_t offset)
+{
+    size_t got = 0;
+    while (got < len)
+    {
+        ssize_t n = pread(keyFD, buffer + got, len - got, offset + got);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        got += n;
+    }
+    if (binaryText)
+    {
+        return 1;
+    }
+    // The key file's contents end at its first newline
+    uint64_t content;
+    int valid = scanText(buffer, len, &content);
+    if (valid && content < len)
+    {
+        return -1;
+    }
+    return valid;
+}
+
+/********************************************************************* 
+** runStream()
+* Encrypts stdin to stdout over one request whose length isn't known
+* up front. Up to STREAM_SLOTS chunks are in flight: while one is being
+* encoded by the daemon the next is already read and queued, and the
+* ciphered text of the one before is written out as soon as it comes
+* back. stdin and the socket are polled together, so reading input,
+* sending and receiving all overlap, in bounded memory. Input ends at
+* EOF or the first newline (only EOF with -B). Key bytes are taken
+* from the key file starting at keyOffset. Returns 0 on success, 1 on
+* failure.
+*********************************************************************/
+
+int runStream(const char* keyPath, uint64_t keyOffset, const char* port)
+{
+    int keyFD = open(keyPath, O_RDONLY);
+    if (keyFD < 0)
+    {
+        fprintf(stderr, "Invalid key\n");
+        return 1;
+    }
+    struct streamState state;
+    memset(&state, 0, sizeof(state));
+    int i;
+    for (i = 0; i < STREAM_SLOTS; i++)
+    {
+        state.slots[i].plaintext = malloc(OTP_CHUNK_SIZE);
+        state.slots[i].key = malloc(OTP_CHUNK_SIZE);
+        if (state.slots[i].plaintext == NULL || state.slots[i].key == NULL) error("CLIENT: ERROR allocating buffers");
+    }
+
+    struct otpConn conn;
+    if (otpConnect(&conn, "localhost", port, clientInfo->authCode) < 0)
+    {
+        return 1;
+    }
+    conn.packed = packWire;
+    struct otpRequest req;
+    memset(&req, 0, sizeof(req));
+    req.len = OTP_LEN_UNKNOWN;
+    req.binary = binaryText;
+    req.onResult = streamResult;
+    req.userData = &state;
+    if (otpBegin(&conn, &req) < 0) error("CLIENT: ERROR queueing request");
+
+    uint64_t total = 0; // plaintext bytes read and queued so far
+    int inputDone = 0;
+    int status = 0;
+    while (req.status == OTP_REQ_PENDING)
+    {
+        struct pollfd pfd[2];
+        pfd[0].fd = conn.socketFD;
+        pfd[0].events = otpWantEvents(&conn);
+        pfd[1].fd = STDIN_FILENO;
+        pfd[1].events = POLLIN;
+        // Only read more input while there is a free slot to hold it
+        int watchInput = !inputDone && state.count < STREAM_SLOTS;
+        if (poll(pfd, watchInput ? 2 : 1, -1) < 0 && errno != EINTR)
+        {
+            perror("CLIENT: poll");
+            status = 1;
+            break;
+        }
+        if (watchInput && (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)))
+        {
+            struct streamSlot* slot = &state.slots[(state.head + state.count) % STREAM_SLOTS];
+            ssize_t n = read(STDIN_FILENO, slot->plaintext, OTP_CHUNK_SIZE);
+            if (n < 0 && errno != EINTR && errno != EAGAIN)
+            {
+                perror("CLIENT: ERROR reading stdin");
+                status = 1;
+                break;
+            }
+            if (n == 0)
+            {
+                inputDone = 1;
+            }
+            if (n > 0 && !binaryText)
+            {
+                // Validate and look for the newline in the same pass
+                uint64_t content;
+                if (!scanText(slot->plaintext, n, &content))
+                {
+                    fprintf(stderr, "stdin contains invalid chars\n");
+                    status = 1;
+                    break;
+                }
+                if (content < (uint64_t)n)
+                {
+                    n = content;
+                    inputDone = 1;
+                }
+            }
+            if (n > 0)
+            {
+                int keyStatus = readKey(keyFD, slot->key, n, keyOffset + total);
+                if (keyStatus <= 0)
+                {
+                    if (keyStatus < 0) fprintf(stderr, "Key is too short to fully %s message\n", clientInfo->verb);
+                    else fprintf(stderr, "Key contains invalid chars\n");
+                    status = 1;
+                    break;
+                }
+                slot->offset = total;
+                slot->len = n;
+                state.count++;
+                if (otpQueueData(&conn, &req, total, slot->plaintext, slot->key, n) < 0) error("CLIENT: ERROR queueing request");
+                total += n;
+            }
+            if (inputDone)
+            {
+                // END carries the length the message turned out to have
+                req.len = total;
+                if (otpFinish(&conn, &req) < 0) error("CLIENT: ERROR queueing request");
+            }
+        }
+        if (otpPump(&conn, 0) < 0)
+        {
+            break;
+        }
+    }
+    if (req.status == OTP_REQ_DONE)
+    {
+        if (!binaryText) printf("\n");
+    }
+    else if (status == 0)
+    {
+        fprintf(stderr, "%s\n", req.errorMsg);
+        status = 1;
+    }
+
+    otpDisconnect(&conn);
+    for (i = 0; i < STREAM_SLOTS; i++)
+    {
+        free(state.slots[i].plaintext);
+        free(state.slots[i].key);
+    }
+    close(keyFD);
+    return status;
+}
+
+/********************************************************************* 
+** runShared()
+* Encodes msgLen bytes of text with the key through a shared memory
+* ring with the daemon at port. Chunks of up to MAPPED_CHUNK_SIZE bytes
+* are copied into the ring's slots, SHM_SLOTS at a time, and each
+* result is printed straight from its slot. Returns 0 on success, 1 on
+* failure.
+*********************************************************************/
+
+int runShared(const char* text, const char* key, uint64_t msgLen, const char* port)
+{
+    struct otpShm shm;
+    size_t slotSize = (msgLen < MAPPED_CHUNK_SIZE) ? msgLen : MAPPED_CHUNK_SIZE;
+    if (otpShmOpen(&shm, "localhost", port, clientInfo->authCode, SHM_SLOTS, slotSize ? slotSize : 1) < 0)
+    {
+        return 1;
+    }
+    uint64_t queued = 0;
+    uint64_t written = 0;
+    int status = 0;
+    while (written < msgLen)
+    {
+        // Keep every slot busy
+        int slot;
+        while (queued < msgLen && (slot = otpShmNext(&shm)) >= 0)
+        {
+            size_t chunk = (msgLen - queued < slotSize) ? msgLen - queued : slotSize;
+            memcpy(otpShmText(&shm, slot), text + queued, chunk);
+            memcpy(otpShmKey(&shm, slot), key + queued, chunk);
+            otpShmSubmit(&shm, chunk);
+            queued += chunk;
+        }
+        slot = otpShmWait(&shm, OTP_IO_TIMEOUT_MS);
+        if (slot < 0)
+        {
+            fprintf(stderr, "%s: lost the daemon\n", clientInfo->name);
+            status = 1;
+            break;
+        }
+        if (otpShmStatus(&shm, slot) != OTP_SHM_OK)
+        {
+            fprintf(stderr, "%s: daemon rejected the input\n", clientInfo->name);
+            status = 1;
+            break;
+        }
+        size_t chunk = (msgLen - written < slotSize) ? msgLen - written : slotSize;
+        fwrite(otpShmText(&shm, slot), 1, chunk, stdout);
+        written += chunk;
+        otpShmRelease(&shm);
+    }
+    if (status == 0)
+    {
+        printf("\n");
+    }
+    otpShmClose(&shm);
+    return status;
+}
+
+/*
+   Summary: Maps the plaintext and key files, then verifies the validity
+   of both and measures their contents in one pass. Authenticates itself
+   with the server with a HELLO frame giving the message size, sending
+   the first chunk right behind it instead of waiting for the ACK. Then
+   sends the plaintext and key in MAPPED_CHUNK_SIZE pieces straight from
+   the mapped pages (big enough for the daemon to encode them in
+   parallel), one DATA frame at a time, printing each RESULT frame of
+   ciphered text to stdout as it comes back. Nothing is copied on the
+   way to the socket.
+*/
+
+int runClient(int argc, char *argv[], const struct clientConfig* config)
+{
+	struct otpMapping plaintext; // plaintext file contents
+	struct otpMapping key;       // key file contents, unless a pad is used
+	uint64_t msgLen;
+	int usePad = 0;
+	uint32_t padId = 0;
+	int batch = 0;
+	int stream = 0;
+	int shared = 0;
+	uint64_t keyOffset = 0;
+	int depth = 16;
+	int opt;
+
+	clientInfo = config;
+	// Pick the fastest validation and packing kernels this CPU supports
+	initEncoder();
+	initPacker();
+	while ((opt = getopt(argc, argv, "k:bd:so:SPB")) != -1)
+	{
+	    switch (opt)
+	    {
+	    case 'k':
+	        usePad = 1;
+	        padId = strtoul(optarg, NULL, 10);
+	        break;
+	    case 'b':
+	        batch = 1;
+	        break;
+	    case 's':
+	        stream = 1;
+	        break;
+	    case 'S':
+	        shared = 1;
+	        break;
+	    case 'P':
+	        packWire = 1;
+	        break;
+	    case 'B':
+	        binaryText = 1;
+	        break;
+	    case 'o':
+	        keyOffset = strtoull(optarg, NULL, 10);
+	        break;
+	    case 'd':
+	        depth = atoi(optarg);
+	        if (depth < 1) depth = 1;
+	        if (depth > OTP_MAX_INFLIGHT) depth = OTP_MAX_INFLIGHT;
+	        break;
+	    default:
+	        exit(0);
+	    }
+	}
+	// Pads, packing and the shared memory ring only carry CHARS
+	if (binaryText && (usePad || batch || shared || packWire))
+	{
+	    fprintf(stderr, "%s: -B can't be used with -k, -b, -S or -P\n", config->name);
+	    return 1;
+	}
+	if (stream)
+	{
+	    // -s [-o key offset] [key file] port < plaintext
+	    if (usePad || argc - optind < 2)
+	    {
+	        fprintf(stderr,"USAGE: %s [-P | -B] -s [-o key offset] [key file] port < text\n", argv[0]);
+	        exit(0);
+	    }
+	    return runStream(argv[optind], keyOffset, argv[optind + 1]);
+	}
+	if (batch)
+	{
+	    // -b [-d depth] [key file] port [plaintext file]...
+	    if (argc - optind < (usePad ? 1 : 2))
+	    {
+	        fprintf(stderr,"USAGE: %s [-P] -b [-d depth] [key file] port [text file]...\n       %s [-P] -b [-d depth] -k pad_id [-o pad offset] port [text file]...\n", argv[0], argv[0]);
+	        exit(0);
+	    }
+	    int first = optind + (usePad ? 1 : 2);
+	    return runBatch(usePad ? NULL : argv[optind], usePad, padId, keyOffset, argv[first - 1], argv + first, argc - first, depth);
+	}
+    // Check usage & args: a pad replaces the key file
+	if (argc - optind < (usePad ? 2 : 3))
+	{
+	    fprintf(stderr,"USAGE: %s [-P] [-S] [-B] [text file] [key file] port\n       %s [-P] -k pad_id [-o pad offset] [text file] port\n", argv[0], argv[0]);
+	    exit(0);
+	}
+	const char* plaintextPath = argv[optind];
+	const char* keyPath = usePad ? NULL : argv[optind + 1];
+	const char* port = argv[usePad ? optind + 1 : optind + 2];
+    
+    // Validate the plaintext and key files and measure their contents.
+    // Binary files are used whole.
+    int (*mapper)(const char* path, struct otpMapping* map) = binaryText ? mapBinary : mapFile;
+    if (mapper(plaintextPath, &plaintext) < 0)
+    {
+        fprintf(stderr, "Invalid filename\n");
+        return 1;
+    }
+    // mapFile checked for invalid characters while measuring
+    if (!plaintext.valid)
+    {
+        fprintf(stderr, "%s contains invalid chars\n", plaintextPath);
+        return 1;
+    }
+    msgLen = plaintext.len;
+    // Do the same  as above for the key file
+    memset(&key, 0, sizeof(key));
+    if (!usePad)
+    {
+        if (mapper(keyPath, &key) < 0)
+        {
+            fprintf(stderr, "Invalid key\n");
+            return 1;
+        }
+        if (!key.valid)
+        {
+            fprintf(stderr, "Key contains invalid chars\n");
+            return 1;
+        }
+
+        // Ensure the key is long enough to encode the plaintext
+        if (key.len < msgLen)
+        {
+            fprintf(stderr, "Key is too short to fully %s message\n", clientInfo->verb);
+            return 1;
+        }
+    }
+    const char* keyData = usePad ? NULL : key.data;
+    if (shared)
+    {
+        // The ring carries the key, so a pad can't be used with it
+        int status = usePad ? 1 : runShared(plaintext.data, keyData, msgLen, port);
+        if (usePad) fprintf(stderr, "%s: -S can't be used with -k\n", config->name);
+        unmapFile(&plaintext);
+        unmapFile(&key);
+        return status;
+    }
+    
+	// Connect to server, over its Unix socket when port is a path
+	int socketFD = connectDaemon("localhost", port);
+	if (socketFD < 0) exit(0);
+	
+	// Send the HELLO frame. The code lets the server know which client
+	// this is and how big of a message to expect, and which pad to use.
+	struct otpFrame hello;
+	unsigned char padStart[OTP_PAD_OFFSET_SIZE];
+	memset(&hello, 0, sizeof(hello));
+	hello.type = OTP_FRAME_HELLO;
+	hello.flags = (usePad ? OTP_FLAG_PAD : 0) | (packWire ? OTP_FLAG_PACKED : 0) | (binaryText ? OTP_FLAG_BINARY : 0);
+	hello.padId = padId;
+	hello.offset = msgLen;
+	hello.len0 = OTP_AUTH_SIZE;
+	if (usePad)
+	{
+	    put64(padStart, keyOffset);
+	    hello.len1 = OTP_PAD_OFFSET_SIZE;
+	}
+	const char* encrypted;                    // points at the RESULT frame body
+	struct otpFrame frame;
+	struct otpReader reader;
+	uint64_t sent = 0;
+	if (initReader(&reader, socketFD) < 0) exit(1);
+	
+	// Don't wait for the ack before sending: the first chunk goes out right
+	// behind HELLO, and if the server rejects us it answers ERROR instead.
+	// A busy server answers BUSY and drops the chunk, and then HELLO goes
+	// again after the wait it asks for (which getAck() leaves in
+	// padOffset), this time alone: the chunk only follows the ACK, so a
+	// server that stays busy isn't sent it over and over.
+	int status = 1;
+	uint64_t padOffset = 0;
+	int confirm = -1;
+	int attempt;
+	for (attempt = 0; confirm == -1 && attempt < BUSY_ATTEMPTS; attempt++)
+	{
+	    if (attempt > 0) usleep(padOffset * 1000);
+	    if (sendFramed(socketFD, &hello, config->authCode, (const char*)padStart) < 0) exit(1);
+	    if (attempt == 0 && sendChunk(socketFD, plaintext.data, keyData, sent, msgLen) < 0) exit(1);
+	    // Get ack/confirmation from server that further transmissions are okay
+	    confirm = getAck(&reader, OTP_ACK_TIMEOUT_MS, &padOffset);
+	    if (attempt > 0 && confirm == 1 && sendChunk(socketFD, plaintext.data, keyData, sent, msgLen) < 0) exit(1);
+	}
+	if (confirm == -1)
+	{
+	    fprintf(stderr, "%s: daemon too busy, gave up after %d tries\n", config->name, BUSY_ATTEMPTS);
+	}
+	if (confirm == 1)
+	{
+	    // The key range has to be known to decrypt later
+	    if (usePad)
+	    {
+	        fprintf(stderr, "%s: pad %u offset %llu length %llu\n", config->name, padId, (unsigned long long)padOffset, (unsigned long long)msgLen);
+	    }
+	    while (sent < msgLen)
+	    {
+	        size_t chunk = (msgLen - sent < MAPPED_CHUNK_SIZE) ? msgLen - sent : MAPPED_CHUNK_SIZE;
+	        // Print the ciphered text for the chunk in flight, then send the next
+	        if (recvFrame(&reader, &frame, &encrypted) < 0) exit(1);
+	        uint64_t got = frame.len0;
+	        if (packWire && frame.type == OTP_FRAME_RESULT)
+	        {
+	            // Unpack into scratch(): the chunk it held has been sent already
+	            char* unpacked = scratch(chunk);
+	            if (unpackedLength((const unsigned char*)encrypted, frame.len0, &got) < 0 || got != chunk ||
+	                unpackSymbols((const unsigned char*)encrypted, frame.len0, unpacked) < 0)
+	            {
+	                fprintf(stderr, "CLIENT: malformed packed result\n");
+	                exit(1);
+	            }
+	            encrypted = unpacked;
+	        }
+	        if (frame.type != OTP_FRAME_RESULT || frame.offset != sent || got != chunk)
+	        {
+	            if (frame.type == OTP_FRAME_ERROR) fprintf(stderr, "%.*s\n", (int)frame.len0, encrypted);
+	            else fprintf(stderr, "CLIENT: unexpected frame from server\n");
+	            exit(1);
+	        }
+	        fwrite(encrypted, 1, chunk, stdout);
+	        sent += chunk;
+	        if (sendChunk(socketFD, plaintext.data, keyData, sent, msgLen) < 0) exit(1);
+	    }
+	    // Wait for the server to agree the message is over
+	    if (recvFrame(&reader, &frame, &encrypted) < 0 || frame.type != OTP_FRAME_END) exit(1);
+	    if (!binaryText) printf("\n");
+	    status = 0;
+	}
+	freeReader(&reader);
+	
+	// Shut socket from any further transmissions
+	shutdown(socketFD, SHUT_RDWR);
+	unmapFile(&plaintext);
+	unmapFile(&key);
+	close(socketFD); // Close the socket
+	return status;
+}
@@ -0,0 +1,20 @@
+/*********************************************************************
+** otpcli.h
+** Description: Entry point of the client side shared by otp_enc and
+* otp_dec. Each client describes itself with a clientConfig and hands
+* its command line to runClient().
+*********************************************************************/
+
+#ifndef OTPCLI_H
+#define OTPCLI_H
+
+struct clientConfig
+{
+    const char* name;     // client name used in messages, e.g. "otp_enc"
+    const char* authCode; // code sent in HELLO, must match the daemon's
+    const char* verb;     // what it does to a message, e.g. "encrypt"
+};
+
+int runClient(int argc, char *argv[], const struct clientConfig* config);
+
+#endif
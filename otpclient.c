@@ -0,0 +1,603 @@
+/*********************************************************************
+** otpclient.c
+** Description: Client side connection engine for the one time pad
+* programs. A connection is opened once and then carries any number of
+* requests, several at a time. Frames are queued with otpBegin(),
+* otpQueueData() and otpFinish() and written by otpPump() without
+* blocking, batching as many queued frames into one sendmsg() as the
+* socket takes. otpPump() also reads replies and hands them to the
+* request they belong to, in whatever order the daemon finishes them.
+*********************************************************************/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include "otpshared.h"
+#include "otpclient.h"
+#include "otpbuf.h"
+#include "otppack.h"
+
+#define OTP_MAX_IOV 192 // iovecs gathered into one sendmsg()
+
+/*********************************************************************
+** otpConnect()
+* Connects to the daemon on host:port (or its Unix socket, when port
+* is a path, see connectDaemon()), switches the socket to
+* non-blocking mode and sets up the connection's reader and send
+* queue. authCode is sent with every HELLO. Returns 0 on success, -1
+* on failure (with the reason printed).
+*********************************************************************/
+
+static pthread_once_t packerPicked = PTHREAD_ONCE_INIT;
+
+static int setupConn(struct otpConn* conn, int socketFD, const char* authCode)
+{
+	// Programs embedding the library never call initPacker() themselves
+	pthread_once(&packerPicked, initPacker);
+	conn->authCode = authCode;
+	conn->socketFD = socketFD;
+	conn->queueCapacity = 64;
+	conn->queue = malloc(conn->queueCapacity * sizeof(struct otpOutFrame));
+	if (conn->queue == NULL || initReader(&conn->reader, conn->socketFD) < 0)
+	{
+	    free(conn->queue);
+	    close(conn->socketFD);
+	    return -1;
+	}
+	return 0;
+}
+
+int otpConnect(struct otpConn* conn, const char* host, const char* port, const char* authCode)
+{
+	memset(conn, 0, sizeof(*conn));
+	int socketFD = connectDaemon(host, port);
+	if (socketFD < 0)
+	{
+	    return -1;
+	}
+	fcntl(socketFD, F_SETFL, fcntl(socketFD, F_GETFL, 0) | O_NONBLOCK);
+	return setupConn(conn, socketFD, authCode);
+}
+
+/*********************************************************************
+** otpConnectAddr()
+* Same as otpConnect(), to an address from resolveDaemon(), but
+* without blocking: the connect is only started, and conn->connecting
+* stays set until otpPump() sees it finish. Frames may be queued
+* meanwhile. Returns 0 once the connect is under way, -1 on failure
+* (with the reason printed), or OTP_CONNECT_AGAIN, quietly, when the
+* daemon's Unix socket has a full backlog and the connect should be
+* tried again shortly (conn is left closed then too).
+*********************************************************************/
+
+int otpConnectAddr(struct otpConn* conn, const struct sockaddr_storage* addr, socklen_t addrLen, const char* authCode)
+{
+	memset(conn, 0, sizeof(*conn));
+	int socketFD = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (socketFD < 0)
+	{
+	    perror("CLIENT: ERROR opening socket");
+	    return -1;
+	}
+	if (addr->ss_family == AF_INET)
+	{
+	    // Frames go out in small pieces, don't let Nagle hold them back
+	    int noDelay = 1;
+	    setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+	}
+	if (connect(socketFD, (const struct sockaddr*)addr, addrLen) < 0)
+	{
+	    // A Unix socket whose backlog is full says EAGAIN rather than queue us
+	    if (errno == EAGAIN)
+	    {
+	        close(socketFD);
+	        return OTP_CONNECT_AGAIN;
+	    }
+	    if (errno != EINPROGRESS)
+	    {
+	        perror("CLIENT: ERROR connecting");
+	        close(socketFD);
+	        return -1;
+	    }
+	    conn->connecting = 1;
+	}
+	return setupConn(conn, socketFD, authCode);
+}
+
+/*********************************************************************
+** otpDisconnect()
+* Closes the connection and frees its buffers. Requests still in
+* flight are abandoned without their callbacks being run.
+*********************************************************************/
+
+void otpDisconnect(struct otpConn* conn)
+{
+    if (conn->socketFD >= 0)
+    {
+        shutdown(conn->socketFD, SHUT_RDWR);
+        close(conn->socketFD);
+        conn->socketFD = -1;
+    }
+    freeReader(&conn->reader);
+    while (conn->queueCount > 0)
+    {
+        struct otpOutFrame* out = &conn->queue[conn->queueHead];
+        putBuffer(out->owned, out->ownedSize);
+        conn->queueHead = (conn->queueHead + 1) % conn->queueCapacity;
+        conn->queueCount--;
+    }
+    free(conn->queue);
+    conn->queue = NULL;
+    putBuffer(conn->unpacked, conn->unpackedCapacity);
+    conn->unpacked = NULL;
+}
+
+/*********************************************************************
+** queueFrame()
+* Adds a frame to the back of the send queue, growing the queue if it
+* is full. Nothing is written until the next flushQueue(). owned, if
+* not NULL, is a buffer from getBuffer() holding the segments, given
+* back once the frame is written.
+* Returns 0 on success, -1 if memory ran out.
+*********************************************************************/
+
+static int queueFrame(struct otpConn* conn, const struct otpFrame* frame, const char* seg0, const char* seg1,
+                      char* owned, size_t ownedSize)
+{
+    if (conn->queueCount == conn->queueCapacity)
+    {
+        size_t newCapacity = conn->queueCapacity * 2;
+        struct otpOutFrame* grown = malloc(newCapacity * sizeof(struct otpOutFrame));
+        if (grown == NULL)
+        {
+            perror("CLIENT: queue");
+            return -1;
+        }
+        size_t i;
+        for (i = 0; i < conn->queueCount; i++)
+        {
+            grown[i] = conn->queue[(conn->queueHead + i) % conn->queueCapacity];
+        }
+        free(conn->queue);
+        conn->queue = grown;
+        conn->queueCapacity = newCapacity;
+        conn->queueHead = 0;
+    }
+    struct otpOutFrame* out = &conn->queue[(conn->queueHead + conn->queueCount) % conn->queueCapacity];
+    struct otpFrame header = *frame;
+    header.version = OTP_VERSION;
+    packFrame(&header, out->header);
+    out->seg0 = seg0;
+    out->seg1 = seg1;
+    out->len0 = header.len0;
+    out->len1 = header.len1;
+    out->sent = 0;
+    out->owned = owned;
+    out->ownedSize = ownedSize;
+    conn->queueCount++;
+    return 0;
+}
+
+/*********************************************************************
+** flushQueue()
+* Writes as much of the send queue as the socket will take right now.
+* Queued frames are gathered into one sendmsg() call (up to
+* OTP_MAX_IOV pieces at a time), so a burst of small frames costs one
+* system call. Returns 0 on success (even if some frames are still
+* queued), -1 if the socket failed.
+*********************************************************************/
+
+static int flushQueue(struct otpConn* conn)
+{
+    while (conn->queueCount > 0)
+    {
+        struct iovec iov[OTP_MAX_IOV];
+        int iovcnt = 0;
+        size_t i;
+        for (i = 0; i < conn->queueCount && iovcnt + 3 <= OTP_MAX_IOV; i++)
+        {
+            struct otpOutFrame* out = &conn->queue[(conn->queueHead + i) % conn->queueCapacity];
+            const char* pieces[3] = { (const char*)out->header, out->seg0, out->seg1 };
+            size_t lengths[3] = { OTP_HEADER_SIZE, out->len0, out->len1 };
+            size_t skip = out->sent;
+            int p;
+            for (p = 0; p < 3; p++)
+            {
+                if (skip >= lengths[p])
+                {
+                    skip -= lengths[p];
+                    continue;
+                }
+                iov[iovcnt].iov_base = (void*)(pieces[p] + skip);
+                iov[iovcnt].iov_len = lengths[p] - skip;
+                iovcnt++;
+                skip = 0;
+            }
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t charsSent = sendmsg(conn->socketFD, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (charsSent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            perror("CLIENT: ERROR writing to socket");
+            return -1;
+        }
+        // Retire every frame that went out completely
+        size_t done = charsSent;
+        while (done > 0)
+        {
+            struct otpOutFrame* out = &conn->queue[conn->queueHead];
+            size_t left = OTP_HEADER_SIZE + out->len0 + out->len1 - out->sent;
+            if (done < left)
+            {
+                out->sent += done;
+                break;
+            }
+            done -= left;
+            putBuffer(out->owned, out->ownedSize);
+            conn->queueHead = (conn->queueHead + 1) % conn->queueCapacity;
+            conn->queueCount--;
+        }
+    }
+    return 0;
+}
+
+/*********************************************************************
+** findRequest()
+* Returns the in-flight request with the given id, or NULL.
+*********************************************************************/
+
+static struct otpRequest* findRequest(struct otpConn* conn, uint32_t id)
+{
+    struct otpRequest* req = conn->inflight[id % OTP_MAX_INFLIGHT];
+    return (req != NULL && req->id == id) ? req : NULL;
+}
+
+/*********************************************************************
+** finishRequest()
+* Marks a request done or failed, takes it out of the in-flight table
+* and runs its onDone callback.
+*********************************************************************/
+
+static void finishRequest(struct otpConn* conn, struct otpRequest* req, int status)
+{
+    req->status = status;
+    conn->inflight[req->id % OTP_MAX_INFLIGHT] = NULL;
+    conn->inflightCount--;
+    if (req->onDone)
+    {
+        req->onDone(req);
+    }
+}
+
+/*********************************************************************
+** otpBegin()
+* Starts a request: gives it an id and queues its HELLO frame. Data
+* may be queued right behind it without waiting for the ACK. Returns
+* 0 on success, -1 if OTP_MAX_INFLIGHT requests are already open.
+*********************************************************************/
+
+int otpBegin(struct otpConn* conn, struct otpRequest* req)
+{
+    if (conn->inflightCount == OTP_MAX_INFLIGHT)
+    {
+        return -1;
+    }
+    // Find a free slot, ids only repeat after 2^32 requests
+    while (conn->inflight[conn->nextId % OTP_MAX_INFLIGHT] != NULL)
+    {
+        conn->nextId++;
+    }
+    req->id = conn->nextId++;
+    req->received = 0;
+    req->status = OTP_REQ_PENDING;
+    req->errorMsg[0] = '\0';
+
+    struct otpFrame hello;
+    memset(&hello, 0, sizeof(hello));
+    hello.type = OTP_FRAME_HELLO;
+    hello.requestId = req->id;
+    // Binary text can't be packed, it goes as it is even on a packed connection
+    hello.flags = (req->usePad ? OTP_FLAG_PAD : 0) | (req->binary ? OTP_FLAG_BINARY : 0) |
+                  (conn->packed && !req->binary ? OTP_FLAG_PACKED : 0);
+    hello.padId = req->padId;
+    hello.offset = req->len;
+    hello.len0 = OTP_AUTH_SIZE;
+    if (req->usePad)
+    {
+        put64(req->helloOffset, req->padOffset);
+        hello.len1 = OTP_PAD_OFFSET_SIZE;
+    }
+    if (queueFrame(conn, &hello, conn->authCode, (const char*)req->helloOffset, NULL, 0) < 0)
+    {
+        return -1;
+    }
+    conn->inflight[req->id % OTP_MAX_INFLIGHT] = req;
+    conn->inflightCount++;
+    return 0;
+}
+
+/*********************************************************************
+** otpQueueData()
+* Queues len bytes of plaintext (and key, NULL when a pad is used)
+* starting at offset within the request's message, split into DATA
+* frames of at most OTP_CHUNK_SIZE bytes. The buffers are sent in
+* place and must stay valid until the request finishes, unless the
+* connection is packed: then each chunk is packed into a buffer of its
+* own as it is queued.
+* Returns 0 on success, -1 if memory ran out.
+*********************************************************************/
+
+int otpQueueData(struct otpConn* conn, struct otpRequest* req, uint64_t offset, const char* plaintext, const char* key, size_t len)
+{
+    struct otpFrame data;
+    memset(&data, 0, sizeof(data));
+    data.type = OTP_FRAME_DATA;
+    data.requestId = req->id;
+    while (len > 0)
+    {
+        size_t chunk = (len < OTP_CHUNK_SIZE) ? len : OTP_CHUNK_SIZE;
+        data.offset = offset;
+        data.len0 = chunk;
+        data.len1 = key ? chunk : 0;
+        const char* seg0 = plaintext;
+        const char* seg1 = key;
+        char* owned = NULL;
+        size_t ownedSize = 0;
+        if (conn->packed && !req->binary)
+        {
+            owned = getBuffer(packedSize(chunk) * (key ? 2 : 1), &ownedSize);
+            if (owned == NULL)
+            {
+                perror("CLIENT: pack");
+                return -1;
+            }
+            data.len0 = packSymbols(plaintext, chunk, (unsigned char*)owned);
+            data.len1 = key ? packSymbols(key, chunk, (unsigned char*)owned + data.len0) : 0;
+            seg0 = owned;
+            seg1 = owned + data.len0;
+        }
+        if (queueFrame(conn, &data, seg0, seg1, owned, ownedSize) < 0)
+        {
+            putBuffer(owned, ownedSize);
+            return -1;
+        }
+        offset += chunk;
+        plaintext += chunk;
+        if (key)
+        {
+            key += chunk;
+        }
+        len -= chunk;
+    }
+    return 0;
+}
+
+/*********************************************************************
+** otpFinish()
+* Queues the END frame that closes a request's message.
+* Returns 0 on success, -1 if memory ran out.
+*********************************************************************/
+
+int otpFinish(struct otpConn* conn, struct otpRequest* req)
+{
+    struct otpFrame end;
+    memset(&end, 0, sizeof(end));
+    end.type = OTP_FRAME_END;
+    end.requestId = req->id;
+    end.offset = req->len;
+    return queueFrame(conn, &end, NULL, NULL, NULL, 0);
+}
+
+/*********************************************************************
+** unpackResult()
+* Unpacks a packed RESULT body into the connection's buffer, pointing
+* body at it and storing the number of characters in len. Returns 0
+* on success, -1 if it isn't valid packed text or memory ran out.
+*********************************************************************/
+
+static int unpackResult(struct otpConn* conn, const struct otpFrame* frame, const char** body, uint64_t* len)
+{
+    if (unpackedLength((const unsigned char*)*body, frame->len0, len) < 0)
+    {
+        return -1;
+    }
+    if (*len > conn->unpackedCapacity)
+    {
+        putBuffer(conn->unpacked, conn->unpackedCapacity);
+        conn->unpacked = getBuffer(*len, &conn->unpackedCapacity);
+        if (conn->unpacked == NULL)
+        {
+            conn->unpackedCapacity = 0;
+            return -1;
+        }
+    }
+    if (unpackSymbols((const unsigned char*)*body, frame->len0, conn->unpacked) < 0)
+    {
+        return -1;
+    }
+    *body = conn->unpacked;
+    return 0;
+}
+
+/*********************************************************************
+** handleReply()
+* Routes one frame from the daemon to the request it answers. An
+* ERROR not tied to an open request (a rejected auth code, say) fails
+* the whole connection. A packed RESULT is unpacked (see
+* unpackResult()) before onResult sees it. BUSY ends the request with
+* OTP_REQ_BUSY, leaving the caller to send it again later.
+* Returns 0 to keep going, -1 on a connection level error.
+*********************************************************************/
+
+static int handleReply(struct otpConn* conn, const struct otpFrame* frame, const char* body)
+{
+    struct otpRequest* req = findRequest(conn, frame->requestId);
+    if (req == NULL)
+    {
+        if (frame->type == OTP_FRAME_ERROR)
+        {
+            fprintf(stderr, "%.*s\n", (int)frame->len0, body);
+        }
+        else
+        {
+            fprintf(stderr, "CLIENT: reply for unknown request %u\n", frame->requestId);
+        }
+        return -1;
+    }
+    switch (frame->type)
+    {
+    case OTP_FRAME_ACK:
+        req->padOffset = frame->offset;
+        break;
+    case OTP_FRAME_RESULT:
+    {
+        uint64_t len = frame->len0;
+        if (conn->packed && !req->binary && unpackResult(conn, frame, &body, &len) < 0)
+        {
+            fprintf(stderr, "CLIENT: malformed packed result\n");
+            return -1;
+        }
+        if (req->onResult)
+        {
+            req->onResult(req, frame->offset, body, len);
+        }
+        req->received += len;
+        break;
+    }
+    case OTP_FRAME_END:
+        finishRequest(conn, req, OTP_REQ_DONE);
+        break;
+    case OTP_FRAME_ERROR:
+        snprintf(req->errorMsg, sizeof(req->errorMsg), "%.*s", (int)frame->len0, body);
+        finishRequest(conn, req, OTP_REQ_FAILED);
+        break;
+    case OTP_FRAME_BUSY:
+        req->retryAfterMs = frame->offset;
+        snprintf(req->errorMsg, sizeof(req->errorMsg), "daemon busy, retry after %llu ms", (unsigned long long)frame->offset);
+        finishRequest(conn, req, OTP_REQ_BUSY);
+        break;
+    default:
+        fprintf(stderr, "CLIENT: unexpected frame type %d\n", frame->type);
+        return -1;
+    }
+    return 0;
+}
+
+/*********************************************************************
+** otpWantEvents()
+* Returns the poll() events the connection is waiting for, so callers
+* that also watch other descriptors can poll them all together and
+* then call otpPump() with a timeout of 0.
+*********************************************************************/
+
+short otpWantEvents(struct otpConn* conn)
+{
+    if (conn->connecting)
+    {
+        return POLLOUT;
+    }
+    return POLLIN | (conn->queueCount > 0 ? POLLOUT : 0);
+}
+
+/*********************************************************************
+** otpPump()
+* Runs the connection once: waits up to timeoutMs (0 to not wait at
+* all, -1 forever) until the socket can be written or read, writes
+* what the send queue holds, then handles every reply that has fully
+* arrived. While a connect from otpConnectAddr() is still under way,
+* it only checks whether that has finished. On a connection error every open request is failed.
+* Returns 0 on success, -1 if the connection is no longer usable.
+*********************************************************************/
+
+int otpPump(struct otpConn* conn, int timeoutMs)
+{
+    struct pollfd pfd;
+    pfd.fd = conn->socketFD;
+    pfd.events = otpWantEvents(conn);
+    pfd.revents = 0;
+    if (poll(&pfd, 1, timeoutMs) < 0 && errno != EINTR)
+    {
+        perror("CLIENT: poll");
+        goto failed;
+    }
+    if (conn->connecting)
+    {
+        // The socket turns writable once the connect has finished, one way or the other
+        if (!(pfd.revents & (POLLOUT | POLLERR | POLLHUP)))
+        {
+            return 0;
+        }
+        int connectError = 0;
+        socklen_t errorLen = sizeof(connectError);
+        if (getsockopt(conn->socketFD, SOL_SOCKET, SO_ERROR, &connectError, &errorLen) < 0 || connectError != 0)
+        {
+            if (connectError != 0) errno = connectError;
+            perror("CLIENT: ERROR connecting");
+            goto failed;
+        }
+        conn->connecting = 0;
+    }
+    if (flushQueue(conn) < 0)
+    {
+        goto failed;
+    }
+    while (1)
+    {
+        struct otpFrame frame;
+        const char* body;
+        int got = nextFrame(&conn->reader, &frame, &body, 0);
+        if (got == 0)
+        {
+            break;
+        }
+        if (got < 0)
+        {
+            if (conn->reader.eof && conn->inflightCount > 0)
+            {
+                fprintf(stderr, "CLIENT: server closed the connection\n");
+            }
+            goto failed;
+        }
+        if (handleReply(conn, &frame, body) < 0)
+        {
+            goto failed;
+        }
+    }
+    return 0;
+
+failed:
+    {
+        // Nothing more will arrive for the open requests
+        int i;
+        for (i = 0; i < OTP_MAX_INFLIGHT; i++)
+        {
+            if (conn->inflight[i] != NULL)
+            {
+                snprintf(conn->inflight[i]->errorMsg, sizeof(conn->inflight[i]->errorMsg), "connection failed");
+                finishRequest(conn, conn->inflight[i], OTP_REQ_FAILED);
+            }
+        }
+    }
+    return -1;
+}
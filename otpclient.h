@@ -0,0 +1,94 @@
+/*********************************************************************
+** otpclient.h
+** Description: Function prototypes for the client side connection
+* engine. One connection carries many requests at once; frames for
+* them are queued, written without blocking and matched back up by
+* request id as replies arrive. With packed set, text is packed on
+* the way out and unpacked on the way in, so callers never see it.
+*********************************************************************/
+
+#ifndef OTPCLIENT_H
+#define OTPCLIENT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "otpshared.h"
+
+#define OTP_REQ_PENDING 0
+#define OTP_REQ_DONE 1
+#define OTP_REQ_FAILED -1
+#define OTP_REQ_BUSY -2 // turned away by a busy daemon, may be sent again after retryAfterMs
+
+#define OTP_CONNECT_AGAIN 1 // otpConnectAddr(): the daemon's Unix socket backlog is full
+
+struct otpRequest;
+// Called for every RESULT frame; data points into the connection's
+// receive buffer and is only valid during the call
+typedef void (*otpResultFn)(struct otpRequest* req, uint64_t offset, const char* data, size_t len);
+// Called once when the request finishes or fails
+typedef void (*otpDoneFn)(struct otpRequest* req);
+
+// One message sent over a connection. Filled in by the caller before
+// otpBegin(), except for the fields the engine updates.
+struct otpRequest
+{
+    uint64_t len;        // plaintext length announced in HELLO
+    int binary;          // text and key are arbitrary bytes (OTP_FLAG_BINARY), never packed
+    int usePad;          // key comes from the daemon's pad padId
+    uint32_t padId;
+    uint64_t padOffset;  // start of the pad range: given to otp_dec_d,
+                         // replaced by the ACK's (otp_enc_d picks its own)
+    otpResultFn onResult;
+    otpDoneFn onDone;
+    void* userData;
+    // Set by the engine
+    uint32_t id;
+    unsigned char helloOffset[OTP_PAD_OFFSET_SIZE]; // padOffset as sent in HELLO
+    uint64_t received;   // ciphertext bytes received so far
+    int status;          // OTP_REQ_*
+    uint64_t retryAfterMs; // with OTP_REQ_BUSY, how long the daemon asked for
+    char errorMsg[128];
+};
+
+// A frame waiting to be written; the body segments point at caller
+// memory, which must stay valid until the request's reply arrives
+struct otpOutFrame
+{
+    unsigned char header[OTP_HEADER_SIZE];
+    const char* seg0;
+    const char* seg1;
+    size_t len0;
+    size_t len1;
+    size_t sent; // bytes of header + body already written
+    char* owned; // pool buffer behind the segments, given back once written
+    size_t ownedSize;
+};
+
+struct otpConn
+{
+    int socketFD;
+    const char* authCode;
+    struct otpReader reader;
+    struct otpOutFrame* queue; // ring of frames waiting to be written
+    size_t queueHead;
+    size_t queueCount;
+    size_t queueCapacity;
+    struct otpRequest* inflight[OTP_MAX_INFLIGHT]; // indexed by id % OTP_MAX_INFLIGHT
+    int inflightCount;
+    uint32_t nextId;
+    int connecting;  // otpConnectAddr()'s connect hasn't finished yet
+    int packed;      // send and receive text packed (see otppack.h); set before otpBegin()
+    char* unpacked;  // RESULT bodies unpacked for onResult
+    size_t unpackedCapacity;
+};
+
+OTP_API int otpConnect(struct otpConn* conn, const char* host, const char* port, const char* authCode);
+OTP_API int otpConnectAddr(struct otpConn* conn, const struct sockaddr_storage* addr, socklen_t addrLen, const char* authCode);
+OTP_API void otpDisconnect(struct otpConn* conn);
+OTP_API int otpBegin(struct otpConn* conn, struct otpRequest* req);
+OTP_API int otpQueueData(struct otpConn* conn, struct otpRequest* req, uint64_t offset, const char* plaintext, const char* key, size_t len);
+OTP_API int otpFinish(struct otpConn* conn, struct otpRequest* req);
+OTP_API short otpWantEvents(struct otpConn* conn);
+OTP_API int otpPump(struct otpConn* conn, int timeoutMs);
+
+#endif
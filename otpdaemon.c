@@ -0,0 +1,1984 @@
+/*********************************************************************
+** otpdaemon.c
+** Description: Server core shared by the one time pad daemons,
+* otp_enc_d and otp_dec_d. Receiving text and a key file from its
+* client, encrypts (or decrypts) the text and sends the result back.
+* The client sends a code to verify it is the matching client; each
+* daemon is a small main() that calls runDaemon() with its name, code
+* and direction.
+* A connection may carry many requests, several in flight at once,
+* each tagged with its own request id (see otpshared.h).
+* By default calls fork() to process each connection. With -m epoll
+* it stays one process: connections are watched with epoll and handed
+* to a fixed pool of worker threads (one per core unless -t is given)
+* whenever they have input. With -m uring each of those threads runs
+* its own io_uring instead, accepting, reading and writing through it
+* (see runUringServer()); where io_uring is missing it falls back to
+* -m epoll. With -r (-m uring only), every io_uring thread gets a
+* SO_REUSEPORT listener of its own on the port; the other models accept
+* from one loop, where separate listeners would gain nothing.
+* -c and -C cap the requests open at once and the bytes they carry;
+* past either, a HELLO is answered with BUSY (see admitRequest()).
+* Pads registered with -k are mapped once and shared; clients naming
+* one send only their text (see otppad.c).
+* Every stage of a request is counted and timed (see otpstats.c); the
+* totals are dumped on SIGUSR1, or to whoever connects to -s path.
+* With -T path each of those stages is also traced per request, and
+* SIGUSR2 writes the trace to path (see otptrace.c).
+*********************************************************************/
+
+#define _GNU_SOURCE // accept4()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h> 
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include "otpshared.h"
+#include "otpcipher.h"
+#include "otppool.h"
+#include "otppad.h"
+#include "otpdaemon.h"
+#include "otpstats.h"
+#include "otptrace.h"
+#include "otpbuf.h"
+#include "otpuring.h"
+#include "otpshm.h"
+#include "otppack.h"
+
+#define DRAIN_TIMEOUT_MS 200 // how long a rejected client gets to hang up, all told
+#define MAX_LISTENERS 2 // listeners one io_uring thread accepts on: a TCP port and the -u Unix socket
+#define LISTEN_BACKLOG 4096 // connections waiting on a listener, capped by the kernel's somaxconn
+#define BUSY_RETRY_MS 20 // how long a client turned away with BUSY is told to wait
+#define STREAM_CHARGE OTP_CHUNK_SIZE // bytes a request of unknown length counts as against -C
+#define CHILD_SLOTS 4096 // forked children at once whose admission is given back if they die, see releaseChild()
+#define REAP_INTERVAL_MS 100 // how often the fork model reaps children while -c or -C is set
+#define MAX_EVENTS 64 // epoll events handled per epoll_wait() call
+#define FRAMES_PER_TURN 64 // frames a worker handles for one session before moving on
+#define URING_ENTRIES 1024 // submission queue size of each io_uring
+#define URING_FIXED_SLOTS 32 // sessions per io_uring thread that get registered buffers
+#define URING_SLOT_SIZE OTP_MIN_READ_BUFFER // size of each registered read and reply buffer
+
+// io_uring operations the io_uring threads use, see runUringServer()
+static const unsigned char uringOps[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+                                          IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_LINK_TIMEOUT };
+
+// Server models, picked with -m
+#define SERVER_FORK 0
+#define SERVER_EPOLL 1
+#define SERVER_URING 2
+
+// What an io_uring completion was for, kept in the low bits of its
+// user_data next to the session pointer
+#define URING_ACCEPT 0
+#define URING_RECV 1
+#define URING_SEND 2
+#define URING_TIMEOUT 3 // a draining session's linked timeout, carries no session
+#define URING_OP_MASK 3
+
+// serveSession() results
+#define SESSION_WAITING 0
+#define SESSION_YIELD 1
+#define SESSION_CLOSED 2
+#define SESSION_FAILED 3
+
+// One request open on a session, see handleFrame()
+struct sessionRequest
+{
+    int open;
+    uint32_t id;
+    struct otpPad* pad;  // pad the key comes from, if the client asked for one
+    uint64_t padBase;    // start of the message's range in the pad
+    uint64_t msgLen;     // text the HELLO announced (the size of that range), or OTP_LEN_UNKNOWN
+    uint64_t received;   // text bytes encoded so far
+    int packed;          // DATA and RESULT bodies are packed
+    int alphabet;        // OTP_ALPHABET_BYTES for an OTP_FLAG_BINARY request
+    uint64_t charge;     // bytes it counts as against -C, see admitRequest()
+};
+
+// Everything the daemon keeps for one client connection. Lives for as
+// long as the connection, so a worker can pick it up where another
+// left off.
+struct otpSession
+{
+    int socketFD;
+    uint32_t traceId; // connection id in traces
+    struct otpReader reader;
+    char* encryptedText; // holds the ciphered text for one frame
+    size_t encryptedCapacity;
+    // epoll and io_uring backends
+    struct otpOutput out; // replies waiting to be written
+    int closing;          // close once out has been written
+    // io_uring backend only
+    int fixedSlot;        // registered buffer slot lent to the session, -1 if none
+    int yielded;          // the turn ran out with frames possibly still buffered
+    uint64_t sendStart;   // when the write in flight was queued (statsNow())
+    struct __kernel_timespec drainTimeout; // what is left of drainUntil, for the linked timeout
+    // Rejected clients, see drainConnection()
+    int draining;         // rejected: discard input until the client hangs up
+    int halfClosed;       // epoll backend: the drain has shut the socket for writing
+    uint64_t drainUntil;  // ... or until this time (statsNow())
+    struct otpSession* drainNext; // epoll backend: next on the draining list
+    // Shared memory ring handed over by the client, if any
+    struct otpShmServer* shm;
+    pthread_t shmThread;
+    struct sessionRequest shmCharge; // the ring's admission, see attachShm()
+    struct sessionRequest requests[OTP_MAX_INFLIGHT]; // indexed by id % OTP_MAX_INFLIGHT
+};
+
+// Sessions waiting for a worker thread. Filled by the epoll loop,
+// drained by the workers.
+struct connQueue
+{
+    struct otpSession** sessions;
+    int capacity;
+    int head;
+    int count;
+    int epollFD; // where workers re-arm sessions that are waiting on input
+    int wakeFD;  // eventfd: a session was put on an empty draining list
+    struct otpSession* drainHead; // rejected sessions, by deadline, see startDrain()
+    struct otpSession* drainTail;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+};
+
+// One io_uring thread: its ring and the registered buffers it lends
+// to sessions
+struct uringWorker
+{
+    struct otpRing ring;
+    int listenFDs[MAX_LISTENERS]; // its own SO_REUSEPORT listener with -r, else the shared ones
+    int listenCount;
+    int multishot; // accepts are multishot, until the kernel turns one down (before 5.19)
+    char* arena; // URING_FIXED_SLOTS pairs of read and reply buffers, NULL if not registered
+    int freeSlots[URING_FIXED_SLOTS];
+    int freeCount;
+};
+
+// Work admitted so far across every thread and child, see
+// admitRequest(). Lives in shared memory so forked children count into
+// the same totals.
+struct admission
+{
+    uint64_t requests; // requests open
+    uint64_t bytes;    // bytes those requests announced
+};
+
+// The part of admitted one forked child holds, also in shared memory,
+// so the parent can give it back if the child dies without doing so
+struct childCharge
+{
+    pid_t pid; // child using the slot, 0 if free (only the parent writes it)
+    struct admission held;
+};
+
+// Which daemon this is, set by runDaemon()
+static const struct daemonConfig* daemonInfo;
+// Admission limits, set by runDaemon(); admitted is NULL without any
+static struct admission* admitted = NULL;
+static uint64_t maxRequests = 0; // -c, 0 for no limit
+static uint64_t maxBytes = 0;    // -C, 0 for no limit
+// Fork model with -c or -C: CHILD_SLOTS slots for children, and in a
+// child the one it charges (NULL if none was free)
+static struct childCharge* childCharges = NULL;
+static struct childCharge* myCharge = NULL;
+
+/********************************************************************* 
+** encode()
+* Given text, a key and a buffer to place the result into, encode()
+* encrypts (or for otp_dec_d, decrypts) len characters of the text
+* with the key and places the result into the provided buffer. The
+* characters are validated in the same pass by the kernel picked by
+* initEncoder() (see otpcipher.c), and payloads of OTP_PARALLEL_MIN or
+* more (single-file clients' frames) are spread over every core with
+* -m epoll and -m uring (see otppool.c). With OTP_ALPHABET_BYTES, len
+* arbitrary bytes are encoded instead and are always valid. Returns 1
+* if all of them were valid, 0 otherwise. Shared memory slots don't
+* come through here, see shmWorker().
+*********************************************************************/
+
+int encode(const char* plaintext, const char* key, char* encryptedText, size_t len, int alphabet)
+{
+    return encodeParallel(plaintext, key, encryptedText, len, daemonInfo->direction, alphabet) == len;
+}
+
+/********************************************************************* 
+** replyError()
+* Sends an ERROR frame for the request, prefixed with the daemon's name.
+*********************************************************************/
+
+void replyError(int socketFD, uint32_t requestId, const char* what)
+{
+    char msg[256];
+    snprintf(msg, sizeof(msg), "%s: %s", daemonInfo->name, what);
+    statsCount(STAT_REQ_ERRORS, 1);
+    sendError(socketFD, requestId, msg);
+}
+
+/********************************************************************* 
+** admitRequest() / closeRequest()
+* Counts a new request of msgLen bytes into the work the daemon has
+* admitted, or takes a request that is closing back out of it.
+* admitRequest() refuses when -c requests are open already, or when
+* the request would take the bytes announced past -C; a request bigger
+* than -C on its own still gets in when nothing else is, so it is
+* never refused forever. A streaming request counts as STREAM_CHARGE
+* bytes. A forked child also counts what it holds in its own slot,
+* raising that after the totals and lowering it before, so a child
+* that dies in between leaves at most one request charged rather than
+* releasing one twice. Returns 0 if the request is admitted, -1 if not.
+*********************************************************************/
+
+int admitRequest(struct sessionRequest* req, uint64_t msgLen)
+{
+    req->charge = 0;
+    if (admitted == NULL)
+    {
+        return 0;
+    }
+    uint64_t charge = (msgLen == OTP_LEN_UNKNOWN) ? STREAM_CHARGE : msgLen;
+    if (__atomic_add_fetch(&admitted->requests, 1, __ATOMIC_RELAXED) > maxRequests && maxRequests > 0)
+    {
+        __atomic_sub_fetch(&admitted->requests, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    uint64_t bytes = __atomic_load_n(&admitted->bytes, __ATOMIC_RELAXED);
+    do
+    {
+        if (maxBytes > 0 && bytes > 0 && (bytes >= maxBytes || charge > maxBytes - bytes))
+        {
+            __atomic_sub_fetch(&admitted->requests, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+    } while (!__atomic_compare_exchange_n(&admitted->bytes, &bytes, bytes + charge, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    req->charge = charge;
+    if (myCharge != NULL)
+    {
+        __atomic_add_fetch(&myCharge->held.requests, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&myCharge->held.bytes, charge, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+void closeRequest(struct sessionRequest* req)
+{
+    req->open = 0;
+    if (myCharge != NULL)
+    {
+        __atomic_sub_fetch(&myCharge->held.requests, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&myCharge->held.bytes, req->charge, __ATOMIC_RELAXED);
+    }
+    if (admitted != NULL)
+    {
+        __atomic_sub_fetch(&admitted->requests, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&admitted->bytes, req->charge, __ATOMIC_RELAXED);
+    }
+}
+
+/********************************************************************* 
+** replyBusy()
+* Turns a request away with a BUSY frame telling the client when to
+* try again.
+*********************************************************************/
+
+void replyBusy(int socketFD, uint32_t requestId)
+{
+    statsCount(STAT_REQ_SHED, 1);
+    sendFrame(socketFD, OTP_FRAME_BUSY, requestId, BUSY_RETRY_MS, NULL, 0, NULL, 0);
+}
+
+/********************************************************************* 
+** drainConnection() / discardInput()
+* Clients send their first DATA frame without waiting for the ACK, so
+* a rejected client may still have data in flight. Closing with unread
+* data makes the kernel reset the connection, which can destroy the
+* ERROR frame before the client reads it. So a rejected session is
+* marked draining instead of closed: once its ERROR is out the socket
+* is half-closed and input is discarded until the client hangs up, but
+* never for more than DRAIN_TIMEOUT_MS in total, however slowly the
+* client keeps sending. drainConnection() does that in place, for the
+* fork model where the connection has a process to itself; the epoll
+* and io_uring models keep serving other connections meanwhile (see
+* startDrain() and uringDrain()). discardInput() throws away what a
+* non-blocking socket has buffered and returns 1 once the client has
+* hung up, 0 while it hasn't.
+*********************************************************************/
+
+void drainConnection(int socketFD)
+{
+    char discard[4096];
+    uint64_t deadline = statsNow() + DRAIN_TIMEOUT_MS * 1000000ull;
+    shutdown(socketFD, SHUT_WR);
+    while (1)
+    {
+        uint64_t now = statsNow();
+        struct pollfd pfd = { socketFD, POLLIN, 0 };
+        if (now >= deadline || poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000)) <= 0)
+        {
+            break;
+        }
+        if (recv(socketFD, discard, sizeof(discard), 0) <= 0)
+        {
+            break;
+        }
+    }
+}
+
+int discardInput(int socketFD)
+{
+    char discard[4096];
+    while (1)
+    {
+        ssize_t got = recv(socketFD, discard, sizeof(discard), MSG_DONTWAIT);
+        if (got > 0)
+        {
+            continue;
+        }
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        return !(got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    }
+}
+
+/********************************************************************* 
+** openSession() / closeSession()
+* Set up the state for a new connection, or tear it down and close the
+* socket. Sessions and their buffers come from the buffer pool and go
+* back to it, so in epoll mode a new connection reuses memory an old
+* one was done with. Nothing is cleared beyond the fields that are read
+* before being written: each request slot's open flag, the rest of a
+* slot is filled in when a HELLO opens it. openSession() returns NULL
+* if memory runs out.
+*********************************************************************/
+
+struct otpSession* openSession(int socketFD)
+{
+    int noDelay = 1;
+    int i;
+    struct otpSession* session = (struct otpSession*)getBuffer(sizeof(struct otpSession), NULL);
+    if (session == NULL)
+    {
+        return NULL;
+    }
+    session->socketFD = socketFD;
+    session->encryptedText = NULL;
+    session->encryptedCapacity = 0;
+    memset(&session->out, 0, sizeof(session->out));
+    session->fixedSlot = -1;
+    session->closing = 0;
+    session->yielded = 0;
+    session->draining = 0;
+    session->halfClosed = 0;
+    session->shm = NULL;
+    for (i = 0; i < OTP_MAX_INFLIGHT; i++)
+    {
+        session->requests[i].open = 0;
+    }
+    session->traceId = traceNewConn();
+    if (initReader(&session->reader, socketFD) < 0)
+    {
+        putBuffer(session, sizeof(struct otpSession));
+        return NULL;
+    }
+    // Replies are small and answered right away, so don't let Nagle hold them
+    setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    return session;
+}
+
+void closeSession(struct otpSession* session)
+{
+    // Requests the client never finished give their admission back
+    int i;
+    for (i = 0; admitted != NULL && i < OTP_MAX_INFLIGHT; i++)
+    {
+        if (session->requests[i].open)
+        {
+            closeRequest(&session->requests[i]);
+        }
+    }
+    // The client is gone, so its ring is too
+    if (session->shm != NULL)
+    {
+        shmStop(session->shm);
+        pthread_join(session->shmThread, NULL);
+        shmDetach(session->shm);
+        free(session->shm);
+        closeRequest(&session->shmCharge);
+    }
+    // Shut down socket to ensure no more transmissions
+    shutdown(session->socketFD, SHUT_RDWR);
+    close(session->socketFD);
+    freeReader(&session->reader);
+    putBuffer(session->encryptedText, session->encryptedCapacity);
+    if (!session->out.borrowed)
+    {
+        putBuffer(session->out.data, session->out.capacity);
+    }
+    putBuffer(session, sizeof(struct otpSession));
+}
+
+/********************************************************************* 
+** shmWorker()
+* Serves a client's shared memory ring until it is closed: each slot
+* the client hands over is encoded in place and handed back. Closes
+* the ring on the way out, so the client stops waiting on it.
+* Slots are encoded on this thread alone, however big: only it is
+* covered by shmGuard(), so a pool thread reading a ring the client
+* shrinks would take the daemon down with SIGBUS.
+*********************************************************************/
+
+void* shmWorker(void* arg)
+{
+    struct otpShmServer* shm = arg;
+    shmGuard(shm);
+    while (shmWaitWork(shm))
+    {
+        int64_t len = shmWorkLen(shm);
+        if (len < 0)
+        {
+            statsCount(STAT_REQ_ERRORS, 1);
+            shmComplete(shm, OTP_SHM_FAILED);
+            continue;
+        }
+        char* text = shmWorkText(shm);
+        uint64_t start = statsNow();
+        int valid = encodeChecked(text, shmWorkKey(shm), text, len, daemonInfo->direction) == (size_t)len;
+        statsStage(STAGE_ENCODE, start);
+        statsCount(valid ? STAT_REQ_COMPLETED : STAT_REQ_ERRORS, 1);
+        if (valid)
+        {
+            statsCount(STAT_BYTES_ENCODED, len);
+        }
+        shmComplete(shm, valid ? OTP_SHM_OK : OTP_SHM_INVALID);
+    }
+    shmShutdown(shm->header);
+    return NULL;
+}
+
+/********************************************************************* 
+** attachShm()
+* Maps the shared memory ring named in an OTP_FLAG_SHM HELLO and starts
+* a thread serving it. A session has at most one ring, which must
+* belong to the user the client runs as; that is only known on the
+* Unix socket. The ring is admitted as one request as big as all its
+* slots' text, for as long as it is attached, so rings count against
+* -c and -C like any other work and a ring past them is turned away
+* with BUSY. Returns 0 on success, otherwise -1 with the client told
+* why.
+*********************************************************************/
+
+int attachShm(struct otpSession* session, const struct otpFrame* frame, const char* name)
+{
+    if (session->shm != NULL)
+    {
+        replyError(session->socketFD, frame->requestId, "shared memory ring already attached");
+        return -1;
+    }
+    struct ucred peer;
+    socklen_t peerLen = sizeof(peer);
+    if (getsockopt(session->socketFD, SOL_SOCKET, SO_PEERCRED, &peer, &peerLen) < 0 || peer.uid == (uid_t)-1)
+    {
+        replyError(session->socketFD, frame->requestId, "shared memory rings are only taken over the Unix socket");
+        return -1;
+    }
+    struct otpShmServer* shm = malloc(sizeof(*shm));
+    if (shm == NULL || shmAttach(shm, name, frame->len1, peer.uid) < 0)
+    {
+        free(shm);
+        replyError(session->socketFD, frame->requestId, "cannot map shared memory ring");
+        return -1;
+    }
+    if (admitRequest(&session->shmCharge, (uint64_t)shm->slots * shm->slotSize) < 0)
+    {
+        shmDetach(shm);
+        free(shm);
+        replyBusy(session->socketFD, frame->requestId);
+        return -1;
+    }
+    if (pthread_create(&session->shmThread, NULL, shmWorker, shm) != 0)
+    {
+        closeRequest(&session->shmCharge);
+        shmDetach(shm);
+        free(shm);
+        replyError(session->socketFD, frame->requestId, "cannot serve shared memory ring");
+        return -1;
+    }
+    session->shm = shm;
+    return 0;
+}
+
+/********************************************************************* 
+** settlePad()
+* For a HELLO naming a pad: otp_enc_d reserves the message's key range
+* from it, and otp_dec_d checks that the range the client gave was
+* handed out. Stores the range's start in req; its size is the
+* message's length, already in req->msgLen. Returns 0 on success,
+* otherwise -1 with the client told why.
+*********************************************************************/
+
+int settlePad(int socketFD, struct sessionRequest* req, const struct otpFrame* frame, const char* body)
+{
+    // A streaming client doesn't know its length, so it can't use a pad
+    if (frame->offset == OTP_LEN_UNKNOWN)
+    {
+        replyError(socketFD, frame->requestId, "pad messages must give their length");
+        return -1;
+    }
+    req->pad = findPad(frame->padId);
+    if (req->pad == NULL)
+    {
+        replyError(socketFD, frame->requestId, "unknown pad");
+        return -1;
+    }
+    if (daemonInfo->direction == OTP_DECRYPT)
+    {
+        // Decrypt with the range the client names, if it was ever used
+        if (frame->len1 != OTP_PAD_OFFSET_SIZE)
+        {
+            replyError(socketFD, frame->requestId, "pad offset missing");
+            return -1;
+        }
+        req->padBase = get64((const unsigned char*)body + frame->len0);
+        if (checkPadRange(req->pad, req->padBase, frame->offset) < 0)
+        {
+            replyError(socketFD, frame->requestId, "pad range was never handed out");
+            return -1;
+        }
+    }
+    else if (reservePad(req->pad, frame->offset, &req->padBase) < 0)
+    {
+        replyError(socketFD, frame->requestId, "not enough key left in pad");
+        return -1;
+    }
+    return 0;
+}
+
+/********************************************************************* 
+** openRequest()
+* Handles a HELLO, which opens a request: it must carry the daemon's
+* auth code, otherwise the client is rejected and the connection
+* drained and closed (see drainConnection()). A request that would take the daemon past its -c or -C
+* limits is turned away with BUSY. If HELLO names a pad, its key range
+* is settled next (see settlePad()); the range's start is sent back in
+* the ACK.
+* A HELLO with OTP_FLAG_SHM instead hands over a shared memory ring
+* (see attachShm()), and opens no request. One with OTP_FLAG_BINARY
+* opens a request for arbitrary bytes (see encode()).
+* Returns 0 to keep going, -1 to close the connection.
+*********************************************************************/
+
+int openRequest(struct otpSession* session, const struct otpFrame* frame, const char* body)
+{
+    int socketFD = session->socketFD;
+    struct sessionRequest* req = &session->requests[frame->requestId % OTP_MAX_INFLIGHT];
+
+    // Look for the secret code, if not found, reject message/close connection. 
+    if (frame->len0 != OTP_AUTH_SIZE || memcmp(body, daemonInfo->authCode, OTP_AUTH_SIZE) != 0)
+    {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "%s only accepts messages from %s", daemonInfo->name, daemonInfo->client);
+        fprintf(stderr, "%s\n", msg);
+        statsCount(STAT_CONN_REJECTED, 1);
+        sendError(socketFD, frame->requestId, msg);
+        // Closed once the client has had a chance to read the ERROR
+        session->draining = 1;
+        return -1;
+    }
+    if (frame->flags & OTP_FLAG_SHM)
+    {
+        if (frame->flags & OTP_FLAG_PAD)
+        {
+            replyError(socketFD, frame->requestId, "pads can't be used over shared memory");
+        }
+        else if (frame->flags & OTP_FLAG_BINARY)
+        {
+            replyError(socketFD, frame->requestId, "binary text can't be sent over shared memory");
+        }
+        else if (attachShm(session, frame, body + frame->len0) == 0)
+        {
+            sendAck(socketFD, frame->requestId, 0);
+        }
+        return 0;
+    }
+    if (req->open)
+    {
+        replyError(socketFD, frame->requestId, "too many requests in flight");
+        return 0;
+    }
+    memset(req, 0, sizeof(*req));
+    req->id = frame->requestId;
+    req->msgLen = frame->offset;
+    req->packed = (frame->flags & OTP_FLAG_PACKED) != 0;
+    req->alphabet = (frame->flags & OTP_FLAG_BINARY) ? OTP_ALPHABET_BYTES : OTP_ALPHABET_TEXT;
+    // Pads and packing only hold CHARS
+    if ((frame->flags & OTP_FLAG_BINARY) && (frame->flags & (OTP_FLAG_PAD | OTP_FLAG_PACKED)))
+    {
+        replyError(socketFD, frame->requestId, "binary text can't use a pad or be packed");
+        return 0;
+    }
+    // Shed load before anything is reserved for the request
+    if (admitRequest(req, frame->offset) < 0)
+    {
+        replyBusy(socketFD, frame->requestId);
+        return 0;
+    }
+    if ((frame->flags & OTP_FLAG_PAD) && settlePad(socketFD, req, frame, body) < 0)
+    {
+        closeRequest(req);
+        return 0;
+    }
+    req->open = 1;
+    // Acknowledge that server is ready to receive the message, telling a
+    // pad client which part of the pad its message uses.
+    sendAck(socketFD, req->id, req->padBase);
+    return 0;
+}
+
+/********************************************************************* 
+** handleFrame()
+* Handles one frame from a client. HELLO opens a request (see
+* openRequest()). Each DATA frame of an open request is encoded with its
+* key segment (or the pad) and the result is sent back in a RESULT
+* frame straight away. END closes the request and is echoed back.
+* A request whose HELLO gave its length (all but streaming ones, which
+* is what admitRequest() charged it) gets no more text than that, and
+* its END must come once all of it has; otherwise it fails.
+* A packed request's segments are unpacked into the scratch buffer,
+* encoded there and packed again for the RESULT.
+* Problems with one request are reported to the client with an ERROR
+* carrying its id, and frames for requests that are not open are
+* dropped, so other requests on the connection carry on.
+* Returns 0 to keep going, -1 to close the connection.
+*********************************************************************/
+
+int handleFrame(struct otpSession* session, const struct otpFrame* frame, const char* body)
+{
+    int socketFD = session->socketFD;
+    struct sessionRequest* req = &session->requests[frame->requestId % OTP_MAX_INFLIGHT];
+    int isOpen = req->open && req->id == frame->requestId;
+
+    if (frame->type == OTP_FRAME_HELLO)
+    {
+        uint64_t start = statsNow();
+        int result = openRequest(session, frame, body);
+        statsStage(STAGE_AUTH, start);
+        return result;
+    }
+    if (frame->type != OTP_FRAME_DATA && frame->type != OTP_FRAME_END)
+    {
+        replyError(socketFD, frame->requestId, "unexpected frame");
+        return -1;
+    }
+    if (!isOpen)
+    {
+        // Already failed (and the client told), or never opened
+        return 0;
+    }
+    if (frame->type == OTP_FRAME_END)
+    {
+        if (req->msgLen != OTP_LEN_UNKNOWN && req->received != req->msgLen)
+        {
+            closeRequest(req);
+            replyError(socketFD, req->id, "message ended short of its length");
+            return 0;
+        }
+        // Echo the end so client knows this message is over
+        closeRequest(req);
+        statsCount(STAT_REQ_COMPLETED, 1);
+        uint64_t start = statsNow();
+        int sent = sendFrame(socketFD, OTP_FRAME_END, req->id, req->received, NULL, 0, NULL, 0);
+        if (!sendsCaptured()) statsStage(STAGE_SEND, start); // else timed when written
+        return sent;
+    }
+
+    // Count symbols rather than bytes when the segments are packed
+    uint64_t textLen = frame->len0;
+    uint64_t keyLen = frame->len1;
+    int unpackable = !req->packed ||
+        (unpackedLength((const unsigned char*)body, frame->len0, &textLen) == 0 &&
+         unpackedLength((const unsigned char*)body + frame->len0, frame->len1, &keyLen) == 0);
+    // The key segment must cover the text (unless it comes from a pad),
+    // and the text must fit in the message's length
+    if (!unpackable || frame->offset != req->received ||
+        (req->pad == NULL && keyLen < textLen) ||
+        (req->pad != NULL && frame->len1 != 0) ||
+        (req->msgLen != OTP_LEN_UNKNOWN && textLen > req->msgLen - req->received))
+    {
+        closeRequest(req);
+        replyError(socketFD, req->id, "malformed DATA frame");
+        return 0;
+    }
+    // Make sure the output buffer can hold this frame's ciphered text,
+    // or when packed, the unpacked text and key and the packed result.
+    // Nothing in the old one is needed, so swap it rather than copy it.
+    size_t needed = req->packed ? textLen + keyLen + packedSize(textLen) : frame->len0;
+    if (needed > session->encryptedCapacity)
+    {
+        size_t capacity;
+        char* grown = getBuffer(needed, &capacity);
+        if (grown == NULL)
+        {
+            perror("getBuffer");
+            return -1;
+        }
+        putBuffer(session->encryptedText, session->encryptedCapacity);
+        session->encryptedText = grown;
+        session->encryptedCapacity = capacity;
+    }
+    // The key segment starts right after the plaintext segment, unless
+    // it comes from the reserved part of the pad
+    const char* text = body;
+    const char* key = req->pad ? req->pad->data + req->padBase + req->received : body + frame->len0;
+    char* encrypted = session->encryptedText;
+    uint64_t start = statsNow();
+    if (req->packed)
+    {
+        // unpackedLength() only sized the segments; a group past 27^5-1
+        // anywhere in them still fails here, before anything is encoded.
+        // Symbols that do unpack are from CHARS; encode() checks a pad's key
+        char* unpacked = session->encryptedText;
+        if (unpackSymbols((const unsigned char*)body, frame->len0, unpacked) < 0 ||
+            (req->pad == NULL &&
+             unpackSymbols((const unsigned char*)body + frame->len0, frame->len1, unpacked + textLen) < 0))
+        {
+            closeRequest(req);
+            replyError(socketFD, req->id, "malformed DATA frame");
+            return 0;
+        }
+        if (req->pad == NULL)
+        {
+            key = unpacked + textLen;
+        }
+        text = unpacked;
+        encrypted = unpacked;
+    }
+    int valid = encode(text, key, encrypted, textLen, req->alphabet);
+    statsStage(STAGE_ENCODE, start);
+    if (!valid)
+    {
+        closeRequest(req);
+        replyError(socketFD, req->id, "input contains invalid chars");
+        return 0;
+    }
+    statsCount(STAT_BYTES_ENCODED, textLen);
+    size_t resultLen = textLen;
+    if (req->packed)
+    {
+        start = statsNow();
+        encrypted = session->encryptedText + textLen + keyLen;
+        resultLen = packSymbols(session->encryptedText, textLen, (unsigned char*)encrypted);
+        statsStage(STAGE_ENCODE, start);
+    }
+    start = statsNow();
+    int sent = sendFrame(socketFD, OTP_FRAME_RESULT, req->id, frame->offset, encrypted, resultLen, NULL, 0);
+    if (!sendsCaptured()) statsStage(STAGE_SEND, start); // else timed when written
+    if (sent < 0)
+    {
+        return -1;
+    }
+    req->received += textLen;
+    return 0;
+}
+
+/********************************************************************* 
+** serveSession()
+* Handles the frames a client has sent. With block set it keeps
+* waiting for more until the client hangs up. Without it, it returns
+* once the socket has nothing more to read, or after FRAMES_PER_TURN
+* frames so one busy client can't hold a worker.
+* Returns SESSION_WAITING when the socket has run dry, SESSION_YIELD
+* when the turn ran out with input possibly still buffered,
+* SESSION_CLOSED when the client hung up between frames, and
+* SESSION_FAILED on errors.
+*********************************************************************/
+
+int serveSession(struct otpSession* session, int block)
+{
+    int frames;
+    for (frames = 0; block || frames < FRAMES_PER_TURN; frames++)
+    {
+        struct otpFrame frame;
+        const char* body; // points at the frame's body inside the reader
+        traceContext(session->traceId, 0);
+        uint64_t start = statsNow();
+        int got = nextFrame(&session->reader, &frame, &body, block);
+        if (got == 0)
+        {
+            return SESSION_WAITING;
+        }
+        if (got < 0)
+        {
+            int closed = session->reader.eof && session->reader.start == session->reader.end;
+            statsCount(closed ? STAT_CONN_CLOSED : STAT_CONN_FAILED, 1);
+            return closed ? SESSION_CLOSED : SESSION_FAILED;
+        }
+        traceContext(session->traceId, frame.requestId);
+        statsStage(STAGE_RECV, start);
+        statsCount(STAT_FRAMES_IN, 1);
+        statsCount(STAT_BYTES_IN, frame.len0 + frame.len1);
+        if (handleFrame(session, &frame, body) < 0)
+        {
+            statsCount(STAT_CONN_FAILED, 1);
+            return SESSION_FAILED;
+        }
+    }
+    return SESSION_YIELD;
+}
+
+/********************************************************************* 
+** claimChild() / releaseChild()
+* With -c or -C, each forked child gets a slot in childCharges to count
+* the admission it holds in. claimChild() picks a free slot for the
+* next child, or returns NULL when CHILD_SLOTS children hold one
+* already (that child's admission is then lost if it dies mid-request).
+* releaseChild() frees a reaped child's slot, taking whatever it still
+* held (because it crashed or was killed) back out of admitted.
+*********************************************************************/
+
+struct childCharge* claimChild(void)
+{
+    int i;
+    for (i = 0; childCharges != NULL && i < CHILD_SLOTS; i++)
+    {
+        if (childCharges[i].pid == 0)
+        {
+            memset(&childCharges[i].held, 0, sizeof(childCharges[i].held));
+            return &childCharges[i];
+        }
+    }
+    return NULL;
+}
+
+void releaseChild(pid_t pid)
+{
+    int i;
+    for (i = 0; childCharges != NULL && i < CHILD_SLOTS; i++)
+    {
+        if (childCharges[i].pid == pid)
+        {
+            __atomic_sub_fetch(&admitted->requests, childCharges[i].held.requests, __ATOMIC_RELAXED);
+            __atomic_sub_fetch(&admitted->bytes, childCharges[i].held.bytes, __ATOMIC_RELAXED);
+            childCharges[i].pid = 0;
+            return;
+        }
+    }
+}
+
+/* Summary: Listens for connections on the given sockets. Upon successful
+   connection creates a child process that serves the session until the
+   client hangs up, rejecting connections from other clients.
+   Reaps every finished child before each accept(), and with -c or -C
+   at least every REAP_INTERVAL_MS, giving back the admission of any
+   that died mid-request (see releaseChild()). */
+
+void runForkServer(const int* listenFDs, int listenCount)
+{
+    int establishedConnectionFD;
+    int i;
+
+    if (admitted != NULL)
+    {
+        childCharges = mmap(NULL, CHILD_SLOTS * sizeof(struct childCharge), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (childCharges == MAP_FAILED) error("ERROR mapping child admission");
+    }
+
+	while (1)
+	{
+	    // Clear all finished children so zombies don't pile up
+	    int status;
+	    pid_t finished;
+	    while ((finished = waitpid(-1, &status, WNOHANG)) > 0)
+	    {
+	        releaseChild(finished);
+	    }
+	    
+	    // Wait for a connection on any of the listening sockets
+	    struct pollfd pfds[listenCount];
+	    for (i = 0; i < listenCount; i++)
+	    {
+	        pfds[i].fd = listenFDs[i];
+	        pfds[i].events = POLLIN;
+	    }
+	    if (poll(pfds, listenCount, childCharges != NULL ? REAP_INTERVAL_MS : -1) < 0)
+	    {
+	        if (errno == EINTR) continue;
+	        error("ERROR on poll");
+	    }
+	    for (i = 0; i < listenCount && !(pfds[i].revents & POLLIN); i++);
+	    if (i == listenCount) continue;
+	    int listenSocketFD = listenFDs[i];
+
+	    // Accept the connection
+    	establishedConnectionFD = accept(listenSocketFD, NULL, NULL); // Accept
+    	if (establishedConnectionFD < 0)
+    	{
+    	    if (errno == EINTR) continue;
+    	    error("ERROR on accept");
+    	}
+    	uint64_t acceptedAt = statsNow();
+    
+        struct childCharge* charge = claimChild();
+        int pid = fork();
+        // if fork failed
+        if (pid < 0)
+        {
+            close(establishedConnectionFD);
+            fprintf(stderr, "fork() returned error\n");
+            continue;
+        }
+        // child processes this code
+        else if (pid == 0)
+        {
+            for (i = 0; i < listenCount; i++)
+            {
+                close(listenFDs[i]);
+            }
+            myCharge = charge;
+            statsNewProcess();
+            traceNewProcess();
+            encodeSerially(); // see otppool.c
+            struct otpSession* session = openSession(establishedConnectionFD);
+            if (session == NULL) exit(1);
+            traceContext(session->traceId, 0);
+            statsCount(STAT_CONN_ACCEPTED, 1);
+            statsStage(STAGE_ACCEPT, acceptedAt);
+            int result = serveSession(session, 1);
+            if (session->draining)
+            {
+                drainConnection(session->socketFD);
+            }
+        	closeSession(session); // Close the existing socket which is connected to the client
+        	exit(result == SESSION_CLOSED ? 0 : 1);
+        }
+        // Parent code
+        else
+        {
+            close(establishedConnectionFD);
+            if (charge != NULL)
+            {
+                charge->pid = pid;
+            }
+        }
+    }
+}
+
+/********************************************************************* 
+** pushConn() / popConn()
+* Add a session that has input to the work queue, or take one off it.
+* popConn() blocks until a session is available. The queue grows
+* when it fills up, so the epoll loop never waits on the workers.
+*********************************************************************/
+
+void pushConn(struct connQueue* queue, struct otpSession* session)
+{
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == queue->capacity)
+    {
+        // Double the ring, unwrapping it into the new array
+        int newCapacity = queue->capacity * 2;
+        struct otpSession** newSessions = malloc(newCapacity * sizeof(struct otpSession*));
+        if (newSessions == NULL)
+        {
+            pthread_mutex_unlock(&queue->lock);
+            fprintf(stderr, "%s: work queue full, dropping connection\n", daemonInfo->name);
+            closeSession(session);
+            return;
+        }
+        int i;
+        for (i = 0; i < queue->count; i++)
+        {
+            newSessions[i] = queue->sessions[(queue->head + i) % queue->capacity];
+        }
+        free(queue->sessions);
+        queue->sessions = newSessions;
+        queue->capacity = newCapacity;
+        queue->head = 0;
+    }
+    queue->sessions[(queue->head + queue->count) % queue->capacity] = session;
+    queue->count++;
+    pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+struct otpSession* popConn(struct connQueue* queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0)
+    {
+        pthread_cond_wait(&queue->ready, &queue->lock);
+    }
+    struct otpSession* session = queue->sessions[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_mutex_unlock(&queue->lock);
+    return session;
+}
+
+/********************************************************************* 
+** flushOutput()
+* Writes as much of the replies an epoll session has captured as the
+* socket takes without blocking, and empties out once all of it is
+* gone. A call with anything to write is timed as one STAGE_SEND.
+* Returns 0 on success (even if some is still waiting), -1 if the
+* socket failed.
+*********************************************************************/
+
+int flushOutput(struct otpSession* session)
+{
+    struct otpOutput* out = &session->out;
+    if (out->sent == out->len)
+    {
+        out->len = 0;
+        out->sent = 0;
+        return 0;
+    }
+    uint64_t start = statsNow();
+    int result = 0;
+    while (out->sent < out->len)
+    {
+        ssize_t charsSent = send(session->socketFD, out->data + out->sent, out->len - out->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (charsSent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                result = -1;
+            }
+            break;
+        }
+        out->sent += charsSent;
+    }
+    traceContext(session->traceId, 0);
+    statsStage(STAGE_SEND, start);
+    if (out->sent == out->len)
+    {
+        out->len = 0;
+        out->sent = 0;
+    }
+    return result;
+}
+
+/********************************************************************* 
+** armSession()
+* Re-arms a session's one-shot epoll registration: for room to write
+* while it has replies waiting, which also stops its input being read
+* until the client takes them, otherwise for input. Returns 0 on
+* success, -1 on failure.
+*********************************************************************/
+
+int armSession(int epollFD, struct otpSession* session)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (session->out.len > 0 ? EPOLLOUT : EPOLLIN) | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = session;
+    return epoll_ctl(epollFD, EPOLL_CTL_MOD, session->socketFD, &ev);
+}
+
+/********************************************************************* 
+** startDrain() / drainStep() / expireDrains()
+* Hand a rejected session over to the epoll loop, or close the ones
+* whose time is up. startDrain() puts the session at the back of the
+* draining list (they all get the same DRAIN_TIMEOUT_MS, so the list
+* stays in deadline order) after its first drainStep(). From then on
+* only the epoll loop touches the session, running drainStep() on it
+* whenever it is ready: that finishes writing the ERROR, half-closes
+* the socket once it is out, and discards input (see discardInput()).
+* expireDrains(), run by the same loop, closes sessions whose time is
+* up and returns the milliseconds until the next deadline, or -1 when
+* nothing is draining.
+*********************************************************************/
+
+void drainStep(int epollFD, struct otpSession* session)
+{
+    int hungUp = (flushOutput(session) < 0);
+    if (!hungUp && session->out.len == 0 && !session->halfClosed)
+    {
+        shutdown(session->socketFD, SHUT_WR);
+        session->halfClosed = 1;
+    }
+    if (hungUp || discardInput(session->socketFD))
+    {
+        // Nothing more to do but wait on the list to be closed
+        epoll_ctl(epollFD, EPOLL_CTL_DEL, session->socketFD, NULL);
+        return;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT | (session->out.len > 0 ? EPOLLOUT : 0);
+    ev.data.ptr = session;
+    epoll_ctl(epollFD, EPOLL_CTL_MOD, session->socketFD, &ev);
+}
+
+void startDrain(struct connQueue* queue, struct otpSession* session)
+{
+    session->drainUntil = statsNow() + DRAIN_TIMEOUT_MS * 1000000ull;
+    session->drainNext = NULL;
+    pthread_mutex_lock(&queue->lock);
+    int wasEmpty = (queue->drainHead == NULL);
+    if (wasEmpty)
+    {
+        queue->drainHead = session;
+    }
+    else
+    {
+        queue->drainTail->drainNext = session;
+    }
+    queue->drainTail = session;
+    pthread_mutex_unlock(&queue->lock);
+    drainStep(queue->epollFD, session);
+    // The epoll loop sleeps without a timeout while nothing drains
+    if (wasEmpty)
+    {
+        uint64_t one = 1;
+        while (write(queue->wakeFD, &one, sizeof(one)) < 0 && errno == EINTR);
+    }
+}
+
+int expireDrains(struct connQueue* queue)
+{
+    uint64_t now = statsNow();
+    while (1)
+    {
+        pthread_mutex_lock(&queue->lock);
+        struct otpSession* session = queue->drainHead;
+        if (session == NULL || session->drainUntil > now)
+        {
+            pthread_mutex_unlock(&queue->lock);
+            return session == NULL ? -1 : (int)((session->drainUntil - now + 999999) / 1000000);
+        }
+        queue->drainHead = session->drainNext;
+        pthread_mutex_unlock(&queue->lock);
+        closeSession(session);
+    }
+}
+
+/********************************************************************* 
+** connWorker()
+* Worker thread body. Takes sessions that are ready off the queue,
+* writes what replies they still have waiting, then serves the frames
+* waiting on them without blocking. Replies are captured on the
+* session (see captureSends()) and written without blocking, so a
+* client that stops reading never holds a worker: whatever the socket
+* won't take waits for EPOLLOUT. A session that runs out of input is
+* re-armed in epoll, so idle persistent connections hold no thread;
+* one that used up its turn goes to the back of the queue. Closed or
+* failed sessions are freed once their replies are out, except
+* rejected ones, which are drained first (see startDrain()).
+*********************************************************************/
+
+void* connWorker(void* arg)
+{
+    struct connQueue* queue = arg;
+    while (1)
+    {
+        struct otpSession* session = popConn(queue);
+        int result = SESSION_WAITING;
+        if (flushOutput(session) < 0)
+        {
+            statsCount(STAT_CONN_FAILED, 1);
+            result = SESSION_FAILED;
+        }
+        else if (session->out.len == 0 && session->closing)
+        {
+            result = SESSION_CLOSED;
+        }
+        else if (session->out.len == 0)
+        {
+            captureSends(&session->out);
+            result = serveSession(session, 0);
+            captureSends(NULL);
+            if (flushOutput(session) < 0 && !session->draining)
+            {
+                statsCount(STAT_CONN_FAILED, 1);
+                result = SESSION_FAILED;
+            }
+        }
+        if (session->draining)
+        {
+            startDrain(queue, session);
+            continue;
+        }
+        // A client that hung up after its last request still gets the replies
+        if (result == SESSION_CLOSED && session->out.len > 0)
+        {
+            session->closing = 1;
+            result = SESSION_WAITING;
+        }
+        if (result == SESSION_CLOSED || result == SESSION_FAILED)
+        {
+            closeSession(session);
+        }
+        else if (result == SESSION_YIELD && session->out.len == 0)
+        {
+            pushConn(queue, session);
+        }
+        else if (armSession(queue->epollFD, session) < 0)
+        {
+            perror("ERROR re-arming connection");
+            closeSession(session);
+        }
+    }
+    return NULL;
+}
+
+/* Summary: Single process server. The listening socket and every accepted
+   connection are non-blocking and registered with one epoll instance.
+   New connections are accepted in a batch until accept() would block.
+   Each connection gets a session and is armed one-shot for input; when
+   input arrives (or room to write replies that are waiting) the
+   session is handed to the worker pool, which handles the frames
+   (including the encode step) and re-arms it.
+   Rejected sessions come back to this loop to be drained, and it
+   wakes in time to close each one when its drain runs out. */
+
+void runEpollServer(const int* listenFDs, int listenCount, int numThreads)
+{
+    struct connQueue queue;
+    queue.capacity = 256;
+    queue.sessions = malloc(queue.capacity * sizeof(struct otpSession*));
+    queue.head = 0;
+    queue.count = 0;
+    queue.drainHead = NULL;
+    queue.drainTail = NULL;
+    if (queue.sessions == NULL) error("ERROR allocating work queue");
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.ready, NULL);
+
+    int epollFD = epoll_create1(0);
+    if (epollFD < 0) error("ERROR creating epoll instance");
+    queue.epollFD = epollFD;
+    queue.wakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue.wakeFD < 0) error("ERROR creating eventfd");
+    struct epoll_event wakeEv;
+    memset(&wakeEv, 0, sizeof(wakeEv));
+    wakeEv.events = EPOLLIN;
+    wakeEv.data.ptr = &queue.wakeFD;
+    if (epoll_ctl(epollFD, EPOLL_CTL_ADD, queue.wakeFD, &wakeEv) < 0)
+        error("ERROR adding eventfd to epoll");
+    int i;
+    for (i = 0; i < listenCount; i++)
+    {
+        int flags = fcntl(listenFDs[i], F_GETFL, 0);
+        fcntl(listenFDs[i], F_SETFL, flags | O_NONBLOCK);
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = (void*)&listenFDs[i]; // listening sockets point into listenFDs, connections at their session
+        if (epoll_ctl(epollFD, EPOLL_CTL_ADD, listenFDs[i], &ev) < 0)
+            error("ERROR adding listen socket to epoll");
+    }
+
+    // Start the worker pool
+    for (i = 0; i < numThreads; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, connWorker, &queue) != 0)
+            error("ERROR creating worker thread");
+        pthread_detach(thread);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int timeoutMs = -1;
+    while (1)
+    {
+        int n = epoll_wait(epollFD, events, MAX_EVENTS, timeoutMs);
+        if (n < 0)
+        {
+            if (errno != EINTR) error("ERROR on epoll_wait");
+            n = 0;
+        }
+        for (i = 0; i < n; i++)
+        {
+            void* ptr = events[i].data.ptr;
+            struct otpSession* session = ptr;
+            if (ptr == (void*)&queue.wakeFD)
+            {
+                uint64_t count;
+                while (read(queue.wakeFD, &count, sizeof(count)) < 0 && errno == EINTR);
+                continue;
+            }
+            if ((ptr < (void*)listenFDs || ptr >= (void*)(listenFDs + listenCount)) && session->draining)
+            {
+                // Rejected, the loop drains it itself
+                drainStep(epollFD, session);
+                continue;
+            }
+            if (ptr < (void*)listenFDs || ptr >= (void*)(listenFDs + listenCount))
+            {
+                // Data, room to write (or a hang up) on a connection, a worker takes it from here.
+                // The one-shot registration stays disarmed until the worker is done.
+                pushConn(&queue, session);
+                continue;
+            }
+            // Accept everything that is waiting
+            while (1)
+            {
+                int connFD = accept4(*(const int*)ptr, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (connFD < 0)
+                {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                        perror("ERROR on accept");
+                    break;
+                }
+                uint64_t acceptedAt = statsNow();
+                session = openSession(connFD);
+                if (session == NULL)
+                {
+                    fprintf(stderr, "%s: out of memory for connection\n", daemonInfo->name);
+                    close(connFD);
+                    continue;
+                }
+                struct epoll_event connEv;
+                memset(&connEv, 0, sizeof(connEv));
+                connEv.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+                connEv.data.ptr = session;
+                if (epoll_ctl(epollFD, EPOLL_CTL_ADD, connFD, &connEv) < 0)
+                {
+                    perror("ERROR adding connection to epoll");
+                    closeSession(session);
+                    continue;
+                }
+                traceContext(session->traceId, 0);
+                statsCount(STAT_CONN_ACCEPTED, 1);
+                statsStage(STAGE_ACCEPT, acceptedAt);
+            }
+        }
+        timeoutMs = expireDrains(&queue);
+    }
+}
+
+/********************************************************************* 
+** uringRecv() / uringSend() / uringAcceptAll()
+* Queue one io_uring request for a session: a read into the free end
+* of its reader, or a write of the replies it has not sent yet (timed
+* as a STAGE_SEND from here until it completes). Both
+* use the registered arena when the buffer lives there; uringRecv()
+* returns its entry so a timeout can be linked to it. uringAcceptAll()
+* arms a multishot accept on the worker's listenFDs[which], which keeps
+* completing once per new connection until the kernel drops it, or a
+* plain accept on kernels without multishot (see uringWorkerLoop()).
+*********************************************************************/
+
+struct io_uring_sqe* uringRecv(struct uringWorker* worker, struct otpSession* session)
+{
+    struct otpReader* reader = &session->reader;
+    struct io_uring_sqe* sqe = getSqe(&worker->ring);
+    if (sqe == NULL) error("ERROR queueing io_uring read");
+    sqe->fd = session->socketFD;
+    sqe->addr = (uint64_t)(uintptr_t)(reader->buffer + reader->end);
+    sqe->len = reader->capacity - reader->end;
+    if (reader->borrowed)
+    {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->off = (uint64_t)-1;
+        sqe->buf_index = 0;
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_RECV;
+    }
+    sqe->user_data = (uint64_t)(uintptr_t)session | URING_RECV;
+    return sqe;
+}
+
+void uringSend(struct uringWorker* worker, struct otpSession* session)
+{
+    struct otpOutput* out = &session->out;
+    struct io_uring_sqe* sqe = getSqe(&worker->ring);
+    if (sqe == NULL) error("ERROR queueing io_uring write");
+    sqe->fd = session->socketFD;
+    sqe->addr = (uint64_t)(uintptr_t)(out->data + out->sent);
+    sqe->len = out->len - out->sent;
+    if (out->borrowed)
+    {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->off = (uint64_t)-1;
+        sqe->buf_index = 0;
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    sqe->user_data = (uint64_t)(uintptr_t)session | URING_SEND;
+    session->sendStart = statsNow();
+}
+
+void uringAcceptAll(struct uringWorker* worker, int which)
+{
+    struct io_uring_sqe* sqe = getSqe(&worker->ring);
+    if (sqe == NULL) error("ERROR queueing io_uring accept");
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = worker->listenFDs[which];
+    sqe->ioprio = worker->multishot ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = ((uint64_t)which << 2) | URING_ACCEPT;
+}
+
+/********************************************************************* 
+** uringClose()
+* Gives the session's registered slot back and closes the session.
+*********************************************************************/
+
+void uringClose(struct uringWorker* worker, struct otpSession* session)
+{
+    if (session->fixedSlot >= 0)
+    {
+        worker->freeSlots[worker->freeCount++] = session->fixedSlot;
+    }
+    closeSession(session);
+}
+
+/********************************************************************* 
+** uringDrain()
+* Drains a rejected session once its ERROR has been written (see
+* drainConnection()): half-closes it on the first call, then queues a
+* read into its reader, thrown away when it completes, with a timeout
+* linked to it for whatever is left of DRAIN_TIMEOUT_MS. The session
+* is closed when the client hangs up, the read fails or is cancelled
+* by the timeout, or the time runs out between reads.
+*********************************************************************/
+
+void uringDrain(struct uringWorker* worker, struct otpSession* session)
+{
+    uint64_t now = statsNow();
+    if (session->drainUntil == 0)
+    {
+        shutdown(session->socketFD, SHUT_WR);
+        session->drainUntil = now + DRAIN_TIMEOUT_MS * 1000000ull;
+    }
+    if (now >= session->drainUntil)
+    {
+        uringClose(worker, session);
+        return;
+    }
+    session->reader.start = 0;
+    session->reader.end = 0;
+    uint64_t left = session->drainUntil - now;
+    session->drainTimeout.tv_sec = left / 1000000000ull;
+    session->drainTimeout.tv_nsec = left % 1000000000ull;
+    struct io_uring_sqe* sqe = uringRecv(worker, session);
+    sqe->flags |= IOSQE_IO_LINK;
+    sqe = getSqe(&worker->ring);
+    if (sqe == NULL) error("ERROR queueing io_uring timeout");
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&session->drainTimeout;
+    sqe->len = 1;
+    sqe->user_data = URING_TIMEOUT;
+}
+
+/********************************************************************* 
+** uringServe()
+* Handles every whole frame the session has buffered, with the replies
+* captured into its output rather than written one by one, then queues
+* what comes next: a single write of all the replies, another read, or
+* closing (or for a rejected client, draining) the session once
+* nothing is left to send.
+*********************************************************************/
+
+void uringServe(struct uringWorker* worker, struct otpSession* session)
+{
+    while (1)
+    {
+        if (!session->closing)
+        {
+            captureSends(&session->out);
+            int result = serveSession(session, 0);
+            captureSends(NULL);
+            session->closing = (result == SESSION_CLOSED || result == SESSION_FAILED);
+            session->yielded = (result == SESSION_YIELD);
+        }
+        if (session->out.sent < session->out.len)
+        {
+            uringSend(worker, session);
+            return;
+        }
+        session->out.len = 0;
+        session->out.sent = 0;
+        if (session->closing)
+        {
+            if (session->draining)
+            {
+                uringDrain(worker, session);
+                return;
+            }
+            uringClose(worker, session);
+            return;
+        }
+        if (!session->yielded)
+        {
+            uringRecv(worker, session);
+            return;
+        }
+    }
+}
+
+/********************************************************************* 
+** uringAccepted()
+* Sets up a session for a connection the ring accepted. While the
+* arena has a free slot, the session reads into and replies from
+* registered buffers; a frame too big for its slot moves it onto
+* pooled buffers (see initReader()). Then the first read is queued.
+*********************************************************************/
+
+void uringAccepted(struct uringWorker* worker, int connFD)
+{
+    uint64_t acceptedAt = statsNow();
+    struct otpSession* session = openSession(connFD);
+    if (session == NULL)
+    {
+        fprintf(stderr, "%s: out of memory for connection\n", daemonInfo->name);
+        close(connFD);
+        return;
+    }
+    session->reader.external = 1;
+    session->drainUntil = 0;
+    if (worker->arena != NULL && worker->freeCount > 0)
+    {
+        int slot = worker->freeSlots[--worker->freeCount];
+        char* base = worker->arena + (size_t)slot * 2 * URING_SLOT_SIZE;
+        putBuffer(session->reader.buffer, session->reader.capacity);
+        session->reader.buffer = base;
+        session->reader.capacity = URING_SLOT_SIZE;
+        session->reader.borrowed = 1;
+        session->out.data = base + URING_SLOT_SIZE;
+        session->out.capacity = URING_SLOT_SIZE;
+        session->out.borrowed = 1;
+        session->fixedSlot = slot;
+    }
+    traceContext(session->traceId, 0);
+    statsCount(STAT_CONN_ACCEPTED, 1);
+    statsStage(STAGE_ACCEPT, acceptedAt);
+    uringRecv(worker, session);
+}
+
+/********************************************************************* 
+** uringAcceptRetry()
+* Says whether an accept that failed with res is worth arming again:
+* yes for a connection that went wrong or resources that ran short
+* for now, no for errors that mean the listener itself is unusable.
+*********************************************************************/
+
+int uringAcceptRetry(int res)
+{
+    switch (-res)
+    {
+    case EINTR: case EAGAIN: case ECONNABORTED: case EPROTO: case EPERM:
+    case EMFILE: case ENFILE: case ENOBUFS: case ENOMEM:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/********************************************************************* 
+** uringWorkerLoop()
+* io_uring thread body. Each turn submits everything queued since the
+* last one and waits for completions in a single system call, then
+* handles every completion that is ready: new connections, finished
+* reads (which are served straight away) and finished writes.
+*********************************************************************/
+
+void* uringWorkerLoop(void* arg)
+{
+    struct uringWorker* worker = arg;
+    int i;
+    for (i = 0; i < worker->listenCount; i++)
+    {
+        uringAcceptAll(worker, i);
+    }
+    while (1)
+    {
+        if (submitAndWait(&worker->ring, 1) < 0)
+        {
+            error("ERROR waiting on io_uring");
+        }
+        struct io_uring_cqe* cqe;
+        while ((cqe = peekCqe(&worker->ring)) != NULL)
+        {
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            seenCqe(&worker->ring);
+            struct otpSession* session = (struct otpSession*)(uintptr_t)(data & ~(uint64_t)URING_OP_MASK);
+            switch (data & URING_OP_MASK)
+            {
+            case URING_ACCEPT:
+                if (res == -EINVAL && worker->multishot)
+                {
+                    // The kernel predates multishot accept, take them one at a time
+                    worker->multishot = 0;
+                    uringAcceptAll(worker, (int)(data >> 2));
+                    break;
+                }
+                if (res >= 0)
+                {
+                    uringAccepted(worker, res);
+                }
+                else if (res != -EINTR && res != -EAGAIN && res != -ECONNABORTED)
+                {
+                    errno = -res;
+                    perror("ERROR on accept");
+                    if (!uringAcceptRetry(res))
+                    {
+                        // Re-arming would only fail the same way, forever
+                        fprintf(stderr, "%s: io_uring thread stopped accepting on a listener\n", daemonInfo->name);
+                        break;
+                    }
+                }
+                if (!(flags & IORING_CQE_F_MORE))
+                {
+                    uringAcceptAll(worker, (int)(data >> 2));
+                }
+                break;
+            case URING_TIMEOUT:
+                // Its read has completed (or been cancelled) as well
+                break;
+            case URING_RECV:
+                if (session->draining)
+                {
+                    if (res > 0 || res == -EINTR || res == -EAGAIN)
+                    {
+                        uringDrain(worker, session);
+                    }
+                    else
+                    {
+                        uringClose(worker, session);
+                    }
+                    break;
+                }
+                if (res == -EINTR || res == -EAGAIN)
+                {
+                    uringRecv(worker, session);
+                    break;
+                }
+                if (res < 0)
+                {
+                    statsCount(STAT_CONN_FAILED, 1);
+                    uringClose(worker, session);
+                    break;
+                }
+                if (res == 0)
+                {
+                    session->reader.eof = 1;
+                }
+                session->reader.end += res;
+                uringServe(worker, session);
+                break;
+            case URING_SEND:
+                if (res == -EINTR || res == -EAGAIN)
+                {
+                    uringSend(worker, session);
+                    break;
+                }
+                if (res <= 0)
+                {
+                    statsCount(STAT_CONN_FAILED, 1);
+                    uringClose(worker, session);
+                    break;
+                }
+                traceContext(session->traceId, 0);
+                statsStage(STAGE_SEND, session->sendStart);
+                session->out.sent += res;
+                uringServe(worker, session);
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Summary: io_uring server. Each of numThreads threads has its own ring
+   with a multishot accept armed on each shared listening socket, so the
+   kernel spreads new connections over the threads. With perThread set
+   the first numThreads of listenFDs are SO_REUSEPORT listeners, one per
+   thread, and the kernel spreads connections over their accept queues
+   instead, so no two threads ever accept from the same one. Reads and writes go
+   through the ring too, a batch of them per system call. A thread
+   serves its own connections start to finish. Each ring registers an
+   arena of read and reply buffers lent to its first URING_FIXED_SLOTS
+   sessions; if the memlock limit refuses it, sessions use pooled
+   buffers and plain recv/send requests instead.
+   Returns -1 without serving if io_uring is not available, or the
+   kernel's io_uring can't run every operation the threads use. */
+
+int runUringServer(const int* listenFDs, int listenCount, int numThreads, int perThread)
+{
+    struct uringWorker* workers = calloc(numThreads, sizeof(struct uringWorker));
+    if (workers == NULL) error("ERROR allocating io_uring workers");
+    int i, registered = 0;
+    for (i = 0; i < numThreads; i++)
+    {
+        struct uringWorker* worker = &workers[i];
+        if (initRing(&worker->ring, URING_ENTRIES) < 0)
+        {
+            if (i == 0)
+            {
+                perror("io_uring_setup");
+                free(workers);
+                return -1;
+            }
+            error("ERROR creating io_uring");
+        }
+        // Every ring is on the same kernel, so asking the first is enough
+        if (i == 0 && !ringSupports(&worker->ring, uringOps, sizeof(uringOps)))
+        {
+            fprintf(stderr, "%s: io_uring can't accept, recv, send or time out reads (kernel older than 5.6?)\n", daemonInfo->name);
+            freeRing(&worker->ring);
+            free(workers);
+            return -1;
+        }
+        worker->multishot = 1;
+        // Its own listener, if it has one, then every shared one
+        int first = perThread ? numThreads : 0;
+        worker->listenCount = 0;
+        if (perThread)
+        {
+            worker->listenFDs[worker->listenCount++] = listenFDs[i];
+        }
+        int j;
+        for (j = first; j < listenCount && worker->listenCount < MAX_LISTENERS; j++)
+        {
+            worker->listenFDs[worker->listenCount++] = listenFDs[j];
+        }
+        size_t arenaSize = (size_t)URING_FIXED_SLOTS * 2 * URING_SLOT_SIZE;
+        worker->arena = mmap(NULL, arenaSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (worker->arena == MAP_FAILED || registerRingBuffer(&worker->ring, worker->arena, arenaSize) < 0)
+        {
+            if (worker->arena != MAP_FAILED) munmap(worker->arena, arenaSize);
+            worker->arena = NULL;
+            continue;
+        }
+        registered++;
+        for (worker->freeCount = 0; worker->freeCount < URING_FIXED_SLOTS; worker->freeCount++)
+        {
+            worker->freeSlots[worker->freeCount] = worker->freeCount;
+        }
+    }
+    if (registered < numThreads)
+    {
+        fprintf(stderr, "%s: registered buffers for %d of %d io_uring threads (memlock limit?)\n",
+                daemonInfo->name, registered, numThreads);
+    }
+    for (i = 1; i < numThreads; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, uringWorkerLoop, &workers[i]) != 0)
+            error("ERROR creating io_uring thread");
+        pthread_detach(thread);
+    }
+    uringWorkerLoop(&workers[0]);
+    return 0;
+}
+
+/********************************************************************* 
+** openListener()
+* Creates a TCP socket listening on portNumber on every address. With
+* reusePort set it joins the port's SO_REUSEPORT group, so one can be
+* opened per thread and the kernel spreads connections over them.
+* Exits on failure.
+*********************************************************************/
+
+int openListener(int portNumber, int reusePort)
+{
+	struct sockaddr_in serverAddress;
+	int one = 1;
+
+	// Set up the address struct for this process (the server)
+	memset((char *)&serverAddress, '\0', sizeof(serverAddress)); // Clear out the address struct
+	serverAddress.sin_family = AF_INET; // Create a network-capable socket
+	serverAddress.sin_port = htons(portNumber); // Store the port number
+	serverAddress.sin_addr.s_addr = INADDR_ANY; // Any address is allowed for connection to this process
+
+	// Set up the socket
+	int listenSocketFD = socket(AF_INET, SOCK_STREAM, 0); // Create the socket
+	if (listenSocketFD < 0) error("ERROR opening socket");
+	if (reusePort && setsockopt(listenSocketFD, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+		error("ERROR setting SO_REUSEPORT");
+
+	// Enable the socket to begin listening
+	if (bind(listenSocketFD, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0) // Connect socket to port
+		error("ERROR on binding");
+	// Flip the socket on, with room for a burst of connections to queue
+	if (listen(listenSocketFD, LISTEN_BACKLOG) < 0) error("ERROR on listen");
+	return listenSocketFD;
+}
+
+/********************************************************************* 
+** runDaemon()
+* Parses the daemon's command line, then listens on the port and
+* serves clients forever as the daemon described by config.
+* Usage: [-m fork|epoll|uring] [-t threads] [-k id=padfile]... [-s statsSocket] [-T traceFile]
+*        [-u unixSocket] [-r] [-c maxRequests] [-C maxBytes] port
+*********************************************************************/
+
+int runDaemon(int argc, char *argv[], const struct daemonConfig* config)
+{
+    // Server variables
+	int portNumber;
+	int* listenFDs;
+	int listenCount = 0;
+	int reusePort = 0;
+	const char* unixPath = NULL;
+	int serverMode = SERVER_FORK;
+	int numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char* statsPath = NULL;
+	const char* tracePath = NULL;
+	int opt;
+
+	daemonInfo = config;
+	while ((opt = getopt(argc, argv, "m:t:k:s:T:u:rc:C:")) != -1)
+	{
+	    switch (opt)
+	    {
+	    case 'm':
+	        if (strcmp(optarg, "epoll") == 0) serverMode = SERVER_EPOLL;
+	        else if (strcmp(optarg, "uring") == 0) serverMode = SERVER_URING;
+	        else if (strcmp(optarg, "fork") == 0) serverMode = SERVER_FORK;
+	        else { fprintf(stderr, "%s: unknown mode %s\n", argv[0], optarg); exit(1); }
+	        break;
+	    case 't':
+	        numThreads = atoi(optarg);
+	        break;
+	    case 'k':
+	        // Map the pad now so forked children and workers all share it
+	        if (registerPad(optarg) < 0) exit(1);
+	        break;
+	    case 's':
+	        statsPath = optarg;
+	        break;
+	    case 'T':
+	        tracePath = optarg;
+	        break;
+	    case 'u':
+	        unixPath = optarg;
+	        break;
+	    case 'r':
+	        reusePort = 1;
+	        break;
+	    case 'c':
+	        maxRequests = strtoull(optarg, NULL, 10);
+	        break;
+	    case 'C':
+	        maxBytes = strtoull(optarg, NULL, 10);
+	        break;
+	    default:
+	        fprintf(stderr, "USAGE: %s [-m fork|epoll|uring] [-t threads] [-k id=padfile]... [-s statsSocket] [-T traceFile] [-u unixSocket] [-r] [-c maxRequests] [-C maxBytes] port\n", argv[0]);
+	        exit(1);
+	    }
+	}
+	if (optind >= argc) { fprintf(stderr,"USAGE: %s [-m fork|epoll|uring] [-t threads] [-k id=padfile]... [-s statsSocket] [-T traceFile] [-u unixSocket] [-r] [-c maxRequests] [-C maxBytes] port\n", argv[0]); exit(1); } // Check usage & args
+	if (numThreads < 1) numThreads = 1;
+	// Only io_uring threads accept for themselves; fork and epoll accept
+	// every connection from one loop, so a listener each would do nothing
+	if (reusePort && serverMode != SERVER_URING)
+	{
+	    fprintf(stderr, "%s: -r needs -m uring\n", argv[0]);
+	    exit(1);
+	}
+
+	// Pick the fastest cipher and packing kernels this CPU supports
+	initEncoder();
+	initPacker();
+	// A client hanging up mid-send shouldn't take the daemon down with it
+	signal(SIGPIPE, SIG_IGN);
+	// Counters go in shared memory before any worker or child starts
+	if (initStats() < 0 || (tracePath != NULL && initTrace() < 0) ||
+	    startStatsThread(statsPath, daemonInfo->name, tracePath) < 0) exit(1);
+
+	// The admission totals are shared with every forked child
+	if (maxRequests > 0 || maxBytes > 0)
+	{
+	    admitted = mmap(NULL, sizeof(struct admission), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	    if (admitted == MAP_FAILED) error("ERROR mapping admission counters");
+	}
+
+	// One listener on the port, or with -r one per thread in a
+	// SO_REUSEPORT group, then the Unix socket
+	portNumber = atoi(argv[optind]); // Get the port number, convert to an integer from a string
+	int tcpCount = reusePort ? numThreads : 1;
+	listenFDs = malloc((tcpCount + 1) * sizeof(int));
+	if (listenFDs == NULL) error("ERROR allocating listeners");
+	while (listenCount < tcpCount)
+	{
+	    listenFDs[listenCount++] = openListener(portNumber, reusePort);
+	}
+
+	// Local clients can skip TCP altogether through a Unix domain socket
+	if (unixPath != NULL)
+	{
+	    struct sockaddr_un unixAddress;
+	    memset(&unixAddress, '\0', sizeof(unixAddress));
+	    unixAddress.sun_family = AF_UNIX;
+	    if (strlen(unixPath) >= sizeof(unixAddress.sun_path))
+	    {
+	        fprintf(stderr, "%s: socket path too long: %s\n", daemonInfo->name, unixPath);
+	        exit(1);
+	    }
+	    strcpy(unixAddress.sun_path, unixPath);
+	    unlink(unixPath); // a stale socket from an earlier run would make bind() fail
+	    int unixSocketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+	    if (unixSocketFD < 0) error("ERROR opening unix socket");
+	    if (bind(unixSocketFD, (struct sockaddr *)&unixAddress, sizeof(unixAddress)) < 0)
+	        error("ERROR on binding unix socket");
+	    if (listen(unixSocketFD, LISTEN_BACKLOG) < 0) error("ERROR on listen");
+	    listenFDs[listenCount++] = unixSocketFD;
+	}
+
+	if (serverMode == SERVER_URING && runUringServer(listenFDs, listenCount, numThreads, reusePort) < 0)
+	{
+	    fprintf(stderr, "%s: io_uring unavailable, using epoll\n", daemonInfo->name);
+	    serverMode = SERVER_EPOLL;
+	    // One loop accepts for epoll, so keep one listener of the -r group
+	    if (reusePort)
+	    {
+	        int i;
+	        for (i = 1; i < tcpCount; i++)
+	        {
+	            close(listenFDs[i]);
+	        }
+	        if (unixPath != NULL)
+	        {
+	            listenFDs[1] = listenFDs[tcpCount];
+	        }
+	        listenCount -= tcpCount - 1;
+	    }
+	}
+	if (serverMode == SERVER_EPOLL)
+	{
+	    runEpollServer(listenFDs, listenCount, numThreads);
+	}
+	else if (serverMode == SERVER_FORK)
+	{
+	    runForkServer(listenFDs, listenCount);
+	}
+	// Close the listening sockets
+	int i;
+	for (i = 0; i < listenCount; i++)
+	{
+	    close(listenFDs[i]);
+	}
+	if (unixPath != NULL)
+	{
+	    unlink(unixPath);
+	}
+	free(listenFDs);
+	return 0; 
+}
@@ -0,0 +1,21 @@
+/*********************************************************************
+** otpdaemon.h
+** Description: Entry point of the server core shared by otp_enc_d and
+* otp_dec_d. Each daemon describes itself with a daemonConfig and hands
+* its command line to runDaemon().
+*********************************************************************/
+
+#ifndef OTPDAEMON_H
+#define OTPDAEMON_H
+
+struct daemonConfig
+{
+    const char* name;     // daemon name used in messages, e.g. "otp_enc_d"
+    const char* client;   // the only client it serves, e.g. "otp_enc"
+    const char* authCode; // code that client sends in HELLO
+    int direction;        // OTP_ENCRYPT or OTP_DECRYPT
+};
+
+int runDaemon(int argc, char *argv[], const struct daemonConfig* config);
+
+#endif
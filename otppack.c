@@ -0,0 +1,328 @@
+/*********************************************************************
+** otppack.c
+** Description: Packing kernels for the packed wire format. Each group
+* of five symbols (indexes 0..26, A=0 .. Z=25, space=26, first symbol
+* most significant) is sent as its base-27 value, a 24-bit
+* little-endian number below 27^5. Only the last group of a segment
+* may be short: a group of k < 5 symbols is sent as
+* 27^5 + tailBase[k] + its value, which still fits in 24 bits, so a
+* segment says how many symbols it holds without a separate length.
+* The scalar kernels do one group at a time. The AVX2 kernels do four:
+* packing multiplies the indexes by their place values in two
+* multiply-add steps, unpacking divides by 27 with a multiply by its
+* reciprocal and a shift, and byte shuffles move the groups between
+* their five and three byte strides. initPacker() picks the widest
+* kernel the CPU supports; OTP_ENCODER=scalar forces the scalar ones.
+*********************************************************************/
+
+#include <string.h>
+#include <stdlib.h>
+#include "otppack.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define OTP_X86 1
+#include <immintrin.h>
+#endif
+
+#define FULL_LIMIT 14348907u // 27^5, first value that isn't a full group
+#define DIV27_MAGIC 1272582903u // ceil(2^35 / 27): x / 27 == (x * DIV27_MAGIC) >> 35 for x < 2^24
+#define INDEX_OF(c) ((c) == ' ' ? 26 : (c) - 'A')
+#define CHAR_AT(i) ((i) == 26 ? ' ' : 'A' + (i))
+
+// Where the codes for a short group of k symbols start, above FULL_LIMIT
+static const uint32_t tailBase[OTP_PACK_SYMBOLS] = { 0, 531441 + 19683 + 729, 531441 + 19683, 531441, 0 };
+static const uint32_t tailSpan[OTP_PACK_SYMBOLS] = { 0, 27, 729, 19683, 531441 };
+
+/*********************************************************************
+** packGroup() / unpackGroup()
+* Pack count symbols into one value, and split a value back into
+* count symbols.
+*********************************************************************/
+
+static uint32_t packGroup(const char* text, int count)
+{
+    uint32_t v = 0;
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        v = v * 27 + (uint32_t)INDEX_OF(text[i]);
+    }
+    return v;
+}
+
+static void unpackGroup(uint32_t v, int count, char* text)
+{
+    int i;
+    for (i = count - 1; i >= 0; i--)
+    {
+        text[i] = CHAR_AT(v % 27);
+        v /= 27;
+    }
+}
+
+static void put24(unsigned char* p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+}
+
+static uint32_t get24(const unsigned char* p)
+{
+    return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+}
+
+/*********************************************************************
+** packScalar() / unpackScalar()
+* Pack groups full groups of text, and unpack them. Unpacking stops at
+* the first value that isn't a full group and returns how many groups
+* came before it.
+*********************************************************************/
+
+static void packScalar(const char* text, size_t groups, unsigned char* packed)
+{
+    size_t g;
+    for (g = 0; g < groups; g++)
+    {
+        put24(packed + g * OTP_PACK_BYTES, packGroup(text + g * OTP_PACK_SYMBOLS, OTP_PACK_SYMBOLS));
+    }
+}
+
+static size_t unpackScalar(const unsigned char* packed, size_t groups, char* text)
+{
+    size_t g;
+    for (g = 0; g < groups; g++)
+    {
+        uint32_t v = get24(packed + g * OTP_PACK_BYTES);
+        if (v >= FULL_LIMIT)
+        {
+            break;
+        }
+        unpackGroup(v, OTP_PACK_SYMBOLS, text + g * OTP_PACK_SYMBOLS);
+    }
+    return g;
+}
+
+#ifdef OTP_X86
+
+/* Both AVX2 kernels work on four groups at a time, two in each 128-bit
+   lane, and load and store whole lanes at overlapping offsets. They
+   stop eight groups short of the end so no load or store runs past the
+   groups they were given; the scalar kernels finish the rest. */
+
+__attribute__((target("avx2")))
+static void packAVX2(const char* text, size_t groups, unsigned char* packed)
+{
+    // Spread each group's five indexes over its own 64 bits
+    const __m256i spread = _mm256_setr_epi8(0, 1, 2, 3, 4, -1, -1, -1, 5, 6, 7, 8, 9, -1, -1, -1,
+                                            0, 1, 2, 3, 4, -1, -1, -1, 5, 6, 7, 8, 9, -1, -1, -1);
+    // a b c d e -> a*27+b, c*27+d, e -> (a*27+b)*27^3 + (c*27+d)*27, e
+    const __m256i place8 = _mm256_setr_epi8(27, 1, 27, 1, 1, 0, 0, 0, 27, 1, 27, 1, 1, 0, 0, 0,
+                                            27, 1, 27, 1, 1, 0, 0, 0, 27, 1, 27, 1, 1, 0, 0, 0);
+    const __m256i place16 = _mm256_setr_epi16(19683, 27, 1, 0, 19683, 27, 1, 0, 19683, 27, 1, 0, 19683, 27, 1, 0);
+    // Low three bytes of each group's value
+    const __m256i gather = _mm256_setr_epi8(0, 1, 2, 8, 9, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                            0, 1, 2, 8, 9, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256i base = _mm256_set1_epi8('A');
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i k26 = _mm256_set1_epi8(26);
+    size_t g = 0;
+    for (; g + 8 <= groups; g += 4)
+    {
+        const char* in = text + g * OTP_PACK_SYMBOLS;
+        unsigned char* out = packed + g * OTP_PACK_BYTES;
+        __m256i x = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)in)),
+                                            _mm_loadu_si128((const __m128i*)(in + 10)), 1);
+        __m256i idx = _mm256_blendv_epi8(_mm256_sub_epi8(x, base), k26, _mm256_cmpeq_epi8(x, space));
+        __m256i v = _mm256_madd_epi16(_mm256_maddubs_epi16(_mm256_shuffle_epi8(idx, spread), place8), place16);
+        v = _mm256_add_epi32(v, _mm256_srli_epi64(v, 32));
+        v = _mm256_shuffle_epi8(v, gather);
+        _mm_storeu_si128((__m128i*)out, _mm256_castsi256_si128(v));
+        _mm_storeu_si128((__m128i*)(out + 6), _mm256_extracti128_si256(v, 1));
+    }
+    packScalar(text + g * OTP_PACK_SYMBOLS, groups - g, packed + g * OTP_PACK_BYTES);
+}
+
+__attribute__((target("avx2")))
+static size_t unpackAVX2(const unsigned char* packed, size_t groups, char* text)
+{
+    // Each group's three bytes into its own 64 bits
+    const __m256i spread = _mm256_setr_epi8(0, 1, 2, -1, -1, -1, -1, -1, 3, 4, 5, -1, -1, -1, -1, -1,
+                                            0, 1, 2, -1, -1, -1, -1, -1, 3, 4, 5, -1, -1, -1, -1, -1);
+    // First five bytes of each group's 64 bits
+    const __m256i gather = _mm256_setr_epi8(0, 1, 2, 3, 4, 8, 9, 10, 11, 12, -1, -1, -1, -1, -1, -1,
+                                            0, 1, 2, 3, 4, 8, 9, 10, 11, 12, -1, -1, -1, -1, -1, -1);
+    const __m256i limit = _mm256_set1_epi64x(FULL_LIMIT);
+    const __m256i magic = _mm256_set1_epi64x(DIV27_MAGIC);
+    const __m256i k27 = _mm256_set1_epi64x(27);
+    const __m256i base = _mm256_set1_epi8('A');
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i k26 = _mm256_set1_epi8(26);
+    size_t g = 0;
+    for (; g + 8 <= groups; g += 4)
+    {
+        const unsigned char* in = packed + g * OTP_PACK_BYTES;
+        char* out = text + g * OTP_PACK_SYMBOLS;
+        __m256i x = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)in)),
+                                            _mm_loadu_si128((const __m128i*)(in + 6)), 1);
+        __m256i v = _mm256_shuffle_epi8(x, spread);
+        if (_mm256_movemask_epi8(_mm256_cmpgt_epi64(limit, v)) != -1)
+        {
+            break;
+        }
+        // Peel off the last symbol four times; what's left is the first
+        __m256i digits = _mm256_setzero_si256();
+        int i;
+        for (i = 4; i >= 1; i--)
+        {
+            __m256i q = _mm256_srli_epi64(_mm256_mul_epu32(v, magic), 35);
+            __m256i r = _mm256_sub_epi64(v, _mm256_mul_epu32(q, k27));
+            digits = _mm256_or_si256(digits, _mm256_slli_epi64(r, 8 * i));
+            v = q;
+        }
+        digits = _mm256_or_si256(digits, v);
+        __m256i sym = _mm256_blendv_epi8(_mm256_add_epi8(digits, base), space, _mm256_cmpeq_epi8(digits, k26));
+        sym = _mm256_shuffle_epi8(sym, gather);
+        _mm_storeu_si128((__m128i*)out, _mm256_castsi256_si128(sym));
+        _mm_storeu_si128((__m128i*)(out + 10), _mm256_extracti128_si256(sym, 1));
+    }
+    return g + unpackScalar(packed + g * OTP_PACK_BYTES, groups - g, text + g * OTP_PACK_SYMBOLS);
+}
+
+#endif
+
+// Kernels chosen by initPacker()
+typedef void (*packKernel)(const char* text, size_t groups, unsigned char* packed);
+typedef size_t (*unpackKernel)(const unsigned char* packed, size_t groups, char* text);
+static packKernel activePacker = packScalar;
+static unpackKernel activeUnpacker = unpackScalar;
+static const char* activeName = "scalar";
+
+/*********************************************************************
+** initPacker()
+* Points the packing functions at the widest kernels the CPU supports.
+* Should be called once at startup, next to initEncoder().
+*********************************************************************/
+
+void initPacker(void)
+{
+    const char* forced = getenv("OTP_ENCODER");
+    activePacker = packScalar;
+    activeUnpacker = unpackScalar;
+    activeName = "scalar";
+    if (forced != NULL && strcmp(forced, "scalar") == 0)
+    {
+        return;
+    }
+#ifdef OTP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        activePacker = packAVX2;
+        activeUnpacker = unpackAVX2;
+        activeName = "avx2";
+    }
+#endif
+}
+
+const char* packerName(void)
+{
+    return activeName;
+}
+
+/*********************************************************************
+** packSymbols()
+* Packs len characters of text, which must all be from CHARS, into
+* packed, which must hold packedSize(len) bytes. Returns how many bytes
+* were written.
+*********************************************************************/
+
+size_t packSymbols(const char* text, size_t len, unsigned char* packed)
+{
+    size_t groups = len / OTP_PACK_SYMBOLS;
+    int tail = len % OTP_PACK_SYMBOLS;
+    activePacker(text, groups, packed);
+    if (tail)
+    {
+        uint32_t v = packGroup(text + groups * OTP_PACK_SYMBOLS, tail);
+        put24(packed + groups * OTP_PACK_BYTES, FULL_LIMIT + tailBase[tail] + v);
+    }
+    return packedSize(len);
+}
+
+/*********************************************************************
+** unpackedLength()
+* Works out how many characters bytes of packed data hold, from the
+* last group. Returns 0 on success, -1 if the data can't be packed
+* symbols.
+*********************************************************************/
+
+static int tailCount(uint32_t v, uint32_t* value)
+{
+    int k;
+    if (v < FULL_LIMIT)
+    {
+        *value = v;
+        return OTP_PACK_SYMBOLS;
+    }
+    v -= FULL_LIMIT;
+    for (k = OTP_PACK_SYMBOLS - 1; k >= 1; k--)
+    {
+        if (v >= tailBase[k] && v < tailBase[k] + tailSpan[k])
+        {
+            *value = v - tailBase[k];
+            return k;
+        }
+    }
+    return -1;
+}
+
+int unpackedLength(const unsigned char* packed, size_t bytes, uint64_t* len)
+{
+    uint32_t value;
+    if (bytes % OTP_PACK_BYTES != 0)
+    {
+        return -1;
+    }
+    if (bytes == 0)
+    {
+        *len = 0;
+        return 0;
+    }
+    int last = tailCount(get24(packed + bytes - OTP_PACK_BYTES), &value);
+    if (last < 0)
+    {
+        return -1;
+    }
+    *len = (uint64_t)(bytes / OTP_PACK_BYTES - 1) * OTP_PACK_SYMBOLS + last;
+    return 0;
+}
+
+/*********************************************************************
+** unpackSymbols()
+* Unpacks bytes of packed data into text, which must hold as many
+* characters as unpackedLength() gives. Returns 0 on success, -1 if
+* the data can't be packed symbols (text may be partly written).
+*********************************************************************/
+
+int unpackSymbols(const unsigned char* packed, size_t bytes, char* text)
+{
+    uint64_t len;
+    if (unpackedLength(packed, bytes, &len) < 0)
+    {
+        return -1;
+    }
+    size_t groups = len / OTP_PACK_SYMBOLS;
+    int tail = len % OTP_PACK_SYMBOLS;
+    if (activeUnpacker(packed, groups, text) != groups)
+    {
+        return -1;
+    }
+    if (tail)
+    {
+        uint32_t value = 0;
+        tailCount(get24(packed + groups * OTP_PACK_BYTES), &value);
+        unpackGroup(value, tail, text + groups * OTP_PACK_SYMBOLS);
+    }
+    return 0;
+}
@@ -0,0 +1,27 @@
+/*********************************************************************
+** otppack.h
+** Description: Function prototypes for the packed wire format. Text
+* only ever holds the 27 symbols in CHARS, so five of them fit in three
+* bytes (27^5 < 2^24) instead of five, 40% less to send. A request
+* asks for it with OTP_FLAG_PACKED in its HELLO.
+*********************************************************************/
+
+#ifndef OTPPACK_H
+#define OTPPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OTP_PACK_SYMBOLS 5 // symbols in one packed group
+#define OTP_PACK_BYTES 3   // bytes one packed group takes
+
+// Bytes that len symbols pack into
+#define packedSize(len) ((((len) + OTP_PACK_SYMBOLS - 1) / OTP_PACK_SYMBOLS) * OTP_PACK_BYTES)
+
+void initPacker(void);
+const char* packerName(void);
+size_t packSymbols(const char* text, size_t len, unsigned char* packed);
+int unpackedLength(const unsigned char* packed, size_t bytes, uint64_t* len);
+int unpackSymbols(const unsigned char* packed, size_t bytes, char* text);
+
+#endif
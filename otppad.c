@@ -0,0 +1,236 @@
+/*********************************************************************
+** otppad.c
+** Description: Pad store for the one time pad daemons. Each pad file
+* given with -k id=path is mapped read-only and checked once at
+* startup. Next to it lives a small ledger file recording how much of
+* the pad has been handed out. reservePad() claims the next unused
+* range with a compare-and-swap on the mapped ledger and forces it to
+* disk before the range is used, so no key byte is given out twice,
+* across threads, forked children or a crash and restart.
+*********************************************************************/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "otpshared.h"
+#include "otppad.h"
+#include "otpcipher.h"
+
+static struct otpPad pads[OTP_MAX_PADS];
+static int padCount = 0;
+
+/*********************************************************************
+** openLedger()
+* Maps the ledger for a pad, creating it with nothing reserved when it
+* does not exist yet. An existing ledger must be for a pad of padSize
+* bytes: one kept for another (or truncated) pad would let reservations
+* run past this one. Returns NULL on failure.
+*********************************************************************/
+
+static struct padLedger* openLedger(const char* padPath, uint64_t padSize)
+{
+    char path[4096];
+    if (snprintf(path, sizeof(path), "%s%s", padPath, OTP_LEDGER_SUFFIX) >= (int)sizeof(path))
+    {
+        fprintf(stderr, "pad path too long: %s\n", padPath);
+        return NULL;
+    }
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+    {
+        perror(path);
+        return NULL;
+    }
+    struct stat st;
+    int fresh = (fstat(fd, &st) == 0 && st.st_size == 0);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (fresh && ftruncate(fd, pageSize) < 0)
+    {
+        perror(path);
+        close(fd);
+        return NULL;
+    }
+    struct padLedger* ledger = mmap(NULL, pageSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ledger == MAP_FAILED)
+    {
+        perror(path);
+        return NULL;
+    }
+    if (fresh)
+    {
+        ledger->magic = OTP_LEDGER_MAGIC;
+        ledger->nextOffset = 0;
+        ledger->padSize = padSize;
+        msync(ledger, pageSize, MS_SYNC);
+    }
+    else if (ledger->magic != OTP_LEDGER_MAGIC)
+    {
+        fprintf(stderr, "%s is not a pad ledger\n", path);
+        munmap(ledger, pageSize);
+        return NULL;
+    }
+    else if (ledger->padSize != padSize || ledger->nextOffset > padSize)
+    {
+        fprintf(stderr, "%s is for a pad of %llu bytes, %s has %llu\n", path,
+                (unsigned long long)ledger->padSize, padPath, (unsigned long long)padSize);
+        munmap(ledger, pageSize);
+        return NULL;
+    }
+    return ledger;
+}
+
+/*********************************************************************
+** registerPad()
+* Given a spec of the form id=path, where id is a number that fits in
+* 32 bits, maps the pad file, measures its contents up to the first
+* newline, validates them and opens its ledger. Must be called before the daemon starts serving (and before
+* any fork) so every worker shares the same mappings.
+* Returns 0 on success, -1 on failure.
+*********************************************************************/
+
+int registerPad(const char* spec)
+{
+    const char* eq = strchr(spec, '=');
+    if (eq == NULL || eq == spec)
+    {
+        fprintf(stderr, "pad must be given as id=path: %s\n", spec);
+        return -1;
+    }
+    if (padCount == OTP_MAX_PADS)
+    {
+        fprintf(stderr, "too many pads, the limit is %d\n", OTP_MAX_PADS);
+        return -1;
+    }
+    char* end;
+    errno = 0;
+    unsigned long long parsed = strtoull(spec, &end, 10);
+    if (!isdigit((unsigned char)spec[0]) || end != eq || errno != 0 || parsed > UINT32_MAX)
+    {
+        fprintf(stderr, "pad id must be a number from 0 to %u: %s\n", UINT32_MAX, spec);
+        return -1;
+    }
+    uint32_t id = parsed;
+    const char* path = eq + 1;
+    if (findPad(id) != NULL)
+    {
+        fprintf(stderr, "pad %u registered twice\n", id);
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        fprintf(stderr, "%s: empty or unreadable pad\n", path);
+        close(fd);
+        return -1;
+    }
+    const char* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        perror(path);
+        return -1;
+    }
+    // Usable key ends at the first newline, same as a key file sent by otp_enc
+    uint64_t size;
+    if (!scanText(data, st.st_size, &size))
+    {
+        fprintf(stderr, "%s contains invalid chars\n", path);
+        munmap((void*)data, st.st_size);
+        return -1;
+    }
+    struct padLedger* ledger = openLedger(path, size);
+    if (ledger == NULL)
+    {
+        munmap((void*)data, st.st_size);
+        return -1;
+    }
+
+    struct otpPad* pad = &pads[padCount++];
+    pad->id = id;
+    pad->data = data;
+    pad->size = size;
+    pad->mapSize = st.st_size;
+    pad->ledger = ledger;
+    return 0;
+}
+
+/*********************************************************************
+** findPad()
+* Returns the registered pad with the given id, or NULL.
+*********************************************************************/
+
+struct otpPad* findPad(uint32_t id)
+{
+    int i;
+    for (i = 0; i < padCount; i++)
+    {
+        if (pads[i].id == id)
+        {
+            return &pads[i];
+        }
+    }
+    return NULL;
+}
+
+/*********************************************************************
+** reservePad()
+* Claims the next len unused bytes of the pad and stores where they
+* start in offset. The claim is a compare-and-swap on the shared ledger,
+* so concurrent clients never get overlapping ranges and nobody waits
+* on a lock. The ledger page is then synced to disk before returning:
+* after a crash the ledger is at or past the end of every range that
+* was actually used. Returns 0 on success, -1 if the pad does not have
+* len bytes left or the ledger could not be synced.
+*********************************************************************/
+
+int reservePad(struct otpPad* pad, uint64_t len, uint64_t* offset)
+{
+    uint64_t current = __atomic_load_n(&pad->ledger->nextOffset, __ATOMIC_ACQUIRE);
+    do
+    {
+        if (current > pad->size || len > pad->size - current)
+        {
+            return -1;
+        }
+    }
+    while (!__atomic_compare_exchange_n(&pad->ledger->nextOffset, &current, current + len, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    if (msync(pad->ledger, sysconf(_SC_PAGESIZE), MS_SYNC) < 0)
+    {
+        perror("ledger msync");
+        return -1;
+    }
+    *offset = current;
+    return 0;
+}
+
+/*********************************************************************
+** checkPadRange()
+* Checks that the len bytes starting at offset have already been handed
+* out by reservePad(), so a message can only be decrypted with key that
+* encrypted something. Returns 0 if they have, -1 if not.
+*********************************************************************/
+
+int checkPadRange(struct otpPad* pad, uint64_t offset, uint64_t len)
+{
+    uint64_t used = __atomic_load_n(&pad->ledger->nextOffset, __ATOMIC_ACQUIRE);
+    if (used > pad->size)
+    {
+        used = pad->size;
+    }
+    return (offset <= used && len <= used - offset) ? 0 : -1;
+}
@@ -0,0 +1,41 @@
+/*********************************************************************
+** otppad.h
+** Description: Function prototypes for the daemon's pad store. Pads
+* are key files registered with the daemon at startup and referred to
+* by number, so clients only send plaintext.
+*********************************************************************/
+
+#ifndef OTPPAD_H
+#define OTPPAD_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define OTP_MAX_PADS 64 // most pads one daemon can hold
+#define OTP_LEDGER_SUFFIX ".ledger" // ledger file sits next to its pad
+#define OTP_LEDGER_MAGIC 0x4F54504C45444752ull // "OTPLEDGR"
+
+// On-disk ledger, mapped shared so every thread and forked child sees
+// the same nextOffset
+struct padLedger
+{
+    uint64_t magic;
+    uint64_t nextOffset; // first key byte nobody has been given yet
+    uint64_t padSize;
+};
+
+struct otpPad
+{
+    uint32_t id;
+    const char* data;     // mapped pad contents
+    uint64_t size;        // usable key bytes (up to the first newline)
+    size_t mapSize;       // size of the data mapping
+    struct padLedger* ledger;
+};
+
+int registerPad(const char* spec);
+struct otpPad* findPad(uint32_t id);
+int reservePad(struct otpPad* pad, uint64_t len, uint64_t* offset);
+int checkPadRange(struct otpPad* pad, uint64_t offset, uint64_t len);
+
+#endif
@@ -0,0 +1,249 @@
+/*********************************************************************
+** otppool.c
+** Description: Parallel encoder for large payloads. Every character
+* of ciphertext depends only on the plaintext and key characters at the
+* same position, so a message can be cut into OTP_PARALLEL_BLOCK sized
+* blocks and encoded in any order. The blocks are dealt out in one
+* slice per thread. Each thread takes blocks from its own slice with an
+* atomic counter, then steals from the other slices once its own runs
+* dry, so a thread that got descheduled doesn't hold up the rest. The
+* calling thread takes part as slice 0.
+* Only single payloads of OTP_PARALLEL_MIN bytes or more use it: the
+* single-file clients' DATA frames. Shared memory slots never do (see
+* shmWorker()). Frames of OTP_CHUNK_SIZE (batch, stream, libotp.a) stay
+* on the worker that got them, as there are usually many of them in
+* flight at once.
+* The pool is started on first use and runs one message at a time; a
+* caller that finds it busy encodes on its own thread instead. Forked
+* daemon children call encodeSerially() and never start one: each
+* serves a single connection, and a pool per child would pay for its
+* threads on every large request and pit the children's pools against
+* each other.
+* Setting OTP_ENCODE_THREADS in the environment overrides the number of
+* threads (1 turns parallel encoding off).
+*********************************************************************/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "otpcipher.h"
+#include "otppool.h"
+
+// One thread's share of the blocks, padded so the counters of
+// different threads don't share a cache line
+struct workSlice
+{
+    size_t next; // next block to take
+    size_t end;  // one past the last block in the slice
+    char pad[64 - 2 * sizeof(size_t)];
+};
+
+struct encodePool
+{
+    pthread_mutex_t submit; // held by the caller whose message is running
+    pthread_mutex_t lock;
+    pthread_cond_t wake;     // a new message is ready
+    pthread_cond_t finished; // the last helper left the message
+    int threads;             // participants, including the caller
+    unsigned long generation;
+    int open;                // helpers may still join the current message
+    int busy;                // helpers working on the current message
+    const char* plaintext;
+    const char* key;
+    char* encryptedText;
+    size_t len;
+    int direction;
+    int alphabet;
+    size_t firstBad;         // lowest position of a bad character found
+    struct workSlice slices[OTP_MAX_ENCODE_THREADS];
+};
+
+static struct encodePool pool =
+{
+    .submit = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .finished = PTHREAD_COND_INITIALIZER
+};
+static pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
+static int serialOnly = 0; // set by encodeSerially()
+
+/*********************************************************************
+** encodeAs()
+* encodeChecked() for text. Any byte is valid, so bytes are all
+* encoded by encodeBytes() and never stop early.
+*********************************************************************/
+
+static size_t encodeAs(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction, int alphabet)
+{
+    if (alphabet == OTP_ALPHABET_BYTES)
+    {
+        encodeBytes(plaintext, key, encryptedText, len, direction);
+        return len;
+    }
+    return encodeChecked(plaintext, key, encryptedText, len, direction);
+}
+
+/*********************************************************************
+** runSlices()
+* Encodes blocks of the current message until none are left, starting
+* with slice self and then stealing from the others in turn. A block
+* with a bad character lowers firstBad to where it is.
+*********************************************************************/
+
+static void runSlices(int self)
+{
+    int i;
+    for (i = 0; i < pool.threads; i++)
+    {
+        struct workSlice* slice = &pool.slices[(self + i) % pool.threads];
+        size_t block;
+        while ((block = __atomic_fetch_add(&slice->next, 1, __ATOMIC_RELAXED)) < slice->end)
+        {
+            size_t start = block * OTP_PARALLEL_BLOCK;
+            size_t n = (pool.len - start < OTP_PARALLEL_BLOCK) ? pool.len - start : OTP_PARALLEL_BLOCK;
+            size_t done = encodeAs(pool.plaintext + start, pool.key + start, pool.encryptedText + start, n, pool.direction, pool.alphabet);
+            if (done < n)
+            {
+                size_t bad = start + done;
+                size_t current = __atomic_load_n(&pool.firstBad, __ATOMIC_RELAXED);
+                while (bad < current && !__atomic_compare_exchange_n(&pool.firstBad, &current, bad, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+            }
+        }
+    }
+}
+
+/*********************************************************************
+** poolWorker()
+* Helper thread: waits for a message, works through its slice and
+* steals what is left, then goes back to waiting.
+*********************************************************************/
+
+static void* poolWorker(void* arg)
+{
+    int self = (int)(long)arg;
+    unsigned long seen = 0;
+    while (1)
+    {
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.open || pool.generation == seen)
+        {
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        }
+        seen = pool.generation;
+        pool.busy++;
+        pthread_mutex_unlock(&pool.lock);
+
+        runSlices(self);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.busy == 0)
+        {
+            pthread_cond_signal(&pool.finished);
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return NULL;
+}
+
+/*********************************************************************
+** startPool()
+* Starts one helper thread per extra online CPU (or OTP_ENCODE_THREADS
+* minus one). If threads can't be started the pool just runs smaller.
+*********************************************************************/
+
+static void startPool(void)
+{
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char* forced = getenv("OTP_ENCODE_THREADS");
+    if (forced != NULL)
+    {
+        threads = atol(forced);
+    }
+    if (threads < 1) threads = 1;
+    if (threads > OTP_MAX_ENCODE_THREADS) threads = OTP_MAX_ENCODE_THREADS;
+
+    pool.threads = 1;
+    while (pool.threads < threads)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, poolWorker, (void*)(long)pool.threads) != 0)
+        {
+            break;
+        }
+        pthread_detach(thread);
+        pool.threads++;
+    }
+}
+
+/*********************************************************************
+** encodeSerially()
+* From now on every payload is encoded on the calling thread, and the
+* pool is never started in this process.
+*********************************************************************/
+
+void encodeSerially(void)
+{
+    serialOnly = 1;
+}
+
+/*********************************************************************
+** encodeParallel()
+* Same as encodeChecked() (or encodeBytes() for OTP_ALPHABET_BYTES),
+* but a payload of OTP_PARALLEL_MIN bytes or more is encoded by the
+* whole pool while the caller helps. Smaller payloads, and any that
+* arrive while the pool is busy with another message, are encoded on
+* the calling thread, as is everything after encodeSerially(). The
+* output is the same
+* either way. Returns how many characters were encoded: len if all were
+* valid, otherwise the position of the first bad one.
+*********************************************************************/
+
+size_t encodeParallel(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction, int alphabet)
+{
+    if (len < OTP_PARALLEL_MIN || serialOnly)
+    {
+        return encodeAs(plaintext, key, encryptedText, len, direction, alphabet);
+    }
+    pthread_once(&poolOnce, startPool);
+    if (pool.threads == 1 || pthread_mutex_trylock(&pool.submit) != 0)
+    {
+        return encodeAs(plaintext, key, encryptedText, len, direction, alphabet);
+    }
+
+    // Deal the blocks out evenly, one slice per participant
+    size_t blocks = (len + OTP_PARALLEL_BLOCK - 1) / OTP_PARALLEL_BLOCK;
+    pthread_mutex_lock(&pool.lock);
+    pool.plaintext = plaintext;
+    pool.key = key;
+    pool.encryptedText = encryptedText;
+    pool.len = len;
+    pool.direction = direction;
+    pool.alphabet = alphabet;
+    pool.firstBad = len;
+    int i;
+    for (i = 0; i < pool.threads; i++)
+    {
+        pool.slices[i].next = blocks * i / pool.threads;
+        pool.slices[i].end = blocks * (i + 1) / pool.threads;
+    }
+    pool.generation++;
+    pool.open = 1;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    runSlices(0);
+
+    // Every block has been taken; wait for the helpers still encoding one.
+    // Helpers that didn't wake up in time stay out of this message.
+    pthread_mutex_lock(&pool.lock);
+    pool.open = 0;
+    while (pool.busy > 0)
+    {
+        pthread_cond_wait(&pool.finished, &pool.lock);
+    }
+    size_t result = pool.firstBad;
+    pthread_mutex_unlock(&pool.lock);
+    pthread_mutex_unlock(&pool.submit);
+    return result;
+}
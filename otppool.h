@@ -0,0 +1,20 @@
+/*********************************************************************
+** otppool.h
+** Description: Function prototypes for the daemon's parallel encoder.
+* Large payloads are cut into cache-sized blocks and encoded by a pool
+* of threads, every core working on the same message.
+*********************************************************************/
+
+#ifndef OTPPOOL_H
+#define OTPPOOL_H
+
+#include <stddef.h>
+
+#define OTP_PARALLEL_MIN (1024 * 1024) // smaller payloads are encoded on one thread (OTP_CHUNK_SIZE frames included)
+#define OTP_PARALLEL_BLOCK 65536 // bytes per block, plaintext + key + output fit in L2
+#define OTP_MAX_ENCODE_THREADS 64 // most threads one encode is split across
+
+void encodeSerially(void);
+size_t encodeParallel(const char* plaintext, const char* key, char* encryptedText, size_t len, int direction, int alphabet);
+
+#endif
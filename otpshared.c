@@ -1,7 +1,12 @@
 /*********************************************************************
 ** otpshared.c
 ** Description: Shared functions between one time pad programs and
-* daemon programs.
+* daemon programs: file handling (including mapping input files so
+* they can be sent in place), validation, and the framed transport
+* described in otpshared.h. Sends go out with one sendmsg() per frame;
+* receives go through a reader that pulls as much as the socket buffer
+* holds per recv() and an incremental parser that hands frames out in
+* place.
 *********************************************************************/
 
 #include <string.h>
@@ -12,12 +17,92 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h> 
-#include <sys/ioctl.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
 #include "otpshared.h"
+#include "otpcipher.h"
+#include "otpbuf.h"
 
 void error(const char *msg) { perror(msg); exit(0); } // Error function used for reporting issues
 
+/********************************************************************* 
+** resolveDaemon()
+* Works out the address of a one time pad daemon. A port with a '/' in
+* it is the path of the daemon's Unix domain socket (see -u), which
+* skips the host lookup and the TCP stack altogether; anything else is
+* a TCP port on host. Returns 0 with the address in addr, or -1 on
+* failure (with the reason printed).
+*********************************************************************/
+
+int resolveDaemon(const char* host, const char* port, struct sockaddr_storage* addr, socklen_t* addrLen)
+{
+    memset(addr, 0, sizeof(*addr));
+    if (strchr(port, '/') != NULL)
+    {
+        struct sockaddr_un* unixAddress = (struct sockaddr_un*)addr;
+        unixAddress->sun_family = AF_UNIX;
+        if (strlen(port) >= sizeof(unixAddress->sun_path))
+        {
+            fprintf(stderr, "CLIENT: ERROR, socket path too long\n");
+            return -1;
+        }
+        strcpy(unixAddress->sun_path, port);
+        *addrLen = sizeof(*unixAddress);
+        return 0;
+    }
+
+    struct sockaddr_in* serverAddress = (struct sockaddr_in*)addr;
+    struct hostent* serverHostInfo;
+    // Set up the server address struct
+    serverAddress->sin_family = AF_INET; // Create a network-capable socket
+    serverAddress->sin_port = htons(atoi(port)); // Store the port number
+    serverHostInfo = gethostbyname(host); // Convert the machine name into a special form of address
+    if (serverHostInfo == NULL) { fprintf(stderr, "CLIENT: ERROR, no such host\n"); return -1; }
+    memcpy((char*)&serverAddress->sin_addr.s_addr, (char*)serverHostInfo->h_addr, serverHostInfo->h_length); // Copy in the address
+    *addrLen = sizeof(*serverAddress);
+    return 0;
+}
+
+/********************************************************************* 
+** connectDaemon()
+* Connects to a one time pad daemon, at the address resolveDaemon()
+* works out from host and port. Returns the connected socket, or -1 on
+* failure (with the reason printed).
+*********************************************************************/
+
+int connectDaemon(const char* host, const char* port)
+{
+    struct sockaddr_storage address;
+    socklen_t addressLen;
+    if (resolveDaemon(host, port, &address, &addressLen) < 0)
+    {
+        return -1;
+    }
+
+    // Set up the socket and connect to the server
+    int socketFD = socket(address.ss_family, SOCK_STREAM, 0);
+    if (socketFD < 0) { perror("CLIENT: ERROR opening socket"); return -1; }
+    if (connect(socketFD, (struct sockaddr*)&address, addressLen) < 0)
+    {
+        perror("CLIENT: ERROR connecting");
+        close(socketFD);
+        return -1;
+    }
+    if (address.ss_family == AF_INET)
+    {
+        // Frames go out in small pieces, don't let Nagle hold them back
+        int noDelay = 1;
+        setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    }
+    return socketFD;
+}
+
 /********************************************************************* 
 ** validateStr()
 * Given a string, iterates through the string to ensure the characters
@@ -27,206 +112,797 @@ void error(const char *msg) { perror(msg); exit(0); } // Error function used for
 
 int validateStr(char* str)
 {
-    int strLength = strlen(str);
-    int i;
-    for (i = 0; i < strLength; i++)
+    return validateLen(str, strlen(str));
+}
+
+/********************************************************************* 
+** validateLen()
+* Same as validateStr(), but checks exactly len characters instead of
+* stopping at a null terminator. The check is done by scanText() (see
+* otpcipher.c), a vector at a time.
+*********************************************************************/
+
+int validateLen(const char* str, size_t len)
+{
+    uint64_t contentLen;
+    // A newline is not a valid character either, so the contents must run to len
+    return scanText(str, len, &contentLen) && contentLen == len;
+}
+
+/********************************************************************* 
+** processFile()
+* Given a valid file pointer, uses fstat() to get the length of the
+* file and malloc a buffer large enough to fit the contents of the file
+* plus a terminator, reads it in and cuts it at the first newline.
+* Returns a pointer to the buffer, or NULL if it could not be read.
+* Memory allocated here should be freed in main.
+*********************************************************************/
+
+char* processFile(FILE* fp)
+{   
+    struct stat st;
+    int fd = fileno(fp);
+    if (fstat(fd, &st) < 0)
+    {
+        fclose(fp);
+        return NULL;
+    }
+    // make a buffer big enough for the file, no need to clear it first
+    char* strbuffer = malloc(st.st_size + 1);
+    size_t length = 0;
+    while (strbuffer != NULL && length < (size_t)st.st_size)
+    {
+        ssize_t n = read(fd, strbuffer + length, st.st_size - length);
+        if (n <= 0)
+        {
+            break;
+        }
+        length += n;
+    }
+    fclose(fp);
+    if (strbuffer == NULL)
+    {
+        return NULL;
+    }
+    // strip off newlines
+    char* newline = memchr(strbuffer, '\n', length);
+    strbuffer[newline ? (size_t)(newline - strbuffer) : length] = '\0';
+    return strbuffer;
+}
+
+/********************************************************************* 
+** mapInput()
+* Maps the file at path read-only, so it can be sent straight from the
+* page cache without being copied. Pipes and other files that can't be
+* mapped are read into memory instead. Returns 0 on success, -1 if the
+* file can't be opened or read.
+*********************************************************************/
+
+static int mapInput(const char* path, struct otpMapping* map)
+{
+    memset(map, 0, sizeof(*map));
+    map->data = "";
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    if (S_ISREG(st.st_mode))
     {
-        // Searching for characters by ASCII range
-        if (str[i] < 'A' || str[i] > 'Z')
+        if (st.st_size > 0)
         {
-            // if the char is space, go on
-            if (str[i] == 32)
+            void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED)
+            {
+                close(fd);
+                return -1;
+            }
+            // Read ahead aggressively, every page is touched once in order
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            map->data = data;
+            map->mapSize = st.st_size;
+            map->mapped = 1;
+        }
+    }
+    else
+    {
+        // Not mappable, read the whole thing into memory
+        size_t capacity = 0, length = 0;
+        char* buffer = NULL;
+        while (1)
+        {
+            if (length == capacity)
+            {
+                capacity = capacity ? capacity * 2 : OTP_CHUNK_SIZE;
+                char* grown = realloc(buffer, capacity);
+                if (grown == NULL)
+                {
+                    free(buffer);
+                    close(fd);
+                    return -1;
+                }
+                buffer = grown;
+            }
+            ssize_t n = read(fd, buffer + length, capacity - length);
+            if (n < 0 && errno == EINTR)
             {
                 continue;
             }
-            else 
+            if (n < 0)
             {
-                return 0;
+                free(buffer);
+                close(fd);
+                return -1;
+            }
+            if (n == 0)
+            {
+                break;
             }
+            length += n;
         }
+        map->data = buffer ? buffer : "";
+        map->mapSize = length;
     }
-    return 1;
+    close(fd);
+    return 0;
 }
 
 /********************************************************************* 
-** processFile()
-* Given a valid file pointer, uses fseek() and ftell()
-* to get the length of the file and malloc a buffer large enough to fit
-* the contents of the file. Returns a pointer to the buffer.
-* Memory allocated here should be freed in main.
+** mapFile()
+* Maps the file at path (see mapInput()), then finds the length of its
+* contents (up to the first newline) and validates them in one
+* scanText() pass. Returns 0 on success, -1 if the file can't be
+* opened or read. Release the mapping with unmapFile().
 *********************************************************************/
 
-char* processFile(FILE* fp)
-{   
-    // go to the end of the file and count how many bytes from the beginning
-    fseek(fp, 0, SEEK_END);
-    int length = ftell(fp);
-    // make a buffer big enough for the file
-    char* strbuffer;
-    strbuffer = malloc(length * sizeof(char));
-    memset(strbuffer, '\0', length);
-    // go to the beginning of the file and read the file into the buffer
+int mapFile(const char* path, struct otpMapping* map)
+{
+    if (mapInput(path, map) < 0)
+    {
+        return -1;
+    }
+    map->valid = scanText(map->data, map->mapSize, &map->len);
+    return 0;
+}
+
+/********************************************************************* 
+** mapBinary()
+* Same as mapFile() for binary input: the contents are every byte of
+* the file, newlines included, and are always valid.
+*********************************************************************/
+
+int mapBinary(const char* path, struct otpMapping* map)
+{
+    if (mapInput(path, map) < 0)
+    {
+        return -1;
+    }
+    map->len = map->mapSize;
+    map->valid = 1;
+    return 0;
+}
+
+/********************************************************************* 
+** unmapFile()
+* Releases a file opened with mapFile().
+*********************************************************************/
+
+void unmapFile(struct otpMapping* map)
+{
+    if (map->mapped)
+    {
+        munmap((void*)map->data, map->mapSize);
+    }
+    else if (map->mapSize > 0)
+    {
+        free((void*)map->data);
+    }
+    map->data = "";
+    map->mapSize = 0;
+    map->len = 0;
+    map->mapped = 0;
+    map->valid = 0;
+}
+
+/********************************************************************* 
+** scanFile()
+* Given a valid file pointer, reads the file a few KB at a time
+* to find how long its contents are (up to the first newline) and to
+* check every character with validateLen(). Stores the length in
+* contentLen and rewinds the file so it can be streamed afterwards.
+* Returns 0 if the file has an invalid character, 1 otherwise. Unlike
+* processFile(), memory use does not depend on the size of the file.
+*********************************************************************/
+
+int scanFile(FILE* fp, uint64_t* contentLen)
+{
+    char chunk[4096];
+    uint64_t length = 0;
+    size_t n;
+    int valid = 1;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+    {
+        // stop at the first newline, like processFile()
+        uint64_t used;
+        if (!scanText(chunk, n, &used))
+        {
+            valid = 0;
+            break;
+        }
+        length += used;
+        if (used < n)
+        {
+            break;
+        }
+    }
+    *contentLen = length;
     fseek(fp, 0, SEEK_SET);
-    fread(strbuffer, 1, length, fp);
-    fclose(fp);
-    // strip off newlines
-    strbuffer[strcspn(strbuffer, "\n")] = '\0';
-    return strbuffer;
+    return valid;
+}
+
+// Where this thread's frames go instead of the socket, see captureSends()
+static __thread struct otpOutput* capturing = NULL;
+
+/********************************************************************* 
+** captureSends() / sendsCaptured()
+* From now on, frames this thread sends are appended to out instead of
+* being written, so a caller driving its own I/O (the io_uring backend)
+* can write every reply a batch of frames produced with one submission.
+* out grows through the buffer pool as needed. NULL goes back to
+* writing straight to the socket. sendsCaptured() tells whether this
+* thread's frames are being captured.
+*********************************************************************/
+
+void captureSends(struct otpOutput* out)
+{
+    capturing = out;
+}
+
+int sendsCaptured(void)
+{
+    return capturing != NULL;
+}
+
+/********************************************************************* 
+** captureVec()
+* Appends the buffers to the output being captured.
+* Returns 0 on success, -1 if memory runs out.
+*********************************************************************/
+
+static int captureVec(struct otpOutput* out, const struct iovec* iov, int iovcnt)
+{
+    size_t total = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++)
+    {
+        total += iov[i].iov_len;
+    }
+    if (out->len + total > out->capacity)
+    {
+        size_t capacity;
+        char* grown = getBuffer(out->len + total, &capacity);
+        if (grown == NULL)
+        {
+            perror("CAPTURE: malloc");
+            return -1;
+        }
+        memcpy(grown, out->data, out->len);
+        if (!out->borrowed)
+        {
+            putBuffer(out->data, out->capacity);
+        }
+        out->data = grown;
+        out->capacity = capacity;
+        out->borrowed = 0;
+    }
+    for (i = 0; i < iovcnt; i++)
+    {
+        memcpy(out->data + out->len, iov[i].iov_base, iov[i].iov_len);
+        out->len += iov[i].iov_len;
+    }
+    return 0;
 }
 
 /********************************************************************* 
-** sendMsg(): Given a buffer and a valid socket file descriptor,
-* sendMsg() ensures all data in the buffer is sent through the socket.
-* Ensures all data is sent before proceeding by using ioctl.
+** sendVec(): Given an array of buffers and a valid socket file
+* descriptor, sends all of them in order with as few sendmsg() calls
+* as the kernel allows, so a frame header and its body segments leave
+* in one system call. Partial sends resume where they stopped.
+* The iovec array is modified as data goes out. While the thread is
+* capturing (see captureSends()) the buffers are copied out instead.
+* Returns 0 on success, -1 if the socket failed. Errors are reported
+* but not fatal, since the daemon may be serving other connections.
 *********************************************************************/
 
-void sendMsg(char* buffer, int socketFD)
+int sendVec(int socketFD, struct iovec* iov, int iovcnt)
 {
-    // current iteration of send()
-    int charsSent = 0;
-    // total count of chars that have gone through send()
-    int totalCharsSent = 0;
-    // max data to send per send call
-    int maxSendBytes = 1000;
-    // remaining data to send
-    int remainingBytes = strlen(buffer);
-    // bytesToSend = full amount of data
-    int bytesToSend = remainingBytes;
-    // update maxSendBytes to bytesToSend when it below 1000
-    if (bytesToSend < maxSendBytes)
+    struct msghdr msg;
+    if (capturing != NULL)
     {
-        maxSendBytes = bytesToSend;
+        return captureVec(capturing, iov, iovcnt);
     }
-    
-    // Save buffer pointer so that send can resume printing to the
-    // right place if interrupted
-    char* ptr = buffer;
-    while (totalCharsSent < bytesToSend)
+    memset(&msg, 0, sizeof(msg));
+    while (iovcnt > 0)
     {
-        charsSent = send(socketFD, ptr, maxSendBytes, 0);
-        // Error handling
+        // Skip buffers that are empty or already sent
+        if (iov->iov_len == 0)
+        {
+            iov++;
+            iovcnt--;
+            continue;
+        }
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t charsSent = sendmsg(socketFD, &msg, MSG_NOSIGNAL);
         if (charsSent < 0)
         {
-            error("ERROR writing to socket");
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // Non-blocking socket with a full send queue, wait for room,
+                // but not forever on a peer that stopped reading
+                struct pollfd pfd = { socketFD, POLLOUT, 0 };
+                if (poll(&pfd, 1, OTP_IO_TIMEOUT_MS) == 0)
+                {
+                    fprintf(stderr, "SENDVEC: timed out waiting for peer\n");
+                    return -1;
+                }
+                continue;
+            }
+            perror("ERROR writing to socket");
+            return -1;
         }
-        else if (charsSent == 0)
+        // Step past everything that went out
+        size_t done = charsSent;
+        while (iovcnt > 0 && done >= iov->iov_len)
         {
-            error("Unexpected EOF");
+            done -= iov->iov_len;
+            iov++;
+            iovcnt--;
         }
-        // Update total and ptr as needed
-        else
+        if (iovcnt > 0)
         {
-            totalCharsSent += charsSent;
-            ptr += charsSent;
+            iov->iov_base = (char*)iov->iov_base + done;
+            iov->iov_len -= done;
         }
-    	// Update maxSendBytes as needed so that erroneous data is not sent
-    	remainingBytes = bytesToSend - totalCharsSent;
-    	if (remainingBytes < maxSendBytes && totalCharsSent < bytesToSend)
-    	{
-    	    maxSendBytes = remainingBytes;
-    	}
     }
-    // verified sending
-    int checkSend = -5;  // Holds amount of bytes remaining in send buffer
-	do
-	{
-		ioctl(socketFD, TIOCOUTQ, &checkSend);  // Check the send buffer for this socket
-	}
-	while (checkSend > 0);  // Loop forever until send buffer for this socket is empty
-	if (checkSend < 0)
-	{
-	    error("ioctl error");
-	}
+    return 0;
 }
 
 /********************************************************************* 
-** recMsg(): Given a buffer and a valid socket file descriptor, and
-* a message size, receives a specific amount of data and places it in
-* the buffer. Very similar to sendMsg, but calls recv() until
-* an end code is found in the buffer. Ideally, the function
-* should "time out" after enough calls to recv and no end code is found,
-* since it will block indefinitely on bad messages.
+** initReader() / freeReader()
+* A reader buffers input from one socket so that small frames (headers,
+* ACKs, short messages) are pulled out of the kernel many at a time
+* instead of with one recv() per field. The buffer starts at the size
+* of the socket's receive buffer, which is the most one recv() can
+* return, and grows to hold the largest frame seen so far, so every
+* frame can be handed out in place. Buffers come from the buffer pool
+* (see otpbuf.c), so a new connection picks up one an old connection
+* left behind instead of faulting in fresh memory. A caller may lend
+* the reader a buffer of its own (setting borrowed) and feed it input
+* itself (setting external); the reader then only parses, and once a
+* frame outgrows the lent buffer moves on to a pooled one.
 *********************************************************************/
 
-void recMsg(char* buffer, int bytesToReceive, int socketFD)
+int initReader(struct otpReader* reader, int socketFD)
 {
-    // bytes rec'd from current iteration of recv
-    int charsRec = 0;
-    // total bytes received across all iterations
-    int totalCharsRec = 0;
-    // max data to receive at a time
-    int maxRecBytes = 1000;
-   
-    if (bytesToReceive < maxRecBytes)
+    int rcvbuf = 0;
+    socklen_t optlen = sizeof(rcvbuf);
+    if (getsockopt(socketFD, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen) < 0 || rcvbuf < OTP_MIN_READ_BUFFER)
     {
-        maxRecBytes = bytesToReceive;
+        rcvbuf = OTP_MIN_READ_BUFFER;
     }
-    
-    char* ptr = buffer;
-    while (totalCharsRec < bytesToReceive && strstr(buffer, "@END@") == NULL)
+    reader->socketFD = socketFD;
+    reader->start = 0;
+    reader->end = 0;
+    reader->eof = 0;
+    reader->external = 0;
+    reader->borrowed = 0;
+    initParser(&reader->parser);
+    reader->buffer = getBuffer(rcvbuf, &reader->capacity);
+    if (reader->buffer == NULL)
     {
-        charsRec = recv(socketFD, ptr, maxRecBytes, 0);
-        if (charsRec < 0)
+        perror("INITREADER: malloc");
+        return -1;
+    }
+    return 0;
+}
+
+void freeReader(struct otpReader* reader)
+{
+    if (!reader->borrowed)
+    {
+        putBuffer(reader->buffer, reader->capacity);
+    }
+    reader->buffer = NULL;
+}
+
+/********************************************************************* 
+** initParser() / parseFrame()
+* An incremental frame parser. parseFrame() is given the bytes that
+* have arrived so far, starting at a frame boundary. Once the header
+* is complete it is decoded and checked exactly once; the parser keeps
+* the result, so calls made as more bytes trickle in only compare
+* lengths and never look at old bytes again.
+* Returns 1 when a whole frame is available: frame is filled in, *body
+* points at its body inside data (plaintext segment first, the key
+* segment len0 bytes later) and *used is the frame's total size.
+* Returns 0 if more bytes are needed; parser->need then says how many
+* bytes the frame occupies in total so the caller can make room.
+* Returns -1 on a malformed header or a body over OTP_MAX_FRAME_BODY.
+*********************************************************************/
+
+void initParser(struct otpParser* parser)
+{
+    parser->frameSize = 0;
+    parser->need = OTP_HEADER_SIZE;
+}
+
+int parseFrame(struct otpParser* parser, const char* data, size_t len, struct otpFrame* frame, const char** body, size_t* used)
+{
+    if (parser->frameSize == 0)
+    {
+        if (len < OTP_HEADER_SIZE)
         {
-            error("ERROR receiving from socket");
+            parser->need = OTP_HEADER_SIZE;
+            return 0;
         }
-        
-        else if (charsRec == 0)
+        if (unpackFrame((const unsigned char*)data, &parser->frame) < 0)
         {
-            error("RECMSG: Unexpected EOF");
+            fprintf(stderr, "PARSEFRAME: bad frame header\n");
+            return -1;
         }
-        else 
+        if (parser->frame.len0 > OTP_MAX_FRAME_BODY || parser->frame.len1 > OTP_MAX_FRAME_BODY - parser->frame.len0)
         {
-            totalCharsRec += charsRec;
-            ptr += charsRec;
+            fprintf(stderr, "PARSEFRAME: frame body too large\n");
+            return -1;
         }
-        
-    	int remainingBytes = bytesToReceive - totalCharsRec;
-    	if (remainingBytes < maxRecBytes && totalCharsRec < bytesToReceive)
-    	{
-    	    maxRecBytes = remainingBytes;
-    	}
-    	
+        parser->frameSize = OTP_HEADER_SIZE + parser->frame.len0 + parser->frame.len1;
+    }
+    if (len < parser->frameSize)
+    {
+        parser->need = parser->frameSize;
+        return 0;
     }
+    *frame = parser->frame;
+    *body = data + OTP_HEADER_SIZE;
+    *used = parser->frameSize;
+    initParser(parser);
+    return 1;
+}
+
+/********************************************************************* 
+** put32() / put64() / get32() / get64()
+* Store or load a big-endian (network order) integer at a byte pointer
+* of any alignment.
+*********************************************************************/
+
+void put32(unsigned char* out, uint32_t v)
+{
+    out[0] = v >> 24; out[1] = v >> 16; out[2] = v >> 8; out[3] = v;
+}
+
+void put64(unsigned char* out, uint64_t v)
+{
+    put32(out, v >> 32);
+    put32(out + 4, (uint32_t)v);
+}
+
+uint32_t get32(const unsigned char* in)
+{
+    return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) | in[3];
+}
+
+uint64_t get64(const unsigned char* in)
+{
+    return ((uint64_t)get32(in) << 32) | get32(in + 4);
+}
+
+/********************************************************************* 
+** packFrame() / unpackFrame()
+* Convert a frame header between struct otpFrame and its
+* OTP_HEADER_SIZE byte big-endian wire form (layout in otpshared.h).
+* unpackFrame() returns -1 if the magic number or version is wrong.
+*********************************************************************/
+
+void packFrame(const struct otpFrame* frame, unsigned char* out)
+{
+    put32(out, OTP_MAGIC);
+    out[4] = frame->version;
+    out[5] = frame->type;
+    out[6] = frame->flags >> 8;
+    out[7] = frame->flags;
+    put32(out + 8, frame->requestId);
+    put32(out + 12, frame->padId);
+    put64(out + 16, frame->offset);
+    put64(out + 24, frame->len0);
+    put64(out + 32, frame->len1);
+}
+
+int unpackFrame(const unsigned char* in, struct otpFrame* frame)
+{
+    if (get32(in) != OTP_MAGIC || in[4] != OTP_VERSION)
+    {
+        return -1;
+    }
+    frame->version = in[4];
+    frame->type = in[5];
+    frame->flags = (in[6] << 8) | in[7];
+    frame->requestId = get32(in + 8);
+    frame->padId = get32(in + 12);
+    frame->offset = get64(in + 16);
+    frame->len0 = get64(in + 24);
+    frame->len1 = get64(in + 32);
+    return 0;
+}
+
+/********************************************************************* 
+** sendFrame()
+* Sends one frame: a header of the given type, request id and offset,
+* followed by the two body segments (either may be NULL with a length
+* of 0).
+* Returns 0 on success, -1 if the socket failed.
+*********************************************************************/
+
+int sendFrame(int socketFD, int type, uint32_t requestId, uint64_t offset, const char* seg0, uint64_t len0, const char* seg1, uint64_t len1)
+{
+    struct otpFrame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.type = type;
+    frame.requestId = requestId;
+    frame.offset = offset;
+    frame.len0 = len0;
+    frame.len1 = len1;
+    return sendFramed(socketFD, &frame, seg0, seg1);
+}
+
+/********************************************************************* 
+** sendFramed()
+* Like sendFrame(), but every header field comes from the caller's
+* frame (flags, padId and so on); the version is filled in here. The
+* header and segments go out together through sendVec(), straight
+* from the caller's buffers.
+* Returns 0 on success, -1 if the socket failed.
+*********************************************************************/
+
+int sendFramed(int socketFD, const struct otpFrame* frame, const char* seg0, const char* seg1)
+{
+    struct otpFrame header = *frame;
+    unsigned char packed[OTP_HEADER_SIZE];
+    struct iovec iov[3];
+    header.version = OTP_VERSION;
+    packFrame(&header, packed);
+    iov[0].iov_base = packed;
+    iov[0].iov_len = sizeof(packed);
+    iov[1].iov_base = (void*)seg0;
+    iov[1].iov_len = header.len0;
+    iov[2].iov_base = (void*)seg1;
+    iov[2].iov_len = header.len1;
+    return sendVec(socketFD, iov, 3);
+}
+
+/********************************************************************* 
+** nextFrame()
+* Gets the next frame from the reader's socket. Each recv() only
+* appends to the buffer and parseFrame() only looks at what is new, so
+* the cost is linear in the message size. On success frame is filled
+* in and *body points at the frame body inside the reader's buffer,
+* with no copy; it stays valid until the next call on this reader.
+* With block set it waits for the whole frame. Without it, it returns
+* as soon as the socket has nothing more to give, keeping the partial
+* frame for the next call; that holds on a blocking socket too. An external reader returns 0 instead of
+* reading, with room made for the rest of the frame, and -1 once the
+* caller has set eof.
+* Returns 1 when a frame is ready, 0 if none is complete yet (only
+* without block), -1 on a socket error, EOF or a malformed frame. EOF
+* between frames is how a peer closes normally: reader->eof is set
+* and nothing is printed.
+*********************************************************************/
+
+int nextFrame(struct otpReader* reader, struct otpFrame* frame, const char** body, int block)
+{
+    while (1)
+    {
+        size_t used;
+        int parsed = parseFrame(&reader->parser, reader->buffer + reader->start, reader->end - reader->start, frame, body, &used);
+        if (parsed < 0)
+        {
+            return -1;
+        }
+        if (parsed == 1)
+        {
+            reader->start += used;
+            return 1;
+        }
+        // Everything handed out already, start filling from the front
+        if (reader->start == reader->end)
+        {
+            reader->start = 0;
+            reader->end = 0;
+        }
+        // Make room for the rest of the frame: move the partial frame to
+        // the front, growing the buffer if the frame is larger than it
+        if (reader->start + reader->parser.need > reader->capacity)
+        {
+            size_t partial = reader->end - reader->start;
+            if (reader->parser.need > reader->capacity)
+            {
+                size_t capacity;
+                char* grown = getBuffer(reader->parser.need, &capacity);
+                if (grown == NULL)
+                {
+                    perror("NEXTFRAME: malloc");
+                    return -1;
+                }
+                memcpy(grown, reader->buffer + reader->start, partial);
+                if (!reader->borrowed)
+                {
+                    putBuffer(reader->buffer, reader->capacity);
+                }
+                reader->buffer = grown;
+                reader->capacity = capacity;
+                reader->borrowed = 0;
+            }
+            else
+            {
+                memmove(reader->buffer, reader->buffer + reader->start, partial);
+            }
+            reader->start = 0;
+            reader->end = partial;
+        }
+        if (reader->external)
+        {
+            // The caller reads into buffer + end once this returns
+            if (!reader->eof)
+            {
+                return 0;
+            }
+            if (reader->end != reader->start)
+            {
+                fprintf(stderr, "NEXTFRAME: Unexpected EOF\n");
+            }
+            return -1;
+        }
+        ssize_t charsRec = recv(reader->socketFD, reader->buffer + reader->end, reader->capacity - reader->end, block ? 0 : MSG_DONTWAIT);
+        if (charsRec < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if (!block)
+                {
+                    return 0;
+                }
+                struct pollfd pfd = { reader->socketFD, POLLIN, 0 };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            perror("ERROR receiving from socket");
+            return -1;
+        }
+        else if (charsRec == 0)
+        {
+            reader->eof = 1;
+            if (reader->end != reader->start)
+            {
+                fprintf(stderr, "NEXTFRAME: Unexpected EOF\n");
+            }
+            return -1;
+        }
+        reader->end += charsRec;
+    }
+}
+
+/********************************************************************* 
+** recvFrame()
+* Waits for the next frame with nextFrame(). Returns 0 on success, -1
+* on a socket error, EOF or a malformed frame.
+*********************************************************************/
+
+int recvFrame(struct otpReader* reader, struct otpFrame* frame, const char** body)
+{
+    return (nextFrame(reader, frame, body, 1) == 1) ? 0 : -1;
 }
 
 /********************************************************************* 
 ** getAck()
-* Given a valid socket file descriptor, waits for an acknowledgement statement.
+* Given a reader on a valid socket, waits for an ACK frame.
 * Typically used to ensure the other side is ready to continue, otherwise
 * send() and recv() calls may fall out of synchronization.
-* Waits two seconds for an ack, otherwise it returns 0 and the programs
-* using getAck() time out.
+* Waits at most timeoutMs milliseconds for the whole frame, not just
+* its first byte, so a server that stalls halfway through one can't
+* hang the caller. Returns 0 if it times out, and the programs using
+* getAck() give up. If the server
+* sends an ERROR frame instead, its message is printed and 0 is returned.
+* The ACK's offset field (where a pad reservation starts) is stored in
+* ackOffset when it is not NULL. If the server is too busy to take the
+* request, -1 is returned with the milliseconds to wait before trying
+* again stored in ackOffset.
 *********************************************************************/
 
-int getAck(int socketFD)
+int getAck(struct otpReader* reader, int timeoutMs, uint64_t* ackOffset)
 {
-	char ack[3];
-	memset(ack, '\0', sizeof(ack));
-	
-	int seconds = 0;
-	while ((strstr(ack, "ACK")) == NULL)
+	struct otpFrame frame;
+	const char* body;
+	int acked = 0;
+	struct pollfd pfd;
+	pfd.fd = reader->socketFD;
+	pfd.events = POLLIN;
+	struct timespec now, deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeoutMs / 1000;
+	deadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000;
+
+	// Take in whatever has arrived, and wait for more only until the deadline
+	int got;
+	while ((got = nextFrame(reader, &frame, &body, 0)) == 0)
 	{
-	    sleep(1);
-	    recv(socketFD, ack, sizeof(ack) + 1, 0);
-	    seconds++;
-	    if (seconds > 2)
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    long remaining = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+	    if (remaining <= 0 || poll(&pfd, 1, remaining) == 0)
 	    {
+	        fprintf(stderr, "GETACK: timed out waiting for server\n");
 	        return 0;
 	    }
 	}
-	return 1;
+	if (got == 1)
+	{
+	    if (frame.type == OTP_FRAME_ACK)
+	    {
+	        acked = 1;
+	        if (ackOffset != NULL)
+	        {
+	            *ackOffset = frame.offset;
+	        }
+	    }
+	    else if (frame.type == OTP_FRAME_BUSY)
+	    {
+	        acked = -1;
+	        if (ackOffset != NULL)
+	        {
+	            *ackOffset = frame.offset;
+	        }
+	    }
+	    else if (frame.type == OTP_FRAME_ERROR)
+	    {
+	        fprintf(stderr, "%.*s\n", (int)frame.len0, body);
+	    }
+	}
+	return acked;
 }
 
 /********************************************************************* 
 ** sendAck()
-* Counterpart to getAck(). Used to send an acknowledgement statement
-* to tell the other side that it is ready to receive or send more data.
+* Counterpart to getAck(). Used to send an ACK frame to tell the other
+* side that it is ready to receive or send more data. offset is passed
+* back through getAck() (0 unless a pad range was reserved).
+*********************************************************************/
+
+void sendAck(int socketFD, uint32_t requestId, uint64_t offset)
+{
+	sendFrame(socketFD, OTP_FRAME_ACK, requestId, offset, NULL, 0, NULL, 0);
+}
+
+/********************************************************************* 
+** sendError()
+* Sends an ERROR frame carrying msg, so the other side can report why
+* its request was refused instead of just seeing the socket close.
+* requestId says which request failed.
 *********************************************************************/
 
-void sendAck(int socketFD)
+void sendError(int socketFD, uint32_t requestId, const char* msg)
 {
-    char ack[] = "ACK";
-	send(socketFD, ack, sizeof(ack), 0);
-	fflush(stdout);
-}
\ No newline at end of file
+	sendFrame(socketFD, OTP_FRAME_ERROR, requestId, 0, msg, strlen(msg), NULL, 0);
+}
@@ -1,25 +1,198 @@
 /*********************************************************************
 ** otpshared.h
 ** Description: Function prototypes for one time pad programs and daemons.
+* Also describes the binary frame format used between otp_enc and
+* otp_enc_d.
 *********************************************************************/
 
+#ifndef OTPSHARED_H
+#define OTPSHARED_H
+
 #include <string.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <netdb.h> 
-#include <sys/ioctl.h>
+#include <netdb.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 
 #define CHARS "ABCDEFGHIJKLMNOPQRSTUVWXYZ "
-#define MAX_MSG_SIZE 150000
 
+// Marks what libotp.a exports; everything is built hidden and the
+// library keeps only these global (see the Makefile). The helpers
+// behind them are only declared for the repo's own build (OTP_BUILD),
+// so a program embedding the library never sees their names.
+#define OTP_API __attribute__((visibility("default")))
+
+/* Frame format. Every transmission is a fixed 40 byte header followed by
+   a body of len0 + len1 bytes. All header fields are big-endian.
+
+     0  magic      4  "OTPF"
+     4  version    1  OTP_VERSION
+     5  type       1  OTP_FRAME_*
+     6  flags      2  OTP_FLAG_*
+     8  requestId  4  request this frame belongs to
+    12  padId      4  pad to take the key from when OTP_FLAG_PAD is set
+    16  offset     8  position of this segment within the message
+    24  len0       8  length of the first body segment
+    32  len1       8  length of the second body segment
+
+   A message is HELLO (body: auth code, offset: total message length),
+   answered by ACK or ERROR, then any number of DATA frames (body:
+   plaintext segment of len0 bytes followed by key segment of len1
+   bytes), each answered with a RESULT frame (body: len0 bytes of
+   ciphertext), then END from the client, echoed back by the server.
+   The client does not wait for the ACK before sending its first DATA
+   frame; a server that rejects the auth code answers ERROR instead of
+   ACK and closes the connection. A DATA frame with a character outside
+   CHARS in its plaintext or key is answered by ERROR, which ends the
+   message.
+   A daemon that already has as much work admitted as it allows
+   answers HELLO with BUSY instead (offset: milliseconds to wait before
+   trying again). The request is never opened, so its DATA and END
+   frames are dropped, and the connection stays open for a retry.
+   With OTP_FLAG_PAD set, HELLO names a pad held by the daemon and its
+   body carries a second segment of OTP_PAD_OFFSET_SIZE bytes, a
+   big-endian offset into the pad. DATA frames then carry no key
+   segment. otp_enc_d ignores the offset and reserves a fresh range;
+   otp_dec_d decrypts with the key starting there. Either way the ACK's
+   offset is where the message's key starts in the pad.
+   A client streaming input of unknown size sends OTP_LEN_UNKNOWN as
+   the message length and the message ends wherever END says. Pad
+   messages must give their length.
+   With OTP_FLAG_SHM set, HELLO's second body segment is instead the
+   name of a shared memory ring the client made (see otpshm.h). Once it
+   is acknowledged, text and key go through the ring and the socket
+   only tells each side when the other hangs up.
+   With OTP_FLAG_PACKED set, every DATA segment and RESULT body of the
+   request is packed five symbols to three bytes (see otppack.h).
+   Offsets and the message length still count symbols, not bytes.
+   With OTP_FLAG_BINARY set, text and key are arbitrary bytes and the
+   key is added (or subtracted) mod 256 instead of mod 27, so nothing
+   is checked against CHARS. Pads, packing and shared memory rings all
+   hold CHARS, so none of them can be combined with it.
+   The same protocol carries decryption: otp_dec talks to otp_dec_d
+   with its own auth code, sending ciphertext where otp_enc sends
+   plaintext.
+   There are no in-band delimiters, so messages can be any length and
+   are streamed through in chunks of at most OTP_MAX_FRAME_BODY bytes. */
+
+#define OTP_MAGIC 0x4F545046u
+#define OTP_VERSION 1
+#define OTP_HEADER_SIZE 40
+#define OTP_CHUNK_SIZE 262144 // plaintext bytes sent per DATA frame
+#define OTP_MAX_FRAME_BODY (16 * 1024 * 1024) // largest body a receiver accepts
+#define OTP_AUTH_SIZE 3 // length of the auth code sent in HELLO
+#define OTP_PAD_OFFSET_SIZE 8 // length of the pad offset sent in a pad HELLO
+#define OTP_ACK_TIMEOUT_MS 2000 // how long a client waits for ACK
+#define OTP_MIN_READ_BUFFER 65536 // smallest buffer a reader uses
+#define OTP_IO_TIMEOUT_MS 5000 // longest a send waits on a peer that stopped reading
+#define OTP_MAX_INFLIGHT 256 // most requests open at once on one connection
+
+#define OTP_FLAG_PAD 0x0001 // key comes from a pad held by the daemon
+#define OTP_FLAG_SHM 0x0002 // HELLO hands over a shared memory ring (see otpshm.h)
+#define OTP_FLAG_PACKED 0x0004 // the request's text travels packed (see otppack.h)
+#define OTP_FLAG_BINARY 0x0008 // the request's text and key are bytes, not CHARS
+#define OTP_LEN_UNKNOWN UINT64_MAX // HELLO length when the client is streaming
+
+#define OTP_FRAME_HELLO 1
+#define OTP_FRAME_ACK 2
+#define OTP_FRAME_DATA 3
+#define OTP_FRAME_RESULT 4
+#define OTP_FRAME_END 5
+#define OTP_FRAME_ERROR 6
+#define OTP_FRAME_BUSY 7
+
+struct otpFrame
+{
+    uint8_t type;
+    uint8_t version;
+    uint16_t flags;
+    uint32_t requestId;
+    uint32_t padId;
+    uint64_t offset;
+    uint64_t len0;
+    uint64_t len1;
+};
+
+// Incremental frame parser state, see parseFrame()
+struct otpParser
+{
+    struct otpFrame frame; // header of the frame in progress
+    size_t frameSize;      // header + body size once the header is decoded, else 0
+    size_t need;           // bytes the frame in progress occupies in total
+};
+
+// Buffered input from one socket, see initReader()
+struct otpReader
+{
+    int socketFD;
+    struct otpParser parser;
+    char* buffer;
+    size_t capacity;
+    size_t start; // next unread byte
+    size_t end;   // one past the last buffered byte
+    int eof;      // peer closed the connection
+    int external; // input is appended by the caller, nextFrame() never calls recv()
+    int borrowed; // buffer belongs to the caller, not the buffer pool
+};
+
+// Frames captured instead of sent, see captureSends()
+struct otpOutput
+{
+    char* data;
+    size_t len;      // bytes captured
+    size_t sent;     // bytes of those already written
+    size_t capacity;
+    int borrowed;    // data belongs to the caller, not the buffer pool
+};
+
+// An input file opened with mapFile(). data is mapped from the page
+// cache when the file allows it, otherwise read into memory.
+struct otpMapping
+{
+    const char* data;
+    uint64_t len;     // contents up to the first newline (all of it for mapBinary())
+    size_t mapSize;   // bytes mapped or read
+    int mapped;       // data is an mmap() rather than a malloc()
+    int valid;        // the contents are all from CHARS
+};
+
+#ifdef OTP_BUILD
 void error(const char *msg);
+int resolveDaemon(const char* host, const char* port, struct sockaddr_storage* addr, socklen_t* addrLen);
+int connectDaemon(const char* host, const char* port);
 char* processFile(FILE* fp);
+int mapFile(const char* path, struct otpMapping* map);
+int mapBinary(const char* path, struct otpMapping* map);
+void unmapFile(struct otpMapping* map);
 int validateStr(char* str);
-void sendMsg(char* buffer, int socketFD);
-void recMsg(char* buffer, int bytesToReceive, int socketFD);
-int getAck(int socketFD);
-void sendAck(int socketFD);
\ No newline at end of file
+int validateLen(const char* str, size_t len);
+int scanFile(FILE* fp, uint64_t* contentLen);
+int sendVec(int socketFD, struct iovec* iov, int iovcnt);
+void captureSends(struct otpOutput* out);
+int sendsCaptured(void);
+void put32(unsigned char* out, uint32_t v);
+void put64(unsigned char* out, uint64_t v);
+uint32_t get32(const unsigned char* in);
+uint64_t get64(const unsigned char* in);
+int initReader(struct otpReader* reader, int socketFD);
+void freeReader(struct otpReader* reader);
+void initParser(struct otpParser* parser);
+int parseFrame(struct otpParser* parser, const char* data, size_t len, struct otpFrame* frame, const char** body, size_t* used);
+void packFrame(const struct otpFrame* frame, unsigned char* out);
+int unpackFrame(const unsigned char* in, struct otpFrame* frame);
+int sendFrame(int socketFD, int type, uint32_t requestId, uint64_t offset, const char* seg0, uint64_t len0, const char* seg1, uint64_t len1);
+int sendFramed(int socketFD, const struct otpFrame* frame, const char* seg0, const char* seg1);
+int nextFrame(struct otpReader* reader, struct otpFrame* frame, const char** body, int block);
+int recvFrame(struct otpReader* reader, struct otpFrame* frame, const char** body);
+int getAck(struct otpReader* reader, int timeoutMs, uint64_t* ackOffset);
+void sendAck(int socketFD, uint32_t requestId, uint64_t offset);
+void sendError(int socketFD, uint32_t requestId, const char* msg);
+#endif
+
+#endif
@@ -0,0 +1,524 @@
+/*********************************************************************
+** otpshm.c
+** Description: Both ends of the shared memory transport. The ring is
+* a single-producer, single-consumer queue: the client owns the
+* submitted counter and the slots it hasn't handed over, the daemon
+* owns the done counter and the slots it has been handed. Text and key
+* are written into a slot once and the daemon encodes them in place,
+* so nothing is copied through the kernel at all.
+* Neither side makes a system call while the other keeps it busy.
+* An idle side polls the ring OTP_SHM_SPIN times (not at all on a
+* single CPU, where the other side can't run meanwhile), then flags
+* that it is waiting and sleeps on the other side's counter with
+* FUTEX_WAIT;
+* the other side only calls FUTEX_WAKE when that flag is set. The flag
+* is set before the counter is checked again, and the counter is
+* published before the flag is read, so a wakeup can't be missed.
+* Sleeps are capped at OTP_SHM_SLEEP_MS so a side that went away
+* without saying so is still noticed.
+* The ring is named by the client and unlinked as soon as the daemon
+* has mapped it, so it disappears with the last mapping. The daemon
+* only maps rings owned by the client's user, and a client that shrinks
+* its ring afterwards only loses it (see shmGuard()).
+*********************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "otpshared.h"
+#include "otpshm.h"
+
+#define SLOT_STRIDE(slotSize) ((sizeof(struct otpShmSlot) + 2 * (slotSize) + 63) & ~(size_t)63)
+#define HEADER_SIZE ((sizeof(struct otpShmHeader) + 63) & ~(size_t)63)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpuRelax() __builtin_ia32_pause()
+#else
+#define cpuRelax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+static uint32_t ringsMade = 0;
+static int spinLimit = -1; // OTP_SHM_SPIN, or 0 on a single CPU
+static pthread_once_t faultHandler = PTHREAD_ONCE_INIT;
+static __thread struct otpShmServer* guarded; // ring the calling thread serves, see shmGuard()
+
+/*********************************************************************
+** futexWait() / futexWake()
+* Sleep while *word is still val, for at most timeoutMs; wake every
+* sleeper on word. The ring is shared between processes, so these are
+* not the private futex operations.
+*********************************************************************/
+
+static void futexWait(uint32_t* word, uint32_t val, int timeoutMs)
+{
+    struct timespec ts;
+    ts.tv_sec = timeoutMs / 1000;
+    ts.tv_nsec = (long)(timeoutMs % 1000) * 1000000;
+    syscall(SYS_futex, word, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void futexWake(uint32_t* word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+/*********************************************************************
+** waitCounter()
+* Waits until *counter differs from seen, *waiting marking that this
+* side is asleep. Returns 1 once it does, 0 when the ring was closed or
+* timeoutMs (-1 for no limit) ran out, whichever came first. check, if
+* not NULL, is called between sleeps and ends the wait when it returns
+* nonzero.
+*********************************************************************/
+
+static int waitCounter(struct otpShmHeader* header, uint32_t* counter, uint32_t* waiting, uint32_t seen,
+                       int timeoutMs, int (*check)(void*), void* arg)
+{
+    int spins;
+    if (spinLimit < 0)
+    {
+        spinLimit = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? OTP_SHM_SPIN : 0;
+    }
+    for (spins = 0; spins < spinLimit; spins++)
+    {
+        if (__atomic_load_n(counter, __ATOMIC_ACQUIRE) != seen)
+        {
+            return 1;
+        }
+        if (__atomic_load_n(&header->closed, __ATOMIC_RELAXED))
+        {
+            return 0;
+        }
+        cpuRelax();
+    }
+    int waited = 0;
+    while (1)
+    {
+        __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(counter, __ATOMIC_SEQ_CST) != seen)
+        {
+            break;
+        }
+        if (__atomic_load_n(&header->closed, __ATOMIC_RELAXED) ||
+            (timeoutMs >= 0 && waited >= timeoutMs) || (check != NULL && check(arg)))
+        {
+            __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+            return 0;
+        }
+        int sleepMs = OTP_SHM_SLEEP_MS;
+        if (timeoutMs >= 0 && timeoutMs - waited < sleepMs) sleepMs = timeoutMs - waited;
+        futexWait(counter, seen, sleepMs);
+        waited += sleepMs;
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return 1;
+}
+
+/*********************************************************************
+** shmMapSize() / slotAt()
+* Size of a ring of slots slots of slotSize bytes, and where the n-th
+* submission's slot lives in it; its text follows the slot, and its
+* key follows the text. Each side uses the geometry it agreed to, never
+* what the header says now.
+*********************************************************************/
+
+static size_t shmMapSize(uint32_t slots, uint64_t slotSize)
+{
+    return HEADER_SIZE + (size_t)slots * SLOT_STRIDE(slotSize);
+}
+
+static struct otpShmSlot* slotAt(struct otpShmHeader* header, uint32_t slots, uint64_t slotSize, uint32_t seq)
+{
+    return (struct otpShmSlot*)((char*)header + HEADER_SIZE + (size_t)(seq % slots) * SLOT_STRIDE(slotSize));
+}
+
+/*********************************************************************
+** shmShutdown()
+* Marks the ring closed and wakes whichever side is asleep on it.
+*********************************************************************/
+
+void shmShutdown(struct otpShmHeader* header)
+{
+    __atomic_store_n(&header->closed, 1, __ATOMIC_SEQ_CST);
+    futexWake(&header->submitted);
+    futexWake(&header->done);
+}
+
+/*********************************************************************
+** otpShmOpen()
+* Creates a ring of slots slots that each hold slotSize bytes of text
+* and as many of key, connects to the daemon at host and port (see
+* connectDaemon(); the daemon only takes rings over its Unix socket)
+* and hands the ring over with a HELLO carrying OTP_FLAG_SHM. Returns 0 once the daemon has acknowledged it, -1 on
+* failure (with the reason printed).
+*********************************************************************/
+
+int otpShmOpen(struct otpShm* shm, const char* host, const char* port, const char* authCode, uint32_t slots, size_t slotSize)
+{
+    char name[OTP_SHM_NAME_MAX];
+    memset(shm, 0, sizeof(*shm));
+    shm->socketFD = -1;
+    if (slots < 1 || slots > OTP_SHM_MAX_SLOTS || slotSize < 1 || slotSize > OTP_SHM_MAX_SLOT_SIZE)
+    {
+        fprintf(stderr, "shm: ring of %u slots of %zu bytes is out of range\n", slots, slotSize);
+        return -1;
+    }
+    snprintf(name, sizeof(name), "/otp-%d-%u", (int)getpid(), __atomic_add_fetch(&ringsMade, 1, __ATOMIC_RELAXED));
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+    {
+        perror("shm_open");
+        return -1;
+    }
+    shm->mapSize = shmMapSize(slots, slotSize);
+    void* mem = MAP_FAILED;
+    if (ftruncate(fd, shm->mapSize) == 0)
+    {
+        mem = mmap(NULL, shm->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mem == MAP_FAILED)
+    {
+        perror("shm: mmap");
+        shm_unlink(name);
+        return -1;
+    }
+    shm->header = mem;
+    memcpy(shm->header->magic, OTP_SHM_MAGIC, sizeof(shm->header->magic));
+    shm->header->slots = slots;
+    shm->header->slotSize = slotSize;
+    shm->slots = slots;
+    shm->slotSize = slotSize;
+
+    shm->socketFD = connectDaemon(host, port);
+    int acked = 0;
+    if (shm->socketFD >= 0)
+    {
+        struct otpFrame hello;
+        struct otpReader reader;
+        memset(&hello, 0, sizeof(hello));
+        hello.type = OTP_FRAME_HELLO;
+        hello.flags = OTP_FLAG_SHM;
+        hello.offset = OTP_LEN_UNKNOWN;
+        hello.len0 = OTP_AUTH_SIZE;
+        hello.len1 = strlen(name);
+        if (sendFramed(shm->socketFD, &hello, authCode, name) == 0 && initReader(&reader, shm->socketFD) == 0)
+        {
+            acked = getAck(&reader, OTP_ACK_TIMEOUT_MS, NULL);
+            freeReader(&reader);
+        }
+    }
+    // Mapped on both sides by now, or never going to be
+    shm_unlink(name);
+    if (acked == -1)
+    {
+        fprintf(stderr, "shm: daemon too busy to take the ring, try again later\n");
+    }
+    if (acked != 1)
+    {
+        otpShmClose(shm);
+        return -1;
+    }
+    return 0;
+}
+
+void otpShmClose(struct otpShm* shm)
+{
+    if (shm->header != NULL)
+    {
+        shmShutdown(shm->header);
+        munmap(shm->header, shm->mapSize);
+        shm->header = NULL;
+    }
+    if (shm->socketFD >= 0)
+    {
+        close(shm->socketFD);
+        shm->socketFD = -1;
+    }
+}
+
+/*********************************************************************
+** otpShmText() / otpShmKey() / otpShmStatus()
+* Where slot's text (and later its result) and key go, and the
+* OTP_SHM_* status the daemon gave it.
+*********************************************************************/
+
+char* otpShmText(struct otpShm* shm, int slot)
+{
+    return (char*)(slotAt(shm->header, shm->slots, shm->slotSize, slot) + 1);
+}
+
+char* otpShmKey(struct otpShm* shm, int slot)
+{
+    return otpShmText(shm, slot) + shm->slotSize;
+}
+
+int otpShmStatus(struct otpShm* shm, int slot)
+{
+    return slotAt(shm->header, shm->slots, shm->slotSize, slot)->status;
+}
+
+/*********************************************************************
+** otpShmNext()
+* Returns the slot to fill next, or -1 while every slot is in flight
+* or waiting to be released.
+*********************************************************************/
+
+int otpShmNext(struct otpShm* shm)
+{
+    if (shm->submitted - shm->consumed >= shm->slots)
+    {
+        return -1;
+    }
+    return shm->submitted % shm->slots;
+}
+
+/*********************************************************************
+** otpShmSubmit()
+* Hands the slot from otpShmNext(), now holding len bytes of text and
+* key, to the daemon. Returns 0 on success, -1 if len doesn't fit or no
+* slot is free.
+*********************************************************************/
+
+int otpShmSubmit(struct otpShm* shm, size_t len)
+{
+    if (len > shm->slotSize || otpShmNext(shm) < 0)
+    {
+        return -1;
+    }
+    slotAt(shm->header, shm->slots, shm->slotSize, shm->submitted)->len = len;
+    shm->submitted++;
+    __atomic_store_n(&shm->header->submitted, shm->submitted, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&shm->header->daemonWaiting, __ATOMIC_SEQ_CST))
+    {
+        futexWake(&shm->header->submitted);
+    }
+    return 0;
+}
+
+/*********************************************************************
+** otpShmWait()
+* Waits up to timeoutMs (-1 for no limit) for the oldest submitted slot
+* to come back. Returns that slot, so the caller can read its status
+* and the result in its text, then otpShmRelease() it; returns
+* -1 if nothing was submitted, on timeout, or when the daemon is gone.
+*********************************************************************/
+
+static int daemonGone(void* arg)
+{
+    struct pollfd pfd;
+    pfd.fd = *(int*)arg;
+    pfd.events = POLLIN;
+    // Nothing more is sent on the socket after the ACK, except by hanging up
+    return poll(&pfd, 1, 0) != 0;
+}
+
+int otpShmWait(struct otpShm* shm, int timeoutMs)
+{
+    if (shm->consumed == shm->submitted)
+    {
+        return -1;
+    }
+    struct otpShmHeader* header = shm->header;
+    if (__atomic_load_n(&header->done, __ATOMIC_ACQUIRE) == shm->consumed &&
+        !waitCounter(header, &header->done, &header->clientWaiting, shm->consumed, timeoutMs, daemonGone, &shm->socketFD))
+    {
+        return -1;
+    }
+    return shm->consumed % shm->slots;
+}
+
+void otpShmRelease(struct otpShm* shm)
+{
+    shm->consumed++;
+}
+
+/*********************************************************************
+** shmAttach()
+* Daemon side: maps the ring a client named in its HELLO. The name must
+* look like one otpShmOpen() makes, the ring must belong to owner (the
+* user the client runs as) and be as big as its header says. Nothing
+* in the ring is read once it is mapped; that is left to the thread
+* serving it (see shmGuard()). Returns 0 on success, -1 otherwise.
+*********************************************************************/
+
+int shmAttach(struct otpShmServer* server, const char* name, size_t nameLen, uid_t owner)
+{
+    char path[OTP_SHM_NAME_MAX];
+    struct otpShmHeader probe;
+    struct stat st;
+    if (nameLen < 6 || nameLen >= sizeof(path) || memcmp(name, "/otp-", 5) != 0 || memchr(name + 1, '/', nameLen - 1) != NULL)
+    {
+        return -1;
+    }
+    memcpy(path, name, nameLen);
+    path[nameLen] = '\0';
+    int fd = shm_open(path, O_RDWR, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    server->header = NULL;
+    if (fstat(fd, &st) == 0 && st.st_uid == owner &&
+        pread(fd, &probe, sizeof(probe), 0) == (ssize_t)sizeof(probe) &&
+        memcmp(probe.magic, OTP_SHM_MAGIC, sizeof(probe.magic)) == 0 &&
+        probe.slots >= 1 && probe.slots <= OTP_SHM_MAX_SLOTS &&
+        probe.slotSize >= 1 && probe.slotSize <= OTP_SHM_MAX_SLOT_SIZE &&
+        (uint64_t)st.st_size >= shmMapSize(probe.slots, probe.slotSize))
+    {
+        server->mapSize = shmMapSize(probe.slots, probe.slotSize);
+        void* mem = mmap(NULL, server->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mem != MAP_FAILED)
+        {
+            server->header = mem;
+        }
+    }
+    close(fd);
+    if (server->header == NULL)
+    {
+        return -1;
+    }
+    // The header is the client's to scribble on, so keep what was checked
+    server->slots = probe.slots;
+    server->slotSize = probe.slotSize;
+    server->stop = 0;
+    server->lost = 0;
+    return 0;
+}
+
+void shmDetach(struct otpShmServer* server)
+{
+    munmap(server->header, server->mapSize);
+}
+
+/*********************************************************************
+** shmGuard() / shmStop()
+* Daemon side. shmGuard() is called by the thread serving a ring before
+* it touches it. The client can still shrink the ring under the
+* mapping, and touching a page past its end raises SIGBUS; for that
+* thread, shmFault() maps zeroed private memory over the whole ring
+* instead, so the access goes through harmlessly, and marks it lost,
+* which ends shmWaitWork(). Any other SIGBUS is fatal, as it would have
+* been, and so is a fault on any other thread, so nothing but the
+* guarded thread may read or write the ring. shmStop() asks the thread
+* to finish from elsewhere. The only part of the ring it uses is the
+* address of the futex it wakes, and FUTEX_WAKE on a page that is gone
+* just fails with EFAULT.
+*********************************************************************/
+
+static void shmFault(int sig, siginfo_t* info, void* context)
+{
+    struct otpShmServer* server = guarded;
+    char* addr = info->si_addr;
+    (void)context;
+    if (server != NULL && addr >= (char*)server->header && addr < (char*)server->header + server->mapSize &&
+        mmap(server->header, server->mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED)
+    {
+        server->lost = 1;
+        return;
+    }
+    // Not a ring's, so fault again and die of it
+    signal(sig, SIG_DFL);
+}
+
+static void installFaultHandler(void)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = shmFault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, NULL);
+}
+
+void shmGuard(struct otpShmServer* server)
+{
+    pthread_once(&faultHandler, installFaultHandler);
+    guarded = server;
+    server->done = __atomic_load_n(&server->header->done, __ATOMIC_ACQUIRE);
+}
+
+void shmStop(struct otpShmServer* server)
+{
+    __atomic_store_n(&server->stop, 1, __ATOMIC_SEQ_CST);
+    futexWake(&server->header->submitted);
+}
+
+/*********************************************************************
+** shmWaitWork()
+* Daemon side: waits until the client hands over the next slot, whose
+* sequence number is server->done. Returns 1 when it has, 0 once the
+* ring is closed, stopped or lost.
+*********************************************************************/
+
+static int serverStopped(void* arg)
+{
+    struct otpShmServer* server = arg;
+    return __atomic_load_n(&server->stop, __ATOMIC_RELAXED) || server->lost;
+}
+
+int shmWaitWork(struct otpShmServer* server)
+{
+    struct otpShmHeader* header = server->header;
+    while (!__atomic_load_n(&header->closed, __ATOMIC_RELAXED) && !serverStopped(server))
+    {
+        if (waitCounter(header, &header->submitted, &header->daemonWaiting, server->done, -1, serverStopped, server))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*********************************************************************
+** shmWorkLen() / shmWorkText() / shmWorkKey()
+* Daemon side: the slot handed over. The length is read once and
+* checked against the agreed slot size, so a client rewriting it
+* meanwhile can't send the daemon outside the slot; returns -1 when it
+* is out of range.
+*********************************************************************/
+
+int64_t shmWorkLen(struct otpShmServer* server)
+{
+    uint64_t len = __atomic_load_n(&slotAt(server->header, server->slots, server->slotSize, server->done)->len, __ATOMIC_RELAXED);
+    return (len > server->slotSize) ? -1 : (int64_t)len;
+}
+
+char* shmWorkText(struct otpShmServer* server)
+{
+    return (char*)(slotAt(server->header, server->slots, server->slotSize, server->done) + 1);
+}
+
+char* shmWorkKey(struct otpShmServer* server)
+{
+    return shmWorkText(server) + server->slotSize;
+}
+
+/*********************************************************************
+** shmComplete()
+* Daemon side: hands slot server->done back to the client with the
+* given OTP_SHM_* status.
+*********************************************************************/
+
+void shmComplete(struct otpShmServer* server, int32_t status)
+{
+    struct otpShmHeader* header = server->header;
+    slotAt(header, server->slots, server->slotSize, server->done)->status = status;
+    server->done++;
+    __atomic_store_n(&header->done, server->done, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->clientWaiting, __ATOMIC_SEQ_CST))
+    {
+        futexWake(&header->done);
+    }
+}
@@ -0,0 +1,105 @@
+/*********************************************************************
+** otpshm.h
+** Description: Shared memory transport for clients on the daemon's
+* host. The client creates a ring of slots in POSIX shared memory and
+* names it to the daemon in a HELLO with OTP_FLAG_SHM; from then on it
+* writes text and key into a slot once, hands the slot over, and reads
+* the result back from the same place. Each side sleeps on a futex in
+* the ring when there is nothing to do. The socket stays open only so
+* each side notices when the other goes away. The daemon only maps a
+* ring owned by the user on the other end of the socket, so rings go
+* over its Unix socket (see -u).
+*********************************************************************/
+
+#ifndef OTPSHM_H
+#define OTPSHM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <signal.h>
+#include <sys/types.h>
+#include "otpshared.h"
+
+#define OTP_SHM_MAGIC "OTPSHM01"
+#define OTP_SHM_NAME_MAX 64 // longest ring name, including the NUL
+#define OTP_SHM_MAX_SLOTS 256
+#define OTP_SHM_MAX_SLOT_SIZE OTP_MAX_FRAME_BODY
+#define OTP_SHM_SPIN 2000 // polls of the ring before going to sleep on it
+#define OTP_SHM_SLEEP_MS 100 // longest one futex sleep, so hangups are noticed
+
+// Slot status, written by the daemon before it hands the slot back
+#define OTP_SHM_OK 1
+#define OTP_SHM_INVALID 0 // text or key had a character outside CHARS
+#define OTP_SHM_FAILED -1 // the slot's length was out of range
+
+/* Ring layout: this header, then slots of otpShmSlot followed by
+   slotSize bytes of text and slotSize bytes of key. Slot n of the ring
+   is taken by the n-th submission modulo slots. The client only writes
+   submitted and the slots it owns, the daemon only writes done and the
+   slots it was handed, and each counter has its own cache line. */
+struct otpShmHeader
+{
+    char magic[8];
+    uint32_t slots;
+    uint32_t closed;   // set when either side goes away
+    uint64_t slotSize;
+    uint32_t submitted __attribute__((aligned(64))); // slots handed to the daemon; futex word
+    uint32_t daemonWaiting;                          // daemon is asleep on submitted
+    uint32_t done __attribute__((aligned(64)));      // slots handed back; futex word
+    uint32_t clientWaiting;                          // client is asleep on done
+};
+
+struct otpShmSlot
+{
+    uint64_t len;
+    int32_t status; // OTP_SHM_*
+} __attribute__((aligned(64)));
+
+// Client end of a ring
+struct otpShm
+{
+    int socketFD;
+    struct otpShmHeader* header;
+    size_t mapSize;
+    uint32_t slots;
+    uint64_t slotSize;
+    uint32_t submitted; // slots handed to the daemon so far
+    uint32_t consumed;  // results taken back so far
+};
+
+// Daemon end of a ring, served by its own thread
+struct otpShmServer
+{
+    struct otpShmHeader* header;
+    size_t mapSize;
+    uint32_t slots;    // geometry checked at attach time
+    uint64_t slotSize;
+    uint32_t done;     // sequence number of the slot being worked on
+    int stop;          // the session is closing, see shmStop()
+    volatile sig_atomic_t lost; // the client shrank the ring, see shmGuard()
+};
+
+OTP_API int otpShmOpen(struct otpShm* shm, const char* host, const char* port, const char* authCode, uint32_t slots, size_t slotSize);
+OTP_API void otpShmClose(struct otpShm* shm);
+OTP_API char* otpShmText(struct otpShm* shm, int slot);
+OTP_API char* otpShmKey(struct otpShm* shm, int slot);
+OTP_API int otpShmStatus(struct otpShm* shm, int slot);
+OTP_API int otpShmNext(struct otpShm* shm);
+OTP_API int otpShmSubmit(struct otpShm* shm, size_t len);
+OTP_API int otpShmWait(struct otpShm* shm, int timeoutMs);
+OTP_API void otpShmRelease(struct otpShm* shm);
+
+#ifdef OTP_BUILD
+int shmAttach(struct otpShmServer* server, const char* name, size_t nameLen, uid_t owner);
+void shmDetach(struct otpShmServer* server);
+void shmGuard(struct otpShmServer* server);
+void shmStop(struct otpShmServer* server);
+int shmWaitWork(struct otpShmServer* server);
+int64_t shmWorkLen(struct otpShmServer* server);
+char* shmWorkText(struct otpShmServer* server);
+char* shmWorkKey(struct otpShmServer* server);
+void shmComplete(struct otpShmServer* server, int32_t status);
+void shmShutdown(struct otpShmHeader* header);
+#endif
+
+#endif
@@ -0,0 +1,371 @@
+/*********************************************************************
+** otpstats.c
+** Description: Metrics for the one time pad daemons. Each thread
+* claims a slot on first use and counts into it with relaxed atomic
+* adds, so the hot path takes no locks and threads don't share cache
+* lines. The slots live in one shared anonymous mapping made before
+* the daemon starts serving, so forked children count into the same
+* place as the parent; a child claims a fresh slot after fork() (slots
+* are reused once they run out, which the atomic adds make safe).
+* Latencies go into power-of-two histograms, one per stage.
+* The numbers are added up only when asked for: on SIGUSR1 they are
+* written to stderr, and a client connecting to the stats socket (-s)
+* gets them and is hung up on. Either way the output is one
+* "name value" pair per line. With tracing on, SIGUSR2 writes the
+* trace rings out (see otptrace.c).
+*********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
+#include "otpstats.h"
+#include "otptrace.h"
+
+struct stageStats
+{
+    uint64_t count;
+    uint64_t totalNs;
+    uint64_t maxNs;
+    uint64_t buckets[OTP_STATS_BUCKETS];
+};
+
+// One thread's counters, aligned so neighbouring slots don't share a cache line
+struct statSlot
+{
+    uint64_t counters[STAT_COUNTERS];
+    struct stageStats stages[STAT_STAGES];
+} __attribute__((aligned(64)));
+
+struct statsShared
+{
+    uint32_t nextSlot; // slots claimed so far, modulo OTP_STATS_SLOTS
+    struct statSlot slots[OTP_STATS_SLOTS];
+};
+
+struct statsListener
+{
+    int signalFD;
+    int listenFD; // -1 without a stats socket
+    const char* prefix;
+    const char* tracePath; // where SIGUSR2 writes the trace, NULL without tracing
+};
+
+static const char* counterNames[STAT_COUNTERS] =
+{
+    "conn.accepted", "conn.rejected", "conn.closed", "conn.failed",
+    "req.completed", "req.errors", "frames.in", "bytes.in", "bytes.encoded",
+    "req.shed"
+};
+
+static const char* stageNames[STAT_STAGES] = { "accept", "auth", "recv", "encode", "send" };
+
+static struct statsShared* shared = NULL;
+static __thread struct statSlot* mySlot = NULL;
+
+/*********************************************************************
+** initStats()
+* Maps the shared slots. Must be called before any threads start or
+* children are forked. Returns 0 on success, -1 on failure.
+*********************************************************************/
+
+int initStats(void)
+{
+    void* mem = mmap(NULL, sizeof(struct statsShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        perror("stats: mmap");
+        return -1;
+    }
+    shared = mem;
+    return 0;
+}
+
+/*********************************************************************
+** statsNewProcess()
+* Called in a forked child so it claims a slot of its own rather than
+* counting into the one of the thread that forked it.
+*********************************************************************/
+
+void statsNewProcess(void)
+{
+    mySlot = NULL;
+}
+
+static struct statSlot* getSlot(void)
+{
+    if (mySlot == NULL)
+    {
+        uint32_t n = __atomic_fetch_add(&shared->nextSlot, 1, __ATOMIC_RELAXED);
+        mySlot = &shared->slots[n % OTP_STATS_SLOTS];
+    }
+    return mySlot;
+}
+
+/*********************************************************************
+** statsNow()
+* Returns a monotonic time in nanoseconds, the start of a stage.
+*********************************************************************/
+
+uint64_t statsNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+const char* statsStageName(int stage)
+{
+    return (stage >= 0 && stage < STAT_STAGES) ? stageNames[stage] : "unknown";
+}
+
+/*********************************************************************
+** statsCount()
+* Adds n to one of the STAT_* counters. Does nothing before initStats().
+*********************************************************************/
+
+void statsCount(int counter, uint64_t n)
+{
+    if (shared == NULL)
+    {
+        return;
+    }
+    __atomic_fetch_add(&getSlot()->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+/*********************************************************************
+** statsStage()
+* Records that one of the STAGE_* stages, begun at startNs (from
+* statsNow()), has just finished, and traces it when tracing is on.
+*********************************************************************/
+
+void statsStage(int stage, uint64_t startNs)
+{
+    if (shared == NULL)
+    {
+        return;
+    }
+    uint64_t endNs = statsNow();
+    uint64_t ns = endNs - startNs;
+    traceSpan(stage, startNs, endNs);
+    struct stageStats* s = &getSlot()->stages[stage];
+    int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+    if (bucket >= OTP_STATS_BUCKETS) bucket = OTP_STATS_BUCKETS - 1;
+    __atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->totalNs, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->buckets[bucket], 1, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&s->maxNs, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&s->maxNs, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*********************************************************************
+** percentile()
+* Given a histogram and how many samples it holds, returns the upper
+* bound of the bucket the p-th fraction of samples falls in.
+*********************************************************************/
+
+static uint64_t percentile(const uint64_t* buckets, uint64_t count, double p)
+{
+    uint64_t want = (uint64_t)(count * p);
+    uint64_t seen = 0;
+    int b;
+    for (b = 0; b < OTP_STATS_BUCKETS; b++)
+    {
+        seen += buckets[b];
+        if (seen > want)
+        {
+            break;
+        }
+    }
+    return (b >= OTP_STATS_BUCKETS) ? UINT64_MAX : (1ull << b);
+}
+
+/*********************************************************************
+** dumpStats()
+* Adds up every slot and writes the totals to out, each name starting
+* with prefix. Stage lines give the count, total and largest time and
+* the p50/p99/p999 bucket bounds, followed by every non-empty bucket as
+* prefix.stage.<name>.le_<bound>.
+*********************************************************************/
+
+void dumpStats(FILE* out, const char* prefix)
+{
+    if (shared == NULL)
+    {
+        return;
+    }
+    uint64_t counters[STAT_COUNTERS] = { 0 };
+    struct stageStats stages[STAT_STAGES];
+    memset(stages, 0, sizeof(stages));
+    int i, c, s, b;
+    for (i = 0; i < OTP_STATS_SLOTS; i++)
+    {
+        struct statSlot* slot = &shared->slots[i];
+        for (c = 0; c < STAT_COUNTERS; c++)
+        {
+            counters[c] += __atomic_load_n(&slot->counters[c], __ATOMIC_RELAXED);
+        }
+        for (s = 0; s < STAT_STAGES; s++)
+        {
+            struct stageStats* from = &slot->stages[s];
+            stages[s].count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+            stages[s].totalNs += __atomic_load_n(&from->totalNs, __ATOMIC_RELAXED);
+            uint64_t max = __atomic_load_n(&from->maxNs, __ATOMIC_RELAXED);
+            if (max > stages[s].maxNs) stages[s].maxNs = max;
+            for (b = 0; b < OTP_STATS_BUCKETS; b++)
+            {
+                stages[s].buckets[b] += __atomic_load_n(&from->buckets[b], __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    for (c = 0; c < STAT_COUNTERS; c++)
+    {
+        fprintf(out, "%s.%s %llu\n", prefix, counterNames[c], (unsigned long long)counters[c]);
+    }
+    for (s = 0; s < STAT_STAGES; s++)
+    {
+        struct stageStats* st = &stages[s];
+        const char* name = stageNames[s];
+        fprintf(out, "%s.stage.%s.count %llu\n", prefix, name, (unsigned long long)st->count);
+        fprintf(out, "%s.stage.%s.total_ns %llu\n", prefix, name, (unsigned long long)st->totalNs);
+        fprintf(out, "%s.stage.%s.max_ns %llu\n", prefix, name, (unsigned long long)st->maxNs);
+        if (st->count == 0)
+        {
+            continue;
+        }
+        fprintf(out, "%s.stage.%s.p50_ns %llu\n", prefix, name, (unsigned long long)percentile(st->buckets, st->count, 0.5));
+        fprintf(out, "%s.stage.%s.p99_ns %llu\n", prefix, name, (unsigned long long)percentile(st->buckets, st->count, 0.99));
+        fprintf(out, "%s.stage.%s.p999_ns %llu\n", prefix, name, (unsigned long long)percentile(st->buckets, st->count, 0.999));
+        for (b = 0; b < OTP_STATS_BUCKETS; b++)
+        {
+            if (st->buckets[b] != 0)
+            {
+                fprintf(out, "%s.stage.%s.le_%llu %llu\n", prefix, name, 1ull << b, (unsigned long long)st->buckets[b]);
+            }
+        }
+    }
+    fflush(out);
+}
+
+/*********************************************************************
+** statsThread()
+* Waits for SIGUSR1 or a connection to the stats socket and answers
+* each with a dump. SIGUSR2 writes out the trace.
+*********************************************************************/
+
+static void* statsThread(void* arg)
+{
+    struct statsListener* listener = arg;
+    struct pollfd pfds[2];
+    pfds[0].fd = listener->signalFD;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = listener->listenFD;
+    pfds[1].events = POLLIN;
+    int nfds = (listener->listenFD >= 0) ? 2 : 1;
+    while (1)
+    {
+        if (poll(pfds, nfds, -1) < 0)
+        {
+            continue;
+        }
+        if (pfds[0].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+            if (read(listener->signalFD, &info, sizeof(info)) != sizeof(info))
+            {
+                continue;
+            }
+            if (info.ssi_signo == SIGUSR1)
+            {
+                dumpStats(stderr, listener->prefix);
+            }
+            else if (listener->tracePath != NULL && dumpTrace(listener->tracePath) == 0)
+            {
+                fprintf(stderr, "%s: trace written to %s\n", listener->prefix, listener->tracePath);
+            }
+        }
+        if (nfds == 2 && (pfds[1].revents & POLLIN))
+        {
+            int connFD = accept(listener->listenFD, NULL, NULL);
+            if (connFD < 0)
+            {
+                continue;
+            }
+            FILE* out = fdopen(connFD, "w");
+            if (out == NULL)
+            {
+                close(connFD);
+                continue;
+            }
+            dumpStats(out, listener->prefix);
+            fclose(out);
+        }
+    }
+    return NULL;
+}
+
+/*********************************************************************
+** startStatsThread()
+* Blocks SIGUSR1 and SIGUSR2 in the calling thread, so every thread
+* and child started after this inherits the mask and the signals only
+* reach the stats thread, then starts that thread. With a socketPath,
+* also listens on a Unix socket there, replacing whatever was at the
+* path. With a tracePath, SIGUSR2 writes the trace there. Names in the
+* output start with prefix. Returns 0 on success, -1 on failure.
+*********************************************************************/
+
+int startStatsThread(const char* socketPath, const char* prefix, const char* tracePath)
+{
+    static struct statsListener listener;
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    listener.prefix = prefix;
+    listener.tracePath = tracePath;
+    listener.listenFD = -1;
+    listener.signalFD = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (listener.signalFD < 0)
+    {
+        perror("stats: signalfd");
+        return -1;
+    }
+    if (socketPath != NULL)
+    {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(socketPath) >= sizeof(addr.sun_path))
+        {
+            fprintf(stderr, "stats socket path too long: %s\n", socketPath);
+            return -1;
+        }
+        strcpy(addr.sun_path, socketPath);
+        listener.listenFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        unlink(socketPath);
+        if (listener.listenFD < 0 || bind(listener.listenFD, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+            listen(listener.listenFD, 5) < 0)
+        {
+            perror(socketPath);
+            return -1;
+        }
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, statsThread, &listener) != 0)
+    {
+        fprintf(stderr, "stats: cannot start thread\n");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
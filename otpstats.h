@@ -0,0 +1,50 @@
+/*********************************************************************
+** otpstats.h
+** Description: Function prototypes for the daemon's metrics. Every
+* thread (or forked child) counts into a slot of its own, and the
+* slots are only added up when someone asks for the numbers.
+*********************************************************************/
+
+#ifndef OTPSTATS_H
+#define OTPSTATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define OTP_STATS_SLOTS 128 // slots shared out among threads and children
+#define OTP_STATS_BUCKETS 40 // latency buckets, bucket b holds [2^(b-1), 2^b) ns
+
+// Counters
+#define STAT_CONN_ACCEPTED 0  // connections accepted
+#define STAT_CONN_REJECTED 1  // clients that failed the auth check
+#define STAT_CONN_CLOSED 2    // clients that hung up cleanly
+#define STAT_CONN_FAILED 3    // connections dropped on an error
+#define STAT_REQ_COMPLETED 4  // requests ended with END
+#define STAT_REQ_ERRORS 5     // requests answered with ERROR
+#define STAT_FRAMES_IN 6      // frames received
+#define STAT_BYTES_IN 7       // frame body bytes received
+#define STAT_BYTES_ENCODED 8  // characters encrypted or decrypted
+#define STAT_REQ_SHED 9       // requests turned away with BUSY
+#define STAT_COUNTERS 10
+
+// Timed stages
+#define STAGE_ACCEPT 0  // accept() returning to the session being ready
+#define STAGE_AUTH 1    // handling a HELLO, including any pad reservation
+#define STAGE_RECV 2    // reading one frame (with -m fork, includes waiting for it)
+#define STAGE_ENCODE 3  // encoding one DATA frame
+// Writing replies to the socket: each reply frame with -m fork, each
+// flushOutput() of the captured replies with -m epoll, and each send
+// from submission to completion with -m uring
+#define STAGE_SEND 4
+#define STAT_STAGES 5
+
+int initStats(void);
+void statsNewProcess(void);
+uint64_t statsNow(void);
+void statsCount(int counter, uint64_t n);
+void statsStage(int stage, uint64_t startNs);
+const char* statsStageName(int stage);
+void dumpStats(FILE* out, const char* prefix);
+int startStatsThread(const char* socketPath, const char* prefix, const char* tracePath);
+
+#endif
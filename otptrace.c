@@ -0,0 +1,205 @@
+/*********************************************************************
+** otptrace.c
+** Description: Request tracing for the one time pad daemons, turned on
+* with -T. Every stage timed by statsStage() is also written as a span
+* into a ring of OTP_TRACE_SPANS entries claimed by the thread on first
+* use, so slow requests can be picked apart one by one rather than only
+* showing up in a histogram. Recording takes no locks and allocates
+* nothing: the rings are one shared anonymous mapping made at startup,
+* which forked children write into too (a child claims a fresh ring,
+* and rings are reused once they run out). Each span is claimed with an
+* atomic add on its ring's head and published by storing its sequence
+* number last, so a dump running alongside skips spans that are half
+* written or were overwritten while it read them.
+* dumpTrace() writes every span still held in the Chrome trace event
+* format, one process per daemon process and one thread per ring, for
+* chrome://tracing or Perfetto.
+*********************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "otptrace.h"
+#include "otpstats.h"
+
+struct traceEvent
+{
+    uint64_t seq;     // position in the ring plus one, 0 while unwritten
+    uint64_t startNs;
+    uint64_t durNs;
+    uint32_t connId;
+    uint32_t requestId;
+    int32_t pid;
+    int32_t stage;
+};
+
+struct traceRing
+{
+    uint64_t head; // spans ever written to this ring
+    char pad[64 - sizeof(uint64_t)];
+    struct traceEvent events[OTP_TRACE_SPANS];
+};
+
+struct traceShared
+{
+    uint32_t nextRing;
+    uint32_t nextConn;
+    struct traceRing rings[OTP_TRACE_RINGS];
+};
+
+static struct traceShared* shared = NULL;
+static __thread struct traceRing* myRing = NULL;
+static __thread int32_t myPid;
+static __thread uint32_t curConn;
+static __thread uint32_t curRequest;
+
+/*********************************************************************
+** initTrace()
+* Maps the rings and turns tracing on. Must be called before any
+* threads start or children are forked. Returns 0 on success, -1 on
+* failure.
+*********************************************************************/
+
+int initTrace(void)
+{
+    void* mem = mmap(NULL, sizeof(struct traceShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        perror("trace: mmap");
+        return -1;
+    }
+    shared = mem;
+    return 0;
+}
+
+/*********************************************************************
+** traceNewProcess()
+* Called in a forked child so it claims a ring of its own.
+*********************************************************************/
+
+void traceNewProcess(void)
+{
+    myRing = NULL;
+}
+
+/*********************************************************************
+** traceNewConn()
+* Returns a connection id unique across the daemon's processes, or 0
+* when tracing is off.
+*********************************************************************/
+
+uint32_t traceNewConn(void)
+{
+    if (shared == NULL)
+    {
+        return 0;
+    }
+    return __atomic_add_fetch(&shared->nextConn, 1, __ATOMIC_RELAXED);
+}
+
+/*********************************************************************
+** traceContext()
+* Sets the connection and request the calling thread's next spans
+* belong to.
+*********************************************************************/
+
+void traceContext(uint32_t connId, uint32_t requestId)
+{
+    curConn = connId;
+    curRequest = requestId;
+}
+
+/*********************************************************************
+** traceSpan()
+* Records a span of the given STAGE_* from startNs to endNs for the
+* current connection and request. Does nothing when tracing is off.
+*********************************************************************/
+
+void traceSpan(int stage, uint64_t startNs, uint64_t endNs)
+{
+    if (shared == NULL)
+    {
+        return;
+    }
+    if (myRing == NULL)
+    {
+        uint32_t n = __atomic_fetch_add(&shared->nextRing, 1, __ATOMIC_RELAXED);
+        myRing = &shared->rings[n % OTP_TRACE_RINGS];
+        myPid = getpid();
+    }
+    uint64_t pos = __atomic_fetch_add(&myRing->head, 1, __ATOMIC_RELAXED);
+    struct traceEvent* ev = &myRing->events[pos % OTP_TRACE_SPANS];
+    __atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ev->startNs = startNs;
+    ev->durNs = endNs - startNs;
+    ev->connId = curConn;
+    ev->requestId = curRequest;
+    ev->pid = myPid;
+    ev->stage = stage;
+    __atomic_store_n(&ev->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/*********************************************************************
+** dumpTrace()
+* Writes every span still held in the rings to path as Chrome trace
+* JSON. The file is written next to path and renamed over it, so a
+* reader never sees half a trace. Returns 0 on success, -1 on failure.
+*********************************************************************/
+
+int dumpTrace(const char* path)
+{
+    if (shared == NULL)
+    {
+        return -1;
+    }
+    char tmpPath[4096];
+    if (snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path) >= (int)sizeof(tmpPath))
+    {
+        fprintf(stderr, "trace path too long: %s\n", path);
+        return -1;
+    }
+    FILE* out = fopen(tmpPath, "w");
+    if (out == NULL)
+    {
+        perror(tmpPath);
+        return -1;
+    }
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    const char* sep = "\n";
+    int r;
+    for (r = 0; r < OTP_TRACE_RINGS; r++)
+    {
+        struct traceRing* ring = &shared->rings[r];
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t pos = (head > OTP_TRACE_SPANS) ? head - OTP_TRACE_SPANS : 0;
+        for (; pos < head; pos++)
+        {
+            struct traceEvent* ev = &ring->events[pos % OTP_TRACE_SPANS];
+            if (__atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE) != pos + 1)
+            {
+                continue;
+            }
+            struct traceEvent copy = *ev;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&ev->seq, __ATOMIC_RELAXED) != pos + 1)
+            {
+                continue;
+            }
+            fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"otp\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"pid\":%d,\"tid\":%d,\"args\":{\"conn\":%u,\"req\":%u}}",
+                    sep, statsStageName(copy.stage), copy.startNs / 1e3, copy.durNs / 1e3,
+                    copy.pid, r, copy.connId, copy.requestId);
+            sep = ",\n";
+        }
+    }
+    fprintf(out, "\n]}\n");
+    if (fclose(out) != 0 || rename(tmpPath, path) < 0)
+    {
+        perror(path);
+        unlink(tmpPath);
+        return -1;
+    }
+    return 0;
+}
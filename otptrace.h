@@ -0,0 +1,25 @@
+/*********************************************************************
+** otptrace.h
+** Description: Function prototypes for the daemon's request tracing.
+* When turned on, every timed stage (see otpstats.h) is also recorded
+* as a span in a fixed-size ring per thread, tagged with the connection
+* and request it belonged to, and the rings can be written out as a
+* Chrome trace.
+*********************************************************************/
+
+#ifndef OTPTRACE_H
+#define OTPTRACE_H
+
+#include <stdint.h>
+
+#define OTP_TRACE_RINGS 64 // rings shared out among threads and children
+#define OTP_TRACE_SPANS 16384 // spans each ring keeps, the oldest are overwritten
+
+int initTrace(void);
+void traceNewProcess(void);
+uint32_t traceNewConn(void);
+void traceContext(uint32_t connId, uint32_t requestId);
+void traceSpan(int stage, uint64_t startNs, uint64_t endNs);
+int dumpTrace(const char* path);
+
+#endif
@@ -0,0 +1,217 @@
+/*********************************************************************
+** otpuring.c
+** Description: io_uring plumbing for the daemon. Sets a ring up with
+* the raw system calls and maps its queues, hands out submission
+* entries, and submits everything queued while waiting for completions
+* in a single io_uring_enter(). The submission array is filled in once
+* as the identity mapping, so queuing an entry is just a tail bump.
+*********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "otpuring.h"
+
+/*********************************************************************
+** initRing()
+* Creates a ring with room for entries submissions and maps its
+* queues. Returns 0 on success, -1 (with errno set) when the kernel
+* has no io_uring or refuses one.
+*********************************************************************/
+
+int initRing(struct otpRing* ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+    {
+        return -1;
+    }
+    ring->entries = params.sq_entries;
+
+    ring->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // Newer kernels put both rings in one mapping
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cqMapSize > ring->sqMapSize) ring->sqMapSize = ring->cqMapSize;
+        ring->cqMapSize = ring->sqMapSize;
+    }
+    ring->sqMap = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqMap == MAP_FAILED)
+    {
+        close(ring->fd);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cqMap = ring->sqMap;
+    }
+    else
+    {
+        ring->cqMap = mmap(NULL, ring->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqMap == MAP_FAILED)
+        {
+            munmap(ring->sqMap, ring->sqMapSize);
+            close(ring->fd);
+            return -1;
+        }
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        if (ring->cqMap != ring->sqMap) munmap(ring->cqMap, ring->cqMapSize);
+        munmap(ring->sqMap, ring->sqMapSize);
+        close(ring->fd);
+        return -1;
+    }
+
+    char* sq = ring->sqMap;
+    char* cq = ring->cqMap;
+    ring->sqHead = (unsigned*)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    ring->sqeTail = *ring->sqTail;
+    unsigned i;
+    for (i = 0; i < params.sq_entries; i++)
+    {
+        ring->sqArray[i] = i;
+    }
+    return 0;
+}
+
+void freeRing(struct otpRing* ring)
+{
+    munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqMap != ring->sqMap) munmap(ring->cqMap, ring->cqMapSize);
+    munmap(ring->sqMap, ring->sqMapSize);
+    close(ring->fd);
+}
+
+/*********************************************************************
+** ringSupports()
+* Asks the kernel which operations the ring can run. A kernel can set
+* a ring up long before it knows every opcode: accept, recv and send
+* only arrived in 5.5 and 5.6, and the probe itself in 5.6. Returns 1
+* if all count of ops are supported, 0 if any is not or the kernel
+* can't say.
+*********************************************************************/
+
+int ringSupports(struct otpRing* ring, const unsigned char* ops, int count)
+{
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    if (probe == NULL)
+    {
+        return 0;
+    }
+    int supported = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    int i;
+    for (i = 0; supported && i < count; i++)
+    {
+        supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+/*********************************************************************
+** registerRingBuffer()
+* Registers one region of memory as fixed buffer 0, so reads and
+* writes into it skip pinning pages on every request.
+* Returns 0 on success, -1 on failure (often RLIMIT_MEMLOCK).
+*********************************************************************/
+
+int registerRingBuffer(struct otpRing* ring, void* base, size_t len)
+{
+    struct iovec iov;
+    iov.iov_base = base;
+    iov.iov_len = len;
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0 ? -1 : 0;
+}
+
+/*********************************************************************
+** getSqe()
+* Returns a cleared submission entry to fill in. If the queue is full,
+* what is queued is submitted first. Returns NULL only if that fails.
+*********************************************************************/
+
+struct io_uring_sqe* getSqe(struct otpRing* ring)
+{
+    unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    if (ring->sqeTail - head >= ring->entries)
+    {
+        if (submitAndWait(ring, 0) < 0)
+        {
+            return NULL;
+        }
+        head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+        if (ring->sqeTail - head >= ring->entries)
+        {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sqeTail & *ring->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqeTail++;
+    return sqe;
+}
+
+/*********************************************************************
+** submitAndWait()
+* Hands every queued entry to the kernel and waits until at least
+* waitFor completions are ready, all in one system call.
+* Returns 0 on success, -1 on failure.
+*********************************************************************/
+
+int submitAndWait(struct otpRing* ring, unsigned waitFor)
+{
+    __atomic_store_n(ring->sqTail, ring->sqeTail, __ATOMIC_RELEASE);
+    while (1)
+    {
+        unsigned pending = ring->sqeTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+        if (syscall(__NR_io_uring_enter, ring->fd, pending, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0, NULL, 0) >= 0)
+        {
+            return 0;
+        }
+        if (errno != EINTR)
+        {
+            perror("io_uring_enter");
+            return -1;
+        }
+    }
+}
+
+/*********************************************************************
+** peekCqe() / seenCqe()
+* Return the oldest completion that hasn't been handled, or NULL when
+* there is none, and mark it handled.
+*********************************************************************/
+
+struct io_uring_cqe* peekCqe(struct otpRing* ring)
+{
+    unsigned head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cqMask];
+}
+
+void seenCqe(struct otpRing* ring)
+{
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
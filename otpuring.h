@@ -0,0 +1,48 @@
+/*********************************************************************
+** otpuring.h
+** Description: A minimal io_uring wrapper for the daemon's io_uring
+* backend, talking to the kernel directly rather than through
+* liburing. Requests are queued with getSqe() and go to the kernel in
+* one batch with each submitAndWait().
+*********************************************************************/
+
+#ifndef OTPURING_H
+#define OTPURING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+struct otpRing
+{
+    int fd;
+    unsigned entries;
+    // Submission queue
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    struct io_uring_sqe* sqes;
+    unsigned sqeTail;     // next free sqe, published to sqTail on submit
+    // Completion queue
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+    // Mappings, for tearing the ring down
+    void* sqMap;
+    size_t sqMapSize;
+    void* cqMap;
+    size_t cqMapSize;
+    size_t sqesSize;
+};
+
+int initRing(struct otpRing* ring, unsigned entries);
+void freeRing(struct otpRing* ring);
+int ringSupports(struct otpRing* ring, const unsigned char* ops, int count);
+int registerRingBuffer(struct otpRing* ring, void* base, size_t len);
+struct io_uring_sqe* getSqe(struct otpRing* ring);
+int submitAndWait(struct otpRing* ring, unsigned waitFor);
+struct io_uring_cqe* peekCqe(struct otpRing* ring);
+void seenCqe(struct otpRing* ring);
+
+#endif
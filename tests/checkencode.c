@@ -0,0 +1,212 @@
+/*********************************************************************
+** checkencode.c
+** Description: Checks that every way the programs encode a message
+* gives the same result as the scalar encodeChecked(): each SIMD kernel
+* the CPU has (forced through OTP_ENCODER) and encodeParallel() on top
+* of each. Messages are sized around OTP_PARALLEL_MIN and
+* OTP_PARALLEL_BLOCK with odd tails, in both directions, once all
+* valid and once with a bad character in the plaintext or key of a
+* late block, so the position encodeParallel() reports is checked too.
+* The byte alphabet is compared with the scalar encodeBytes() the same
+* way. Run by make check; prints each failure and exits 1 if any.
+* Usage: checkencode
+*********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "otpshared.h"
+#include "otpcipher.h"
+#include "otppool.h"
+
+#define MAX_LEN (OTP_PARALLEL_MIN + 9 * OTP_PARALLEL_BLOCK + 61) // largest message checked
+
+static const size_t lengths[] =
+{
+    0, 1, 15, 17, 31, 33, 63, 65, 4097,
+    OTP_PARALLEL_BLOCK - 1, OTP_PARALLEL_BLOCK, OTP_PARALLEL_BLOCK + 1,
+    OTP_PARALLEL_MIN - 1, OTP_PARALLEL_MIN, OTP_PARALLEL_MIN + 1,
+    OTP_PARALLEL_MIN + OTP_PARALLEL_BLOCK - 1, OTP_PARALLEL_MIN + OTP_PARALLEL_BLOCK + 7,
+    MAX_LEN
+};
+
+// Where to put a bad character, if anywhere
+enum { BAD_NONE, BAD_TEXT, BAD_KEY };
+
+static char* plaintext; // MAX_LEN random characters from CHARS
+static char* key;
+static char* expected;  // scalar output
+static char* output;
+static int failures = 0;
+
+/*********************************************************************
+** badPosition()
+* Where the bad character goes in a message of len: inside the second
+* to last block, past the first slice, so a helper thread finds it.
+*********************************************************************/
+
+static size_t badPosition(size_t len)
+{
+    return (len > OTP_PARALLEL_BLOCK + 3) ? len - OTP_PARALLEL_BLOCK - 3 : len / 2;
+}
+
+/*********************************************************************
+** compare()
+* Checks one result against the scalar one: the same count of encoded
+* characters, and the same output up to it.
+*********************************************************************/
+
+static void compare(const char* what, const char* kernel, size_t len, int direction, int bad, size_t want, size_t got)
+{
+    size_t i;
+    if (got != want)
+    {
+        fprintf(stderr, "FAIL %s (%s) len %zu dir %d bad %d: encoded %zu, expected %zu\n",
+                what, kernel, len, direction, bad, got, want);
+        failures++;
+        return;
+    }
+    for (i = 0; i < want && output[i] == expected[i]; i++);
+    if (i < want)
+    {
+        fprintf(stderr, "FAIL %s (%s) len %zu dir %d bad %d: output differs at %zu\n",
+                what, kernel, len, direction, bad, i);
+        failures++;
+    }
+}
+
+/*********************************************************************
+** checkText()
+* Checks encodeChecked() and encodeParallel() under the current kernel
+* for every length, direction and bad character placement.
+*********************************************************************/
+
+static void checkText(const char* kernel)
+{
+    size_t l;
+    int direction, bad;
+    for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+    {
+        size_t len = lengths[l];
+        for (direction = OTP_ENCRYPT; direction <= OTP_DECRYPT; direction++)
+        {
+            for (bad = BAD_NONE; bad <= BAD_KEY; bad++)
+            {
+                if (bad != BAD_NONE && len == 0) continue;
+                size_t at = badPosition(len);
+                char* target = (bad == BAD_TEXT) ? plaintext : key;
+                char saved = target[at];
+                if (bad != BAD_NONE) target[at] = 'a';
+
+                // The scalar result was worked out under the scalar kernel
+                setenv("OTP_ENCODER", "scalar", 1);
+                initEncoder();
+                size_t want = encodeChecked(plaintext, key, expected, len, direction);
+                setenv("OTP_ENCODER", kernel, 1);
+                initEncoder();
+                if (want != (bad == BAD_NONE ? len : at))
+                {
+                    fprintf(stderr, "FAIL scalar len %zu dir %d bad %d: encoded %zu\n", len, direction, bad, want);
+                    failures++;
+                }
+
+                memset(output, 0, len);
+                compare("encodeChecked", kernel, len, direction, bad, want,
+                        encodeChecked(plaintext, key, output, len, direction));
+                memset(output, 0, len);
+                compare("encodeParallel", kernel, len, direction, bad, want,
+                        encodeParallel(plaintext, key, output, len, direction, OTP_ALPHABET_TEXT));
+
+                if (bad != BAD_NONE) target[at] = saved;
+            }
+        }
+    }
+}
+
+/*********************************************************************
+** checkBytes()
+* Checks encodeBytes() and encodeParallel() on the byte alphabet under
+* the current kernel, with every byte value in the text and key.
+*********************************************************************/
+
+static void checkBytes(const char* kernel)
+{
+    size_t l;
+    int direction;
+    for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+    {
+        size_t len = lengths[l];
+        for (direction = OTP_ENCRYPT; direction <= OTP_DECRYPT; direction++)
+        {
+            setenv("OTP_ENCODER", "scalar", 1);
+            initEncoder();
+            encodeBytes(plaintext, key, expected, len, direction);
+            setenv("OTP_ENCODER", kernel, 1);
+            initEncoder();
+
+            memset(output, 0, len);
+            encodeBytes(plaintext, key, output, len, direction);
+            compare("encodeBytes", kernel, len, direction, BAD_NONE, len, len);
+            memset(output, 0, len);
+            compare("encodeParallel bytes", kernel, len, direction, BAD_NONE, len,
+                    encodeParallel(plaintext, key, output, len, direction, OTP_ALPHABET_BYTES));
+        }
+    }
+}
+
+int main(void)
+{
+    static const char* kernels[] = { "scalar", "sse2", "avx2", "avx512" };
+    const char charset[] = CHARS;
+    size_t i, k;
+    unsigned int seed = 1;
+
+    // Run the pool with helpers even on a machine with one CPU
+    setenv("OTP_ENCODE_THREADS", "4", 0);
+    plaintext = malloc(MAX_LEN);
+    key = malloc(MAX_LEN);
+    expected = malloc(MAX_LEN);
+    output = malloc(MAX_LEN);
+    if (plaintext == NULL || key == NULL || expected == NULL || output == NULL) error("checkencode: malloc");
+
+    for (i = 0; i < MAX_LEN; i++)
+    {
+        plaintext[i] = charset[rand_r(&seed) % 27];
+        key[i] = charset[rand_r(&seed) % 27];
+    }
+    for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+    {
+        // Kernels the CPU lacks fall back to the widest it has; skip those
+        setenv("OTP_ENCODER", kernels[k], 1);
+        initEncoder();
+        if (strcmp(encoderName(), kernels[k]) != 0) continue;
+        printf("checking %s\n", kernels[k]);
+        checkText(kernels[k]);
+    }
+
+    for (i = 0; i < MAX_LEN; i++)
+    {
+        plaintext[i] = (char)rand_r(&seed);
+        key[i] = (char)rand_r(&seed);
+    }
+    for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+    {
+        setenv("OTP_ENCODER", kernels[k], 1);
+        initEncoder();
+        if (strcmp(encoderName(), kernels[k]) != 0) continue;
+        printf("checking %s bytes\n", kernels[k]);
+        checkBytes(kernels[k]);
+    }
+
+    free(plaintext);
+    free(key);
+    free(expected);
+    free(output);
+    if (failures > 0)
+    {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("all encoders match encodeChecked()\n");
+    return 0;
+}
@@ -0,0 +1,138 @@
+/*********************************************************************
+** checkshm.c
+** Description: Checks that a client shrinking its shared memory ring
+* while the daemon encodes a slot only loses the ring, and doesn't
+* take the daemon down with SIGBUS. Starts ./otp_enc_d -m epoll on a
+* Unix socket with OTP_ENCODE_THREADS=4, then hands it one full slot
+* of OTP_SHM_MAX_SLOT_SIZE bytes (well past OTP_PARALLEL_MIN) at a
+* time and truncates the ring after a range of delays. Once that is
+* done the daemon must still be running and serve a ring normally.
+* Run by make check, from the top of the tree; exits 1 on failure.
+* Usage: tests/checkshm
+*********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "otpshared.h"
+#include "otpshm.h"
+
+#define SLOT_SIZE OTP_SHM_MAX_SLOT_SIZE
+
+static const useconds_t delays[] = { 0, 10, 30, 100, 300, 1000, 3000, 10000, 30000 };
+
+static int ringFD = -1; // the last ring made, kept open by shm_unlink()
+
+/*********************************************************************
+** shm_unlink()
+* Stands in for the libc one that otpShmOpen() calls once the daemon
+* has the ring, keeping the ring open first so it can be truncated.
+*********************************************************************/
+
+int shm_unlink(const char* name)
+{
+    char path[OTP_SHM_NAME_MAX + 16];
+    if (ringFD >= 0) close(ringFD);
+    ringFD = shm_open(name, O_RDWR, 0);
+    snprintf(path, sizeof(path), "/dev/shm%s", name);
+    return unlink(path);
+}
+
+/*********************************************************************
+** fillRing()
+* Fills slot 0 of a ring with len characters of text and key.
+*********************************************************************/
+
+static void fillRing(struct otpShm* shm, size_t len)
+{
+    memset(otpShmText(shm, 0), 'A', len);
+    memset(otpShmKey(shm, 0), 'B', len);
+}
+
+int main(void)
+{
+    char socketPath[64];
+    const char* port = "57399";
+    int failures = 0;
+    size_t d;
+
+    snprintf(socketPath, sizeof(socketPath), "/tmp/otpcheck-%d.sock", (int)getpid());
+    pid_t daemon = fork();
+    if (daemon == 0)
+    {
+        setenv("OTP_ENCODE_THREADS", "4", 1);
+        execl("./otp_enc_d", "otp_enc_d", "-m", "epoll", "-u", socketPath, port, (char*)NULL);
+        perror("checkshm: exec ./otp_enc_d");
+        _exit(127);
+    }
+    struct stat st;
+    int waited;
+    for (waited = 0; stat(socketPath, &st) < 0 && waited < 200; waited++)
+    {
+        usleep(10000);
+    }
+
+    for (d = 0; d < sizeof(delays) / sizeof(delays[0]); d++)
+    {
+        struct otpShm shm;
+        if (otpShmOpen(&shm, "localhost", socketPath, "ENC", 1, SLOT_SIZE) < 0)
+        {
+            fprintf(stderr, "FAIL: daemon turned the ring down before delay %u us\n", (unsigned)delays[d]);
+            failures++;
+            break;
+        }
+        fillRing(&shm, SLOT_SIZE);
+        otpShmSubmit(&shm, SLOT_SIZE);
+        usleep(delays[d]);
+        if (ftruncate(ringFD, 0) < 0) perror("checkshm: ftruncate");
+        // The ring is gone for this side too, so drop it without touching it
+        close(shm.socketFD);
+        munmap(shm.header, shm.mapSize);
+        usleep(50000);
+        if (waitpid(daemon, NULL, WNOHANG) != 0)
+        {
+            fprintf(stderr, "FAIL: daemon died when the ring was truncated after %u us\n", (unsigned)delays[d]);
+            failures++;
+            daemon = -1;
+            break;
+        }
+    }
+
+    if (daemon > 0)
+    {
+        // A ring left alone still works
+        struct otpShm shm;
+        if (otpShmOpen(&shm, "localhost", socketPath, "ENC", 1, SLOT_SIZE) < 0)
+        {
+            fprintf(stderr, "FAIL: daemon turned down a ring after the truncations\n");
+            failures++;
+        }
+        else
+        {
+            fillRing(&shm, SLOT_SIZE);
+            otpShmSubmit(&shm, SLOT_SIZE);
+            int slot = otpShmWait(&shm, OTP_IO_TIMEOUT_MS);
+            if (slot < 0 || otpShmStatus(&shm, slot) != OTP_SHM_OK || otpShmText(&shm, slot)[SLOT_SIZE - 1] != 'B')
+            {
+                fprintf(stderr, "FAIL: ring after the truncations not encoded\n");
+                failures++;
+            }
+            otpShmClose(&shm);
+        }
+        kill(daemon, SIGTERM);
+        waitpid(daemon, NULL, 0);
+    }
+    unlink(socketPath);
+    if (failures > 0)
+    {
+        return 1;
+    }
+    printf("daemon survived every truncated ring\n");
+    return 0;
+}